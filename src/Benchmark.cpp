@@ -0,0 +1,231 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#include "VoxelOctree.hpp"
+#include "FrameGovernor.hpp"
+#include "Benchmark.hpp"
+#include "Renderer.hpp"
+#include "Timer.hpp"
+
+#include "math/Mat4.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <stdio.h>
+#include <vector>
+#include <cmath>
+
+enum PathSegment {
+    SEGMENT_ORBIT,
+    SEGMENT_ZOOM,
+    SEGMENT_FLYTHROUGH,
+
+    SEGMENT_COUNT
+};
+
+static const char *SegmentNames[] = {"orbit", "zoom", "flythrough"};
+
+struct FrameResult {
+    PathSegment segment;
+    double frameTime;
+    RenderQuality quality;
+    RenderStats stats;
+};
+
+/* Builds the inverse modelview matrix for frame i of n in a path segment.
+ * Cameras follow the conventions of the viewer: the model is rotated and the
+ * camera sits on the z axis looking towards positive z.
+ */
+static Mat4 cameraTransform(PathSegment segment, int i, int n) {
+    float u = n > 1 ? i/float(n - 1) : 0.0f;
+
+    Mat4 model, view;
+    switch (segment) {
+    case SEGMENT_ORBIT:
+        model = Mat4::rotXYZ(Vec3(20.0f, 0.0f, 0.0f))*Mat4::rotXYZ(Vec3(0.0f, 360.0f*u, 0.0f));
+        view = Mat4::translate(Vec3(0.0f, 0.0f, -1.0f));
+        break;
+    case SEGMENT_ZOOM:
+        model = Mat4::rotXYZ(Vec3(10.0f, 0.0f, 0.0f))*Mat4::rotXYZ(Vec3(0.0f, 30.0f, 0.0f));
+        view = Mat4::translate(Vec3(0.0f, 0.0f, -2.0f*std::pow(0.15f, u)));
+        break;
+    case SEGMENT_FLYTHROUGH:
+    default:
+        model = Mat4::rotXYZ(Vec3(0.0f, 20.0f*u - 10.0f, 0.0f));
+        view = Mat4::translate(Vec3(0.05f, 0.02f, 2.0f*u - 1.2f));
+        break;
+    }
+
+    return model.pseudoInvert()*view;
+}
+
+static double percentile(const std::vector<double> &sorted, double p) {
+    size_t idx = size_t(std::ceil(p*sorted.size()));
+    return sorted[std::min(std::max(idx, size_t(1)), sorted.size()) - 1];
+}
+
+static bool writeCsv(const std::string &path, const std::vector<FrameResult> &frames) {
+    FILE *fp = fopen(path.c_str(), "w");
+    if (!fp)
+        return false;
+
+    fprintf(fp, "frame,segment,frame_ms,stride,lod_scale,coarse_cpu_ms,tile_cpu_ms,shadow_cpu_ms,coarse_rays,tile_rays,shadow_rays\n");
+    for (size_t i = 0; i < frames.size(); i++) {
+        const FrameResult &f = frames[i];
+        fprintf(fp, "%d,%s,%.4f,%d,%.2f,%.4f,%.4f,%.4f,%llu,%llu,%llu\n", int(i), SegmentNames[f.segment], f.frameTime*1e3,
+                f.quality.stride, f.quality.lodScale,
+                f.stats.coarseTime*1e3, f.stats.tileTime*1e3, f.stats.shadowTime*1e3,
+                (unsigned long long)f.stats.coarseRays, (unsigned long long)f.stats.tileRays,
+                (unsigned long long)f.stats.shadowRays);
+    }
+
+    bool success = !ferror(fp);
+    fclose(fp);
+    return success;
+}
+
+int runBenchmark(VoxelOctree *tree, const BenchmarkSettings &settings) {
+    std::vector<uint32> color(settings.width*settings.height);
+
+    RenderTarget target;
+    target.width  = settings.width;
+    target.height = settings.height;
+    target.pitch  = settings.width;
+    target.color  = &color[0];
+    target.depth  = 0;
+
+    Renderer renderer(tree, target);
+    FrameGovernor governor(settings.frameTime, tree->isPrefiltered());
+    renderer.setReprojection(settings.reproject);
+    renderer.setShadows(settings.shadows);
+    renderer.setSingleRays(settings.singleRays);
+
+    for (int i = 0; i < settings.warmupFrames; i++)
+        renderer.render(cameraTransform(SEGMENT_ORBIT, 0, 1));
+
+    std::vector<FrameResult> frames;
+    for (int s = 0; s < SEGMENT_COUNT; s++) {
+        for (int i = 0; i < settings.segmentFrames; i++) {
+            Mat4 tform = cameraTransform(PathSegment(s), i, settings.segmentFrames);
+
+            RenderQuality quality;
+            if (settings.frameTime > 0.0)
+                quality = governor.nextFrame(true);
+
+            Timer frameTimer;
+            renderer.render(tform, quality);
+            frameTimer.stop();
+            governor.frameDone(frameTimer.elapsed());
+
+            FrameResult result;
+            result.segment = PathSegment(s);
+            result.frameTime = frameTimer.elapsed();
+            result.quality = quality;
+            result.stats = renderer.stats();
+            frames.push_back(result);
+        }
+    }
+
+    std::cout << "Benchmark: " << settings.width << "x" << settings.height << ", " << settings.threads
+              << " threads, " << settings.segmentFrames << " frames per segment, "
+              << isaName(traversalKernels().isa) << " kernels" << std::endl;
+    if (settings.reproject)
+        std::cout << "Reprojecting depth from the previous frame" << std::endl;
+    if (settings.frameTime > 0.0)
+        std::cout << "Adaptive quality aiming for " << settings.frameTime*1e3 << " ms per frame" << std::endl;
+    if (settings.singleRays)
+        std::cout << "Tracing primary rays one at a time" << std::endl;
+    if (settings.shadows == SHADOWS_PACKETS)
+        std::cout << "Tracing shadow rays in packets" << std::endl;
+    else if (settings.shadows == SHADOWS_SINGLE_RAYS)
+        std::cout << "Tracing shadow rays one at a time" << (tree->hasRopes() ? ", following neighbor links" : "") << std::endl;
+    if (tree->hasTopGrid())
+        std::cout << "Stepping through the upper levels with the top grid" << std::endl;
+
+    FILE *json = 0;
+    if (!settings.jsonFile.empty()) {
+        json = fopen(settings.jsonFile.c_str(), "w");
+        if (!json) {
+            std::cout << "Failed to write " << settings.jsonFile << std::endl;
+            return 1;
+        }
+        fprintf(json, "{\n  \"width\": %d,\n  \"height\": %d,\n  \"threads\": %d,\n  \"isa\": \"%s\",\n  \"segments\": {\n",
+                settings.width, settings.height, settings.threads, isaName(traversalKernels().isa));
+    }
+
+    /* The last entry summarizes the whole path */
+    for (int s = 0; s <= SEGMENT_COUNT; s++) {
+        const char *name = s < SEGMENT_COUNT ? SegmentNames[s] : "total";
+
+        std::vector<double> times;
+        RenderStats stats;
+        double totalTime = 0.0, totalStride = 0.0;
+        for (size_t i = 0; i < frames.size(); i++) {
+            if (s < SEGMENT_COUNT && frames[i].segment != s)
+                continue;
+            times.push_back(frames[i].frameTime*1e3);
+            stats += frames[i].stats;
+            totalTime += frames[i].frameTime;
+            totalStride += frames[i].quality.stride;
+        }
+        if (times.empty())
+            continue;
+        std::sort(times.begin(), times.end());
+
+        double raysPerSecond = double(stats.coarseRays + stats.tileRays + stats.shadowRays)/totalTime;
+        double coarseFraction = stats.coarseTime/std::max(stats.coarseTime + stats.tileTime, 1e-9);
+
+        printf("  %-10s  mean %7.2f ms  p50 %7.2f  p90 %7.2f  p99 %7.2f  max %7.2f  %7.2f Mrays/s  coarse %4.1f%%\n",
+                name, totalTime*1e3/times.size(), percentile(times, 0.5), percentile(times, 0.9),
+                percentile(times, 0.99), times.back(), raysPerSecond*1e-6, coarseFraction*100.0);
+        if (settings.frameTime > 0.0)
+            printf("  %-10s  mean stride %.2f\n", "", totalStride/times.size());
+        /* Per thread, since the time is summed over all of them */
+        if (stats.shadowRays)
+            printf("  %-10s  shadow rays %7.2f Mrays/s per thread, %4.1f%% of the tile time\n", "",
+                    stats.shadowRays/std::max(stats.shadowTime, 1e-9)*1e-6,
+                    stats.shadowTime/std::max(stats.tileTime, 1e-9)*100.0);
+
+        if (json) {
+            fprintf(json, "    \"%s\": {\"frames\": %d, \"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p90_ms\": %.4f, "
+                    "\"p99_ms\": %.4f, \"max_ms\": %.4f, \"rays_per_sec\": %.1f, \"coarse_cpu_ms\": %.4f, \"tile_cpu_ms\": %.4f, "
+                    "\"shadow_cpu_ms\": %.4f, \"shadow_rays\": %llu, \"mean_stride\": %.3f}%s\n",
+                    name, int(times.size()), totalTime*1e3/times.size(), percentile(times, 0.5), percentile(times, 0.9),
+                    percentile(times, 0.99), times.back(), raysPerSecond, stats.coarseTime*1e3, stats.tileTime*1e3,
+                    stats.shadowTime*1e3, (unsigned long long)stats.shadowRays, totalStride/times.size(),
+                    s < SEGMENT_COUNT ? "," : "");
+        }
+    }
+
+    if (json) {
+        fprintf(json, "  }\n}\n");
+        fclose(json);
+    }
+    if (!settings.csvFile.empty() && !writeCsv(settings.csvFile, frames)) {
+        std::cout << "Failed to write " << settings.csvFile << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,75 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#ifndef BENCHMARK_HPP_
+#define BENCHMARK_HPP_
+
+#include "CpuFeatures.hpp"
+#include "Renderer.hpp"
+
+#include <string>
+
+class VoxelOctree;
+
+struct BenchmarkSettings {
+    int width, height;
+    int threads;
+    /* Number of frames rendered for each segment of the camera path */
+    int segmentFrames;
+    /* Frames rendered before measuring starts, to warm up caches and threads */
+    int warmupFrames;
+    /* If positive, frames are rendered at the quality the viewer would pick
+     * while the camera moves, aiming for this frame time in seconds */
+    double frameTime;
+    /* Seed the starting distances of each frame from the one before */
+    bool reproject;
+    ShadowMode shadows;
+    /* Trace primary rays one at a time, see Renderer::setSingleRays */
+    bool singleRays;
+    /* Link the nodes to their neighbors before rendering, see VoxelOctree::buildRopes */
+    bool ropes;
+    /* Build the occupancy pyramid before rendering, see VoxelOctree::buildTopGrid */
+    bool topGrid;
+    /* Best instruction set the traversal kernels may use */
+    CpuIsa isa;
+    std::string csvFile;
+    std::string jsonFile;
+
+    BenchmarkSettings()
+    : width(1280), height(720), threads(0), segmentFrames(60), warmupFrames(5), frameTime(0.0), reproject(false),
+      shadows(SHADOWS_NONE), singleRays(false), ropes(false), topGrid(false), isa(ISA_AVX512)
+    {
+    }
+};
+
+/* Renders a fixed camera path (orbit, zoom-in and fly-through) over the
+ * octree and reports frame time percentiles, rays per second and the time
+ * spent in the coarse pass versus the per-pixel tile pass, as well as the
+ * rate of shadow rays if there are any. The thread pool must already be
+ * running with the desired number of threads, and the neighbor links must
+ * already be built if the settings ask for them.
+ */
+int runBenchmark(VoxelOctree *tree, const BenchmarkSettings &settings);
+
+#endif /* BENCHMARK_HPP_ */
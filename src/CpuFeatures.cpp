@@ -0,0 +1,120 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#include "CpuFeatures.hpp"
+
+#include <cctype>
+
+#ifdef CPU_X86
+# ifdef _MSC_VER
+#  include <intrin.h>
+#  include <immintrin.h>
+# else
+#  include <cpuid.h>
+# endif
+
+static void cpuid(int leaf, int subleaf, unsigned regs[4]) {
+#ifdef _MSC_VER
+    int info[4];
+    __cpuidex(info, leaf, subleaf);
+    for (int i = 0; i < 4; i++)
+        regs[i] = unsigned(info[i]);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+/* Register state the operating system saves on context switches */
+static unsigned long long xgetbv() {
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (unsigned long long)hi << 32 | lo;
+#endif
+}
+#endif
+
+CpuIsa detectCpuIsa() {
+#ifdef CPU_X86
+    unsigned regs[4];
+    cpuid(0, 0, regs);
+    unsigned maxLeaf = regs[0];
+    if (maxLeaf < 1)
+        return ISA_BASELINE;
+
+    cpuid(1, 0, regs);
+    bool sse42   = (regs[2] & (1u << 20)) != 0;
+    bool popcnt  = (regs[2] & (1u << 23)) != 0;
+    bool osxsave = (regs[2] & (1u << 27)) != 0;
+    bool avx     = (regs[2] & (1u << 28)) != 0;
+    if (!sse42 || !popcnt)
+        return ISA_BASELINE;
+
+    /* AVX registers are only usable if the OS saves the upper halves */
+    if (!osxsave || !avx || maxLeaf < 7)
+        return ISA_SSE42;
+    unsigned long long xcr0 = xgetbv();
+    if ((xcr0 & 0x6) != 0x6)
+        return ISA_SSE42;
+
+    cpuid(7, 0, regs);
+    bool avx2 = (regs[1] & (1u <<  5)) != 0;
+    bool bmi1 = (regs[1] & (1u <<  3)) != 0;
+    bool bmi2 = (regs[1] & (1u <<  8)) != 0;
+    if (!avx2 || !bmi1 || !bmi2)
+        return ISA_SSE42;
+
+    /* Opmask and both halves of the upper 16 ZMM registers */
+    if ((xcr0 & 0xE0) != 0xE0)
+        return ISA_AVX2;
+    const unsigned avx512 = (1u << 16) | (1u << 17) | (1u << 28) | (1u << 30) | (1u << 31);
+    if ((regs[1] & avx512) != avx512)
+        return ISA_AVX2;
+
+    return ISA_AVX512;
+#else
+    return ISA_BASELINE;
+#endif
+}
+
+static const char *IsaNames[] = {"baseline", "sse4.2", "avx2", "avx512"};
+
+const char *isaName(CpuIsa isa) {
+    return IsaNames[isa];
+}
+
+bool parseIsa(const std::string &name, CpuIsa &isa) {
+    std::string lower(name);
+    for (size_t i = 0; i < lower.size(); i++)
+        lower[i] = char(std::tolower((unsigned char)lower[i]));
+
+    for (int i = ISA_BASELINE; i <= ISA_AVX512; i++) {
+        if (lower == IsaNames[i]) {
+            isa = CpuIsa(i);
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,54 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef CPUFEATURES_HPP_
+#define CPUFEATURES_HPP_
+
+#include <string>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+# define CPU_X86
+#endif
+
+/* Instruction set levels that kernels are compiled for, ordered so that
+ * every level includes the ones before it. The baseline is whatever the rest
+ * of the program is compiled for, i.e. SSE2 on x86-64.
+ */
+enum CpuIsa {
+    ISA_BASELINE,
+    /* SSE4.2 and POPCNT */
+    ISA_SSE42,
+    /* AVX2, BMI1 and BMI2 */
+    ISA_AVX2,
+    /* AVX-512 F, CD, BW, DQ and VL */
+    ISA_AVX512
+};
+
+/* Best level that the CPU and the operating system both support */
+CpuIsa detectCpuIsa();
+
+const char *isaName(CpuIsa isa);
+/* Accepts the names returned by isaName in any case */
+bool parseIsa(const std::string &name, CpuIsa &isa);
+
+#endif /* CPUFEATURES_HPP_ */
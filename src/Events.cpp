@@ -86,10 +86,15 @@ int waitEvent() {
     return event.type;
 }
 
-void checkEvents() {
+bool checkEvents() {
+    bool processed = false;
     SDL_Event event;
-    while (SDL_PollEvent(&event))
+    while (SDL_PollEvent(&event)) {
         processEvent(event);
+        processed = true;
+    }
+
+    return processed;
 }
 
 int getMouseX() {
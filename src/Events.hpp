@@ -24,7 +24,7 @@ freely, subject to the following restrictions:
 #ifndef EVENTS_HPP_
 #define EVENTS_HPP_
 
-void checkEvents();
+bool checkEvents();
 int waitEvent();
 int getMouseX();
 int getMouseY();
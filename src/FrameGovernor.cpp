@@ -0,0 +1,108 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#include "FrameGovernor.hpp"
+
+#include <algorithm>
+
+struct QualityStep {
+    int stride;
+    float lodScale;
+    /* Expected cost relative to a full quality frame */
+    double cost;
+    /* Only differs from the previous step on prefiltered octrees */
+    bool lodOnly;
+};
+
+/* Ordered from full quality to the cheapest setting. Costs follow the number
+ * of primary rays; a coarser LOD cutoff saves about a third of the traversal
+ * on prefiltered octrees */
+static const QualityStep Steps[] = {
+    {1, 1.0f, 1.0,        false},
+    {1, 2.0f, 0.7,        true},
+    {2, 1.0f, 1.0/4.0,    false},
+    {2, 2.0f, 0.7/4.0,    true},
+    {3, 1.0f, 1.0/9.0,    false},
+    {3, 2.0f, 0.7/9.0,    true},
+    {4, 2.0f, 0.7/16.0,   false},
+    {6, 2.0f, 0.7/36.0,   false},
+    {8, 2.0f, 0.7/64.0,   false},
+};
+static const int StepCount = sizeof(Steps)/sizeof(Steps[0]);
+
+/* Weight of the newest frame in the estimate of the full quality frame time */
+static const double EstimateWeight = 0.5;
+/* Only move to a finer step while moving if it is expected to stay this far
+ * below the target, so that the governor does not oscillate between two steps */
+static const double RefineMargin = 0.8;
+
+FrameGovernor::FrameGovernor(double targetTime, bool prefiltered)
+: _targetTime(targetTime),
+  _prefiltered(prefiltered),
+  _step(0),
+  _fullTime(0.0)
+{
+}
+
+int FrameGovernor::coarserStep(int step) const {
+    do
+        step++;
+    while (step < StepCount - 1 && Steps[step].lodOnly && !_prefiltered);
+    return std::min(step, StepCount - 1);
+}
+
+int FrameGovernor::finerStep(int step) const {
+    do
+        step--;
+    while (step > 0 && Steps[step].lodOnly && !_prefiltered);
+    return std::max(step, 0);
+}
+
+RenderQuality FrameGovernor::nextFrame(bool moving) {
+    if (!moving) {
+        _step = finerStep(_step);
+    } else {
+        int step = 0;
+        while (step < StepCount - 1 && Steps[step].cost*_fullTime > _targetTime)
+            step = coarserStep(step);
+
+        while (step < _step && Steps[step].cost*_fullTime > _targetTime*RefineMargin)
+            step = coarserStep(step);
+        _step = step;
+    }
+
+    return RenderQuality(Steps[_step].stride, Steps[_step].lodScale);
+}
+
+void FrameGovernor::frameDone(double time) {
+    double fullTime = time/Steps[_step].cost;
+    if (_fullTime == 0.0)
+        _fullTime = fullTime;
+    else
+        _fullTime += (fullTime - _fullTime)*EstimateWeight;
+}
+
+bool FrameGovernor::isRefined() const {
+    return _step == 0;
+}
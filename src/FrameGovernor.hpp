@@ -0,0 +1,65 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#ifndef FRAMEGOVERNOR_HPP_
+#define FRAMEGOVERNOR_HPP_
+
+#include "Renderer.hpp"
+
+/* Picks the quality of each frame from the time the previous frames took.
+ * While the camera moves, it chooses the finest quality that is expected to
+ * render within the target frame time; once the camera stops, every further
+ * frame is rendered one step finer until the image is at full quality.
+ *
+ * Qualities are taken from a fixed ladder of strides and LOD scales ordered
+ * by cost. The time of a full quality frame is estimated from each measured
+ * frame, so the governor adapts to the machine and the view within a few
+ * frames.
+ */
+class FrameGovernor {
+    double _targetTime;
+    bool _prefiltered;
+
+    int _step;
+    /* Smoothed estimate of the time a full quality frame of the current view takes */
+    double _fullTime;
+
+    int coarserStep(int step) const;
+    int finerStep(int step) const;
+
+public:
+    /* targetTime is given in seconds. LOD steps are skipped for octrees that
+     * are not prefiltered, since they would not make frames any cheaper */
+    FrameGovernor(double targetTime, bool prefiltered);
+
+    /* Quality of the next frame. moving is true if the view changed since the last frame */
+    RenderQuality nextFrame(bool moving);
+    /* Reports the time the frame rendered with the last returned quality took, in seconds */
+    void frameDone(double time);
+
+    /* True if the last returned quality is full quality */
+    bool isRefined() const;
+};
+
+#endif /* FRAMEGOVERNOR_HPP_ */
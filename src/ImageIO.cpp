@@ -0,0 +1,90 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#include "ImageIO.hpp"
+#include "Renderer.hpp"
+
+#include <memory>
+#include <stdio.h>
+
+static bool isLittleEndian() {
+    uint32 one = 1;
+    return *reinterpret_cast<const uint8 *>(&one) == 1;
+}
+
+bool savePpm(const char *path, const uint32 *pixels, int width, int height, int pitch) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+
+    std::unique_ptr<uint8[]> row(new uint8[width*3]);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            Vec3 c = unpackColor(pixels[x + y*pitch]);
+            row[x*3 + 0] = uint8(c.x*255.0f + 0.5f);
+            row[x*3 + 1] = uint8(c.y*255.0f + 0.5f);
+            row[x*3 + 2] = uint8(c.z*255.0f + 0.5f);
+        }
+        fwrite(row.get(), sizeof(uint8), width*3, fp);
+    }
+
+    bool success = !ferror(fp);
+    fclose(fp);
+    return success;
+}
+
+static bool savePfm(const char *path, const float *data, int channels, int width, int height, int pitch) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+
+    /* A negative scale marks little endian data */
+    fprintf(fp, "%s\n%d %d\n%s\n", channels == 3 ? "PF" : "Pf", width, height, isLittleEndian() ? "-1.0" : "1.0");
+    for (int y = height - 1; y >= 0; y--)
+        fwrite(data + y*pitch*channels, sizeof(float), width*channels, fp);
+
+    bool success = !ferror(fp);
+    fclose(fp);
+    return success;
+}
+
+bool savePfm(const char *path, const uint32 *pixels, int width, int height, int pitch) {
+    std::unique_ptr<float[]> data(new float[width*height*3]);
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            Vec3 c = unpackColor(pixels[x + y*pitch]);
+            data[(x + y*width)*3 + 0] = c.x;
+            data[(x + y*width)*3 + 1] = c.y;
+            data[(x + y*width)*3 + 2] = c.z;
+        }
+    }
+
+    return savePfm(path, data.get(), 3, width, height, width);
+}
+
+bool saveDepthPfm(const char *path, const float *depth, int width, int height, int pitch) {
+    return savePfm(path, depth, 1, width, height, pitch);
+}
@@ -0,0 +1,40 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#ifndef IMAGEIO_HPP_
+#define IMAGEIO_HPP_
+
+#include "IntTypes.hpp"
+
+/* Image writers for the headless renderer. Pixels are in the packed format
+ * produced by packColor; pitch is given in pixels. PFM files are stored
+ * bottom-up as required by the format. All functions return false if the
+ * file could not be written.
+ */
+bool savePpm(const char *path, const uint32 *pixels, int width, int height, int pitch);
+bool savePfm(const char *path, const uint32 *pixels, int width, int height, int pitch);
+/* Writes a single channel greyscale PFM */
+bool saveDepthPfm(const char *path, const float *depth, int width, int height, int pitch);
+
+#endif /* IMAGEIO_HPP_ */
@@ -22,13 +22,13 @@ freely, subject to the following restrictions:
 */
 
 
-#include "ThreadBarrier.hpp"
 #include "VoxelOctree.hpp"
 #include "PlyLoader.hpp"
 #include "VoxelData.hpp"
-#include "Events.hpp"
+#include "Benchmark.hpp"
+#include "Renderer.hpp"
+#include "ImageIO.hpp"
 #include "Timer.hpp"
-#include "Util.hpp"
 
 #include "thread/ThreadUtils.hpp"
 #include "thread/ThreadPool.hpp"
@@ -37,270 +37,641 @@ freely, subject to the following restrictions:
 #include "math/Vec3.hpp"
 #include "math/Mat4.hpp"
 
+#ifdef HAVE_SDL
+#include "Viewer.hpp"
+#endif
+
 #include <algorithm>
 #include <stdlib.h>
 #include <iostream>
 #include <stdio.h>
-#include <cstring>
-#include <atomic>
 #include <memory>
 #include <vector>
 #include <string>
-#include <cmath>
+#ifdef HAVE_SDL
 #include <SDL.h>
-
-#ifndef M_PI
-#define M_PI        3.14159265358979323846
 #endif
 
-/* Number of threads to use - adapt this to your platform for optimal results */
-static const int NumThreads = 16;
-/* Screen resolution */
-static const int GWidth  = 1280;
-static const int GHeight = 720;
+/* Maximum allowed memory allocation sizes for lookup table and cache blocks.
+ * Larger => faster conversion usually, but adapt this to your own RAM size.
+ * The conversion will still succeed with memory sizes much, much smaller than
+ * the size of the voxel data, only slower.
+ */
+static const size_t dataMemory = int64_t(1024)*1024*1024;
+
+void printHelp() {
+    std::cout << "Usage: sparse-voxel-octrees [options] filename ..." << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "-builder              set program to SVO building mode." << std::endl;
+    std::cout << "  --resolution <r>    set voxel resolution. r is an integer which equals to a power of 2." << std::endl;
+    std::cout << "  --mode <m>          set where to generate voxel data, m equals 0 or 1, where 0 indicates GENERATE_IN_MEMORY while 1 indicates GENERATE_ON_DISK." << std::endl;
+    std::cout << "  --exact             compute the final octree layout before writing any nodes. Halves peak memory of the octree, but loads the voxel data twice if it does not fit into one cache block." << std::endl;
+    std::cout << "  --stream <mb>       write the octree to disk while it is built, keeping only about mb megabytes of it in memory. Implies --exact." << std::endl;
+    std::cout << "  --uncompressed      write an uncompressed octree that is memory mapped when loaded." << std::endl;
+    std::cout << "  --block-size <kb>   split the file into blocks of kb kilobytes, a power of two. Paged octrees are loaded one block at a time. Defaults to 4096." << std::endl;
+    std::cout << "  --dag               merge identical subtrees into a directed acyclic graph before saving. Needs the whole octree in memory." << std::endl;
+    std::cout << "  --separate-attributes store leaf materials in an array behind the nodes. Needs the whole octree in memory." << std::endl;
+    std::cout << "  --geometry-only     drop leaf materials, e.g. for collision or visibility queries. Needs the whole octree in memory." << std::endl;
+    std::cout << "  --prefilter         store averaged materials in interior nodes, so that distant parts of the model are rendered at a coarser level of detail. Needs the whole octree in memory." << std::endl;
+    std::cout << "  --bricks            replace the three levels of nodes above the leaves by dense bricks of 8x8x8 voxels wherever that saves space. Needs the whole octree in memory." << std::endl;
+    std::cout << "  --relayout          reorder the nodes so that the upper levels of every subtree share cache lines. Needs the whole octree in memory." << std::endl;
+    std::cout << "-convert              rewrite an existing octree file in the current format." << std::endl;
+    std::cout << "  --uncompressed      write an uncompressed octree that is memory mapped when loaded." << std::endl;
+    std::cout << "  --block-size <kb>   split the file into blocks of kb kilobytes, a power of two. Paged octrees are loaded one block at a time. Defaults to 4096." << std::endl;
+    std::cout << "  --dag               merge identical subtrees into a directed acyclic graph." << std::endl;
+    std::cout << "  --separate-attributes store leaf materials in an array behind the nodes." << std::endl;
+    std::cout << "  --geometry-only     drop leaf materials, e.g. for collision or visibility queries." << std::endl;
+    std::cout << "  --prefilter         store averaged materials in interior nodes, so that distant parts of the model are rendered at a coarser level of detail." << std::endl;
+    std::cout << "  --bricks            replace the three levels of nodes above the leaves by dense bricks of 8x8x8 voxels wherever that saves space. Only works with interleaved materials without --prefilter." << std::endl;
+    std::cout << "  --relayout          reorder the nodes so that the upper levels of every subtree share cache lines. Cannot be combined with --dag." << std::endl;
+    std::cout << "-viewer               set program to SVO rendering mode." << std::endl;
+    std::cout << "  --cache <mb>        load the octree on demand, keeping at most mb megabytes of it in memory." << std::endl;
+    std::cout << "  --frame-time <ms>   lower the quality while the camera moves so that frames take about ms milliseconds. Defaults to 33." << std::endl;
+    std::cout << "  --top-grid          record the upper six levels in a bit pyramid after loading, which rays step through without reading nodes." << std::endl;
+    std::cout << "-render               render images without opening a window." << std::endl;
+    std::cout << "  --width <w>         set image width. Defaults to 1280." << std::endl;
+    std::cout << "  --height <h>        set image height. Defaults to 720." << std::endl;
+    std::cout << "  --camera <p> <y> <r> add a camera with pitch and yaw in degrees and distance r to the model center. Each camera renders one frame." << std::endl;
+    std::cout << "  --output <file>     write color to a .ppm or .pfm file. Frames are numbered if more than one camera is given." << std::endl;
+    std::cout << "  --depth <file>      write depth to a .pfm file." << std::endl;
+    std::cout << "  --half              trace one ray per 3x3 pixel block, like a reduced quality frame of the viewer." << std::endl;
+    std::cout << "  --cache <mb>        load the octree on demand, keeping at most mb megabytes of it in memory. Frames are refined until all visible nodes are loaded." << std::endl;
+    std::cout << "  --shadows <mode>    trace a shadow ray from every hit, either in packets or one ray at a time. mode is packets or rays." << std::endl;
+    std::cout << "  --ropes             link every node to its neighbors after loading, which speeds up shadow rays traced one at a time." << std::endl;
+    std::cout << "  --top-grid          record the upper six levels in a bit pyramid after loading, which rays step through without reading nodes." << std::endl;
+    std::cout << "  --isa <name>        trace with kernels for at most this instruction set: baseline, sse4.2, avx2 or avx512. Defaults to the best one of the CPU." << std::endl;
+    std::cout << "-benchmark            render a fixed camera path and report timings." << std::endl;
+    std::cout << "  --width <w>         set image width. Defaults to 1280." << std::endl;
+    std::cout << "  --height <h>        set image height. Defaults to 720." << std::endl;
+    std::cout << "  --threads <n>       set number of render threads, including the main thread. Defaults to the number of cores." << std::endl;
+    std::cout << "  --frames <n>        set number of frames per path segment. Defaults to 60." << std::endl;
+    std::cout << "  --warmup <n>        set number of untimed frames rendered first. Defaults to 5." << std::endl;
+    std::cout << "  --frame-time <ms>   pick the quality of each frame like the viewer does while the camera moves." << std::endl;
+    std::cout << "  --reproject         start the rays of each frame from the depth of the previous one, like the viewer does." << std::endl;
+    std::cout << "  --shadows <mode>    trace a shadow ray from every hit, either in packets or one ray at a time. mode is packets or rays." << std::endl;
+    std::cout << "  --single-rays       trace primary rays one at a time instead of in packets, to measure what the packets gain." << std::endl;
+    std::cout << "  --ropes             link every node to its neighbors after loading, which speeds up shadow rays traced one at a time." << std::endl;
+    std::cout << "  --top-grid          record the upper six levels in a bit pyramid after loading, which rays step through without reading nodes." << std::endl;
+    std::cout << "  --csv <file>        write per-frame timings to a CSV file." << std::endl;
+    std::cout << "  --json <file>       write a timing summary to a JSON file." << std::endl;
+    std::cout << "  --isa <name>        trace with kernels for at most this instruction set: baseline, sse4.2, avx2 or avx512. Defaults to the best one of the CPU." << std::endl;
+    std::cout << "-query                trace the rays listed in a text file and write their hits to another one." << std::endl;
+    std::cout << "  --any-hit           only report whether each ray hits anything." << std::endl;
+    std::cout << "  --check             also trace every ray on its own and report the rays whose hits differ." << std::endl;
+    std::cout << "  --ropes             link every node to its neighbors after loading, which --check then follows." << std::endl;
+    std::cout << "  --top-grid          record the upper six levels in a bit pyramid after loading, which rays step through without reading nodes." << std::endl;
+    std::cout << "  --isa <name>        trace with kernels for at most this instruction set: baseline, sse4.2, avx2 or avx512. Defaults to the best one of the CPU." << std::endl << std::endl;
+    std::cout << "Examples:" << std::endl;
+    std::cout << "  sparse-voxel-octrees -builder --resolution 256 --mode 0 ../models/xyzrgb_dragon.ply ../models/xyzrgb_dragon.oct" << std::endl;
+    std::cout << "  sparse-voxel-octrees -builder ../models/xyzrgb_dragon.ply ../models/xyzrgb_dragon.oct" << std::endl;
+    std::cout << "  sparse-voxel-octrees -convert --uncompressed ../models/XYZRGB-Dragon.oct ../models/XYZRGB-Dragon-mapped.oct" << std::endl;
+    std::cout << "  sparse-voxel-octrees -viewer ../models/XYZRGB-Dragon.oct" << std::endl;
+    std::cout << "  sparse-voxel-octrees -viewer --cache 512 ../models/XYZRGB-Dragon.oct" << std::endl;
+    std::cout << "  sparse-voxel-octrees -render --camera 20 45 1 --output dragon.ppm --depth dragon.pfm ../models/XYZRGB-Dragon.oct" << std::endl;
+    std::cout << "  sparse-voxel-octrees -benchmark --threads 8 --csv frames.csv --json summary.json ../models/XYZRGB-Dragon.oct" << std::endl;
+    std::cout << "  sparse-voxel-octrees -query --check ../models/XYZRGB-Dragon.oct rays.txt hits.txt" << std::endl << std::endl << std::endl;
+}
+
+struct BuilderSettings {
+    unsigned int resolution;
+    unsigned int mode;
+    OctreeLayout layout;
+    /* Octree memory budget in bytes when streaming to disk, 0 to build in memory */
+    size_t streamBudget;
+    bool compress;
+    /* Words per file block, which is also the unit in which paged octrees are loaded */
+    uint64 blockSize;
+    bool dag;
+    AttributeLayout attributes;
+    bool prefilter;
+    bool bricks;
+    bool relayout;
+
+    BuilderSettings() : resolution(256), mode(0), layout(LAYOUT_INSERTION), streamBudget(0), compress(true),
+            blockSize(OctreeFile::DefaultBlockSize), dag(false), attributes(ATTRIBUTES_INTERLEAVED), prefilter(false), bricks(false), relayout(false) {}
+
+    /* Whether the octree has to be rewritten after it was built */
+    bool needsConversion() const {
+        return dag || attributes != ATTRIBUTES_INTERLEAVED || prefilter || bricks || relayout;
+    }
+};
 
-static const float AspectRatio = GHeight/(float)GWidth;
-static const int TileSize = 8;
+/* Parses the options between the mode and the input and output files */
+static bool parseBuilderSettings(int argc, char *argv[], BuilderSettings &settings) {
+    for (int i = 2; i < argc - 2; i++) {
+        std::string arg(argv[i]);
+        bool hasValue = i + 1 < argc - 2;
+        if (arg == "--resolution" && hasValue)
+            settings.resolution = atoi(argv[++i]);
+        else if (arg == "--mode" && hasValue)
+            settings.mode = atoi(argv[++i]);
+        else if (arg == "--exact")
+            settings.layout = LAYOUT_EXACT;
+        else if (arg == "--stream" && hasValue)
+            settings.streamBudget = size_t(atoi(argv[++i]))*1024*1024;
+        else if (arg == "--uncompressed")
+            settings.compress = false;
+        else if (arg == "--block-size" && hasValue) {
+            /* Pages are addressed with shifts, so the size has to be a power of two */
+            uint64 kilobytes = uint64(atoi(argv[++i]));
+            if (kilobytes == 0 || (kilobytes & (kilobytes - 1)) || kilobytes > 1024*1024)
+                return false;
+            settings.blockSize = kilobytes*1024/sizeof(uint32);
+        }
+        else if (arg == "--dag")
+            settings.dag = true;
+        else if (arg == "--separate-attributes")
+            settings.attributes = ATTRIBUTES_SEPARATE;
+        else if (arg == "--geometry-only")
+            settings.attributes = ATTRIBUTES_NONE;
+        else if (arg == "--prefilter")
+            settings.prefilter = true;
+        else if (arg == "--bricks")
+            settings.bricks = true;
+        else if (arg == "--relayout")
+            settings.relayout = true;
+        else
+            return false;
+    }
 
-static SDL_Surface *backBuffer;
-static ThreadBarrier *barrier;
+    return true;
+}
 
-static std::atomic<bool> doTerminate;
-static std::atomic<bool> renderHalfSize;
+/* Returns false as soon as one of the conversions fails, which has printed
+ * the reason. The octree must not be saved then */
+static bool convertOctree(VoxelOctree *tree, const BuilderSettings &settings) {
+    if (settings.dag && !tree->convertToDag())
+        return false;
+    if (settings.attributes != ATTRIBUTES_INTERLEAVED && !tree->convertAttributes(settings.attributes))
+        return false;
+    if (settings.prefilter && !tree->prefilterAttributes())
+        return false;
+    if (settings.bricks && !tree->convertToBricks())
+        return false;
+    /* Every conversion above writes the nodes in depth first order again */
+    if (settings.relayout && !tree->relayout())
+        return false;
+    return true;
+}
 
-struct BatchData {
-    int id;
-    int x0, y0;
-    int x1, y1;
+static bool buildOctreeFile(VoxelData *data, const BuilderSettings &settings, const std::string &outputFile) {
+    if (settings.streamBudget && !settings.needsConversion())
+        return VoxelOctree::buildToFile(data, outputFile.c_str(), settings.streamBudget, settings.compress,
+                settings.blockSize);
+
+    if (settings.streamBudget)
+        std::cout << "Converting the octree needs all of it in memory, ignoring --stream" << std::endl;
+    std::unique_ptr<VoxelOctree> tree(new VoxelOctree(data, settings.layout));
+    if (!convertOctree(tree.get(), settings))
+        return false;
+    tree->save(outputFile.c_str(), settings.compress, settings.blockSize);
+    return true;
+}
 
-    int tilesX, tilesY;
-    float *depthBuffer;
-    VoxelOctree *tree;
+struct Camera {
+    float pitch, yaw, radius;
 };
 
-Vec3 shade(int intNormal, const Vec3 &ray, const Vec3 &light) {
-    Vec3 n;
-    float c;
-    decompressMaterial(intNormal, n, c);
+struct RenderSettings {
+    int width, height;
+    bool halfSize;
+    std::vector<Camera> cameras;
+    std::string colorFile;
+    std::string depthFile;
+    /* Page cache size in bytes, 0 to load the whole octree */
+    size_t cacheSize;
+    /* Frame time the viewer aims for while the camera moves, in seconds */
+    double frameTime;
+    ShadowMode shadows;
+    /* Link the nodes to their neighbors after loading, see VoxelOctree::buildRopes */
+    bool ropes;
+    /* Build the occupancy pyramid after loading, see VoxelOctree::buildTopGrid */
+    bool topGrid;
+    /* Best instruction set the traversal kernels may use */
+    CpuIsa isa;
+
+    RenderSettings() : width(1280), height(720), halfSize(false), cacheSize(0), frameTime(1.0/30.0),
+            shadows(SHADOWS_NONE), ropes(false), topGrid(false), isa(ISA_AVX512) {}
+};
 
-    float d = std::max(light.dot(ray.reflect(n)), 0.0f);
-    float specular = d*d;
+static bool parseShadowMode(const std::string &name, ShadowMode &mode) {
+    if (name == "packets")
+        mode = SHADOWS_PACKETS;
+    else if (name == "rays")
+        mode = SHADOWS_SINGLE_RAYS;
+    else
+        return false;
+    return true;
+}
 
-    return c*0.9f*std::abs(light.dot(n)) + specular*0.2f;
+/* Parses the options between the mode and the input file. Returns false on malformed input */
+static bool parseRenderSettings(int argc, char *argv[], RenderSettings &settings) {
+    for (int i = 2; i < argc - 1; i++) {
+        std::string arg(argv[i]);
+        int remaining = argc - 2 - i;
+        if (arg == "--width" && remaining >= 1)
+            settings.width = atoi(argv[++i]);
+        else if (arg == "--height" && remaining >= 1)
+            settings.height = atoi(argv[++i]);
+        else if (arg == "--camera" && remaining >= 3) {
+            Camera camera;
+            camera.pitch  = float(atof(argv[++i]));
+            camera.yaw    = float(atof(argv[++i]));
+            camera.radius = float(atof(argv[++i]));
+            settings.cameras.push_back(camera);
+        } else if (arg == "--output" && remaining >= 1)
+            settings.colorFile = argv[++i];
+        else if (arg == "--depth" && remaining >= 1)
+            settings.depthFile = argv[++i];
+        else if (arg == "--half")
+            settings.halfSize = true;
+        else if (arg == "--cache" && remaining >= 1)
+            settings.cacheSize = size_t(atoi(argv[++i]))*1024*1024;
+        else if (arg == "--shadows" && remaining >= 1) {
+            if (!parseShadowMode(argv[++i], settings.shadows))
+                return false;
+        } else if (arg == "--ropes")
+            settings.ropes = true;
+        else if (arg == "--top-grid")
+            settings.topGrid = true;
+        else if (arg == "--isa" && remaining >= 1) {
+            if (!parseIsa(argv[++i], settings.isa))
+                return false;
+        } else
+            return false;
+    }
+    if (settings.cameras.empty()) {
+        Camera camera = {0.0f, 0.0f, 1.0f};
+        settings.cameras.push_back(camera);
+    }
+
+    return settings.width > 0 && settings.height > 0;
 }
 
-void renderTile(int x0, int y0, int x1, int y1, int stride, float scale, float zx, float zy, float zz,
-        const Mat4 &tform, const Vec3 &light, VoxelOctree *tree, const Vec3 &pos, float minT) {
-    uint32 *buffer  = (uint32 *)backBuffer->pixels;
-    int pitch       = backBuffer->pitch;
-
-    float dy = AspectRatio - y0*scale;
-    for (int y = y0; y < y1; ++y, dy -= scale) {
-        float dx = -1.0f + x0*scale;
-        for (int x = x0; x < x1; ++x, dx += scale) {
-            int cornerX = x - ((x - x0) % stride);
-            int cornerY = y - ((y - y0) % stride);
-            if (cornerX != x || cornerY != y) {
-                buffer[x + y*pitch/4] = buffer[cornerX + cornerY*pitch/4];
-                continue;
-            }
+static bool parseViewerSettings(int argc, char *argv[], RenderSettings &settings) {
+    for (int i = 2; i < argc - 1; i++) {
+        std::string arg(argv[i]);
+        bool hasValue = i + 1 < argc - 1;
+        if (arg == "--cache" && hasValue)
+            settings.cacheSize = size_t(atoi(argv[++i]))*1024*1024;
+        else if (arg == "--frame-time" && hasValue)
+            settings.frameTime = atof(argv[++i])*1e-3;
+        else if (arg == "--top-grid")
+            settings.topGrid = true;
+        else
+            return false;
+    }
 
-            Vec3 dir = Vec3(
-                dx*tform.a11 + dy*tform.a12 + zx,
-                dx*tform.a21 + dy*tform.a22 + zy,
-                dx*tform.a31 + dy*tform.a32 + zz
-            );
-            dir *= invSqrt(dir.x*dir.x + dir.y*dir.y + dir.z*dir.z);
-
-            uint32 intNormal;
-            float t;
-            Vec3 col;
-            if (tree->raymarch(pos + dir*minT, dir, 0.0f, intNormal, t))
-                col = shade(intNormal, dir, light);
-
-#ifdef __APPLE__
-            uint32 color =
-                 uint32(std::min(col.x, 1.0f)*255.0) <<  8   |
-                (uint32(std::min(col.y, 1.0f)*255.0) <<  16) |
-                (uint32(std::min(col.z, 1.0f)*255.0) <<  24) |
-                0x000000FFu;
-#else
-            uint32 color =
-                 uint32(std::min(col.x, 1.0f)*255.0)        |
-                (uint32(std::min(col.y, 1.0f)*255.0) <<  8) |
-                (uint32(std::min(col.z, 1.0f)*255.0) << 16) |
-                0xFF000000u;
-#endif
-            buffer[x + y*pitch/4] = color;
-        }
+    return settings.frameTime > 0.0;
+}
+
+static bool parseBenchmarkSettings(int argc, char *argv[], BenchmarkSettings &settings) {
+    for (int i = 2; i < argc - 1; i++) {
+        std::string arg(argv[i]);
+        bool hasValue = i + 1 < argc - 1;
+        if (arg == "--width" && hasValue)
+            settings.width = atoi(argv[++i]);
+        else if (arg == "--height" && hasValue)
+            settings.height = atoi(argv[++i]);
+        else if (arg == "--threads" && hasValue)
+            settings.threads = atoi(argv[++i]);
+        else if (arg == "--frames" && hasValue)
+            settings.segmentFrames = atoi(argv[++i]);
+        else if (arg == "--warmup" && hasValue)
+            settings.warmupFrames = atoi(argv[++i]);
+        else if (arg == "--frame-time" && hasValue)
+            settings.frameTime = atof(argv[++i])*1e-3;
+        else if (arg == "--reproject")
+            settings.reproject = true;
+        else if (arg == "--shadows" && hasValue) {
+            if (!parseShadowMode(argv[++i], settings.shadows))
+                return false;
+        } else if (arg == "--single-rays")
+            settings.singleRays = true;
+        else if (arg == "--ropes")
+            settings.ropes = true;
+        else if (arg == "--top-grid")
+            settings.topGrid = true;
+        else if (arg == "--csv" && hasValue)
+            settings.csvFile = argv[++i];
+        else if (arg == "--json" && hasValue)
+            settings.jsonFile = argv[++i];
+        else if (arg == "--isa" && hasValue) {
+            if (!parseIsa(argv[++i], settings.isa))
+                return false;
+        } else
+            return false;
     }
+    if (settings.threads <= 0)
+        settings.threads = ThreadUtils::idealThreadCount();
+
+    return settings.width > 0 && settings.height > 0 && settings.segmentFrames > 0 && settings.warmupFrames >= 0;
 }
 
-void renderBatch(BatchData *data) {
-    const float TreeMiss = 1e10;
-
-    int x0 = data->x0, y0 = data->y0;
-    int x1 = data->x1, y1 = data->y1;
-    int tilesX = data->tilesX;
-    int tilesY = data->tilesY;
-    float *depthBuffer = data->depthBuffer;
-    VoxelOctree *tree = data->tree;
-
-    Mat4 tform;
-    MatrixStack::get(INV_MODELVIEW_STACK, tform);
-
-    Vec3 pos = tform*Vec3() + tree->center() + Vec3(1.0);
-
-    tform.a14 = tform.a24 = tform.a34 = 0.0f;
-
-    float scale = 2.0f/GWidth;
-    float tileScale = TileSize*scale;
-    float planeDist = 1.0f/std::tan(float(M_PI)/6.0f);
-    float zx = planeDist*tform.a13, zy = planeDist*tform.a23, zz = planeDist*tform.a33;
-    float coarseScale = 2.0f*TileSize/(planeDist*GHeight);
-    int stride = renderHalfSize ? 3 : 1;
-
-    Vec3 light = (tform*Vec3(-1.0, 1.0, -1.0)).normalize();
-
-    std::memset((uint8 *)backBuffer->pixels + y0*backBuffer->pitch, 0, (y1 - y0)*backBuffer->pitch);
-
-    float dy = AspectRatio - y0*scale;
-    for (int y = 0, idx = 0; y < tilesY; y++, dy -= tileScale) {
-        float dx = -1.0f + x0*scale;
-        for (int x = 0; x < tilesX; x++, dx += tileScale, idx++) {
-            Vec3 dir = Vec3(
-                dx*tform.a11 + dy*tform.a12 + zx,
-                dx*tform.a21 + dy*tform.a22 + zy,
-                dx*tform.a31 + dy*tform.a32 + zz
-            );
-            dir *= invSqrt(dir.x*dir.x + dir.y*dir.y + dir.z*dir.z);
-
-            uint32 intNormal;
-            float t;
-            Vec3 col;
-            if (tree->raymarch(pos, dir, coarseScale, intNormal, t))
-                depthBuffer[idx] = t;
+static bool hasExtension(const std::string &path, const std::string &ext) {
+    return path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+static std::string frameFileName(const std::string &path, int frame, int frameCount) {
+    if (frameCount == 1)
+        return path;
+
+    char suffix[32];
+    sprintf(suffix, "_%04d", frame);
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos || path.find_first_of("/\\", dot) != std::string::npos)
+        return path + suffix;
+    return path.substr(0, dot) + suffix + path.substr(dot);
+}
+
+/* Paged octrees are rendered again until no pages are missing, or at most this often */
+static const int MaxRefinementPasses = 64;
+
+/* Returns 0 if the file could not be read */
+static VoxelOctree *loadOctree(const std::string &path, size_t cacheSize) {
+    std::unique_ptr<VoxelOctree> tree(cacheSize ? new VoxelOctree(path.c_str(), cacheSize) : new VoxelOctree(path.c_str()));
+    return tree->isLoaded() ? tree.release() : 0;
+}
+
+/* Builds the neighbor links and the top grid if they were asked for */
+static bool prepareOctree(VoxelOctree *tree, bool ropes, bool topGrid) {
+    if (ropes && !tree->buildRopes()) {
+        std::cout << "Failed to link the nodes to their neighbors" << std::endl;
+        return false;
+    }
+    if (topGrid && !tree->buildTopGrid()) {
+        std::cout << "Failed to build the top grid" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static int renderHeadless(VoxelOctree *tree, const RenderSettings &settings) {
+    std::vector<uint32> color(settings.width*settings.height);
+    std::vector<float> depth(settings.depthFile.empty() ? 0 : settings.width*settings.height);
+
+    RenderTarget target;
+    target.width  = settings.width;
+    target.height = settings.height;
+    target.pitch  = settings.width;
+    target.color  = &color[0];
+    target.depth  = depth.empty() ? 0 : &depth[0];
+
+    Renderer renderer(tree, target);
+    renderer.setShadows(settings.shadows);
+
+    RenderQuality quality;
+    if (settings.halfSize)
+        quality.stride = 3;
+
+    int frameCount = int(settings.cameras.size());
+    double totalTime = 0.0;
+    for (int i = 0; i < frameCount; i++) {
+        const Camera &camera = settings.cameras[i];
+        MatrixStack::set(VIEW_STACK, Mat4::translate(Vec3(0.0f, 0.0f, -camera.radius)));
+        MatrixStack::set(MODEL_STACK, Mat4::rotXYZ(Vec3(camera.pitch, 0.0f, 0.0f))*
+                Mat4::rotXYZ(Vec3(0.0f, camera.yaw, 0.0f)));
+
+        Mat4 tform;
+        MatrixStack::get(INV_MODELVIEW_STACK, tform);
+
+        Timer frameTimer;
+        renderer.render(tform, quality);
+        frameTimer.stop();
+        totalTime += frameTimer.elapsed();
+
+        std::cout << "Frame " << i << " took " << frameTimer.elapsed()*1000.0 << " ms" << std::endl;
+
+        int passes = 1;
+        while (tree->updatePages() && passes < MaxRefinementPasses) {
+            tree->waitForPages();
+            renderer.render(tform, quality);
+            passes++;
+        }
+        if (passes == MaxRefinementPasses)
+            std::cout << "Frame " << i << " is still missing nodes after " << passes << " passes, the cache is too small" << std::endl;
+        else if (passes > 1)
+            std::cout << "Frame " << i << " needed " << passes << " passes to load all visible nodes" << std::endl;
+
+        if (!settings.colorFile.empty()) {
+            std::string path = frameFileName(settings.colorFile, i, frameCount);
+            bool success;
+            if (hasExtension(path, ".pfm"))
+                success = savePfm(path.c_str(), target.color, target.width, target.height, target.pitch);
             else
-                depthBuffer[idx] = TreeMiss;
-
-            if (x > 0 && y > 0) {
-                float minT = std::min(std::min(depthBuffer[idx], depthBuffer[idx - 1]),
-                    std::min(depthBuffer[idx - tilesX],
-                    depthBuffer[idx - tilesX - 1]));
-
-                if (minT != TreeMiss) {
-                    int tx0 = (x - 1)*TileSize + x0;
-                    int ty0 = (y - 1)*TileSize + y0;
-                    int tx1 = std::min(tx0 + TileSize, x1);
-                    int ty1 = std::min(ty0 + TileSize, y1);
-                    renderTile(tx0, ty0, tx1, ty1, stride, scale, zx, zy, zz, tform, light, tree, pos,
-                            std::max(minT - 0.03f, 0.0f));
-                }
+                success = savePpm(path.c_str(), target.color, target.width, target.height, target.pitch);
+            if (!success) {
+                std::cout << "Failed to write " << path << std::endl;
+                return 1;
+            }
+        }
+        if (!settings.depthFile.empty()) {
+            std::string path = frameFileName(settings.depthFile, i, frameCount);
+            if (!saveDepthPfm(path.c_str(), target.depth, target.width, target.height, target.pitch)) {
+                std::cout << "Failed to write " << path << std::endl;
+                return 1;
             }
         }
     }
-}
 
-int renderLoop(void *threadData) {
-    BatchData *data = (BatchData *)threadData;
+    std::cout << "Rendered " << frameCount << " frames at " << settings.width << "x" << settings.height
+              << ", average " << totalTime*1000.0/frameCount << " ms per frame" << std::endl;
+
+    return 0;
+}
 
-    float radius = 1.0f;
-    float pitch = 0.0f;
-    float yaw = 0.0f;
+struct QuerySettings {
+    RayQuery query;
+    /* Whether every ray is also traced on its own and compared */
+    bool check;
+    /* Link the nodes to their neighbors after loading, see VoxelOctree::buildRopes */
+    bool ropes;
+    /* Build the occupancy pyramid after loading, see VoxelOctree::buildTopGrid */
+    bool topGrid;
+    /* Best instruction set the traversal kernels may use */
+    CpuIsa isa;
+
+    QuerySettings() : query(QUERY_CLOSEST_HIT), check(false), ropes(false), topGrid(false), isa(ISA_AVX512) {}
+};
 
-    if (data->id == 0) {
-        MatrixStack::set(VIEW_STACK, Mat4::translate(Vec3(0.0f, 0.0f, -radius)));
-        MatrixStack::set(MODEL_STACK, Mat4());
+/* Parses the options between the mode and the octree, ray and hit files */
+static bool parseQuerySettings(int argc, char *argv[], QuerySettings &settings) {
+    for (int i = 2; i < argc - 3; i++) {
+        std::string arg(argv[i]);
+        bool hasValue = i + 1 < argc - 3;
+        if (arg == "--any-hit")
+            settings.query = QUERY_ANY_HIT;
+        else if (arg == "--check")
+            settings.check = true;
+        else if (arg == "--ropes")
+            settings.ropes = true;
+        else if (arg == "--top-grid")
+            settings.topGrid = true;
+        else if (arg == "--isa" && hasValue) {
+            if (!parseIsa(argv[++i], settings.isa))
+                return false;
+        } else
+            return false;
     }
 
-    while (!doTerminate) {
-        barrier->waitPre();
-        renderBatch(data);
-        barrier->waitPost();
+    return true;
+}
 
-        if (data->id == 0) {
-            if (SDL_MUSTLOCK(backBuffer))
-                SDL_UnlockSurface(backBuffer);
+/* Rays whose hits differ are listed by --check up to this number */
+static const size_t MaxReportedMismatches = 10;
 
-            SDL_UpdateRect(backBuffer, 0, 0, 0, 0);
+/* Reads one ray per line from rayFile, given as "ox oy oz dx dy dz" with an
+ * optional "tMin tMax" behind it, in the coordinates of VoxelOctree::raymarch.
+ * The rays are traced as one batch, and hitFile receives a line for each of
+ * them: 0 for a miss, or 1 followed by t, material, x, y, z and level for a
+ * hit. Any-hit queries only write 0 or 1.
+ */
+static int runQuery(VoxelOctree *tree, const QuerySettings &settings, const std::string &rayFile,
+        const std::string &hitFile) {
+    FILE *fp = fopen(rayFile.c_str(), "r");
+    if (!fp) {
+        std::cout << "Failed to open " << rayFile << std::endl;
+        return 1;
+    }
 
-            int event;
-            while ((event = waitEvent()) && (event == SDL_MOUSEMOTION && !getMouseDown(0) && !getMouseDown(1)));
+    std::vector<float> ox, oy, oz, dx, dy, dz, tMin, tMax;
+    char line[1024];
+    int lineNumber = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineNumber++;
+        float values[9];
+        int count = 0;
+        char *cursor = line;
+        while (count < 9) {
+            char *end;
+            float value = strtof(cursor, &end);
+            if (end == cursor)
+                break;
+            values[count++] = value;
+            cursor = end;
+        }
+        while (*cursor == ' ' || *cursor == '\t' || *cursor == '\r' || *cursor == '\n')
+            cursor++;
+        if (count == 0 && !*cursor)
+            continue;
+        if ((count != 6 && count != 8) || *cursor) {
+            std::cout << rayFile << ":" << lineNumber << ": expected 6 or 8 numbers" << std::endl;
+            fclose(fp);
+            return 1;
+        }
 
-            if (getKeyDown(SDLK_ESCAPE)) {
-                doTerminate = true;
-                barrier->releaseAll();
-            }
+        ox.push_back(values[0]);
+        oy.push_back(values[1]);
+        oz.push_back(values[2]);
+        dx.push_back(values[3]);
+        dy.push_back(values[4]);
+        dz.push_back(values[5]);
+        tMin.push_back(count == 8 ? values[6] : 0.0f);
+        tMax.push_back(count == 8 ? values[7] : std::numeric_limits<float>::infinity());
+    }
+    fclose(fp);
+
+    RayBatch rays;
+    rays.count = ox.size();
+    rays.ox = ox.data();
+    rays.oy = oy.data();
+    rays.oz = oz.data();
+    rays.dx = dx.data();
+    rays.dy = dy.data();
+    rays.dz = dz.data();
+    rays.tMin = tMin.data();
+    rays.tMax = tMax.data();
+
+    bool closest = settings.query == QUERY_CLOSEST_HIT;
+    std::vector<uint8> hit(rays.count);
+    std::vector<float> t(closest ? rays.count : 0);
+    std::vector<uint32> material(t.size());
+    std::vector<int32> x(t.size()), y(t.size()), z(t.size()), level(t.size());
+
+    HitBatch hits;
+    hits.hit = hit.data();
+    if (closest) {
+        hits.t = t.data();
+        hits.material = material.data();
+        hits.x = x.data();
+        hits.y = y.data();
+        hits.z = z.data();
+        hits.level = level.data();
+    }
 
-            float mx = float(getMouseXSpeed());
-            float my = float(getMouseYSpeed());
-            if (getMouseDown(0) && (mx != 0 || my != 0)) {
-                pitch = std::fmod(pitch - my, 360.0f);
-                yaw = std::fmod(yaw + (std::fabs(pitch) > 90.0f ? mx : -mx), 360.0f);
-
-                     if (pitch >  180.0f) pitch -= 360.0f;
-                else if (pitch < -180.0f) pitch += 360.0f;
-
-                MatrixStack::set(MODEL_STACK, Mat4::rotXYZ(Vec3(pitch, 0.0f, 0.0f))*
-                        Mat4::rotXYZ(Vec3(0.0f, yaw, 0.0f)));
-                renderHalfSize = true;
-            } else if (getMouseDown(1) && my != 0) {
-                radius *= std::min(std::max(1.0f - my*0.01f, 0.5f), 1.5f);
-                radius = std::min(radius, 25.0f);
-                MatrixStack::set(VIEW_STACK, Mat4::translate(Vec3(0.0f, 0.0f, -radius)));
-                renderHalfSize = true;
-            } else {
-                renderHalfSize = false;
-            }
+    Timer timer;
+    tree->raymarchBatch(rays, hits, settings.query);
+    timer.stop();
 
-            if (SDL_MUSTLOCK(backBuffer))
-                SDL_LockSurface(backBuffer);
-        }
+    size_t hitCount = std::count(hit.begin(), hit.end(), uint8(1));
+    std::cout << "Traced " << rays.count << " rays in " << timer.elapsed()*1000.0 << " ms, "
+              << hitCount << " of them hit" << std::endl;
+
+    fp = fopen(hitFile.c_str(), "w");
+    if (!fp) {
+        std::cout << "Failed to write " << hitFile << std::endl;
+        return 1;
+    }
+    for (size_t i = 0; i < rays.count; i++) {
+        if (hit[i] && closest)
+            fprintf(fp, "1 %.9g %u %d %d %d %d\n", t[i], material[i], x[i], y[i], z[i], level[i]);
+        else
+            fprintf(fp, "%d\n", hit[i]);
     }
+    fclose(fp);
 
-    return 0;
-}
+    if (!settings.check)
+        return 0;
 
-/* Maximum allowed memory allocation sizes for lookup table and cache blocks.
- * Larger => faster conversion usually, but adapt this to your own RAM size.
- * The conversion will still succeed with memory sizes much, much smaller than
- * the size of the voxel data, only slower.
- */
-static const size_t dataMemory = int64_t(1024)*1024*1024;
+    size_t mismatches = 0;
+    for (size_t i = 0; i < rays.count; i++) {
+        RayHit single;
+        bool singleHit = tree->raymarch(Vec3(ox[i], oy[i], oz[i]), Vec3(dx[i], dy[i], dz[i]),
+                tMin[i], tMax[i], 0.0f, single, settings.query);
+
+        bool same = singleHit == (hit[i] != 0);
+        if (same && singleHit && closest)
+            same = single.t == t[i] && single.material == material[i] && single.x == x[i] &&
+                   single.y == y[i] && single.z == z[i] && single.level == level[i];
+        if (!same && mismatches++ < MaxReportedMismatches)
+            std::cout << "Ray " << i << " differs when traced on its own" << std::endl;
+    }
+    std::cout << mismatches << " of " << rays.count << " rays differ when traced on their own" << std::endl;
 
-void printHelp() {
-    std::cout << "Usage: sparse-voxel-octrees [options] filename ..." << std::endl;
-    std::cout << "Options:" << std::endl;
-    std::cout << "-builder              set program to SVO building mode." << std::endl;
-    std::cout << "  --resolution <r>    set voxel resolution. r is an integer which equals to a power of 2." << std::endl;
-    std::cout << "  --mode <m>          set where to generate voxel data, m equals 0 or 1, where 0 indicates GENERATE_IN_MEMORY while 1 indicates GENERATE_ON_DISK." << std::endl;
-    std::cout << "-viewer               set program to SVO rendering mode." << std::endl << std::endl;
-    std::cout << "Examples:" << std::endl;
-    std::cout << "  sparse-voxel-octrees -builder --resolution 256 --mode 0 ../models/xyzrgb_dragon.ply ../models/xyzrgb_dragon.oct" << std::endl;
-    std::cout << "  sparse-voxel-octrees -builder ../models/xyzrgb_dragon.ply ../models/xyzrgb_dragon.oct" << std::endl;
-    std::cout << "  sparse-voxel-octrees -viewer ../models/XYZRGB-Dragon.oct" << std::endl << std::endl << std::endl;
+    return mismatches ? 1 : 0;
 }
 
 int main(int argc, char *argv[]) {
     
-    unsigned int resolution = 256;  //default resolution
-    unsigned int mode = 0;          //default to generate in memory
     std::string inputFile = "";
     std::string outputFile = "";
+    BuilderSettings builderSettings;
+    RenderSettings renderSettings;
+    BenchmarkSettings benchmarkSettings;
+    QuerySettings querySettings;
+    std::string rayFile = "";
+    std::string hitFile = "";
     
     /* parse arguments */
-    if ((argc == 8) && (std::string(argv[1]) == "-builder")) {
-        resolution = atoi(argv[3]);
-        mode = atoi(argv[5]);
-        inputFile = argv[6];
-        outputFile = argv[7];
+    if ((argc >= 4) && (std::string(argv[1]) == "-builder") && parseBuilderSettings(argc, argv, builderSettings)) {
+        inputFile = argv[argc - 2];
+        outputFile = argv[argc - 1];
     }
-    else if ((argc == 4) && (std::string(argv[1]) == "-builder")) {
-        inputFile = argv[2];
-        outputFile = argv[3];
+    else if ((argc >= 4) && (std::string(argv[1]) == "-convert") && parseBuilderSettings(argc, argv, builderSettings)) {
+        inputFile = argv[argc - 2];
+        outputFile = argv[argc - 1];
+    }
+    else if ((argc >= 3) && (std::string(argv[1]) == "-viewer") && parseViewerSettings(argc, argv, renderSettings))
+        inputFile = argv[argc - 1];
+    else if ((argc >= 3) && (std::string(argv[1]) == "-render") && parseRenderSettings(argc, argv, renderSettings))
+        inputFile = argv[argc - 1];
+    else if ((argc >= 3) && (std::string(argv[1]) == "-benchmark") && parseBenchmarkSettings(argc, argv, benchmarkSettings))
+        inputFile = argv[argc - 1];
+    else if ((argc >= 5) && (std::string(argv[1]) == "-query") && parseQuerySettings(argc, argv, querySettings)) {
+        inputFile = argv[argc - 3];
+        rayFile = argv[argc - 2];
+        hitFile = argv[argc - 1];
     }
-    else if ((argc == 3) && (std::string(argv[1]) == "-viewer")) 
-        inputFile = argv[2];
     else {
         std::cout << "Invalid arguments! Please refer to the help info!" << std::endl;
         printHelp();
@@ -312,67 +683,91 @@ int main(int argc, char *argv[]) {
     if (std::string(argv[1]) == "-builder") {
         ThreadUtils::startThreads(ThreadUtils::idealThreadCount());
 
-        if (mode) { //generate on disk
+        if (builderSettings.mode) { //generate on disk
             std::unique_ptr<PlyLoader> loader(new PlyLoader(inputFile.c_str()));
-            loader->convertToVolume("models/temp.voxel", resolution, dataMemory);
+            loader->convertToVolume("models/temp.voxel", builderSettings.resolution, dataMemory);
             std::unique_ptr<VoxelData> data(new VoxelData("models/temp.voxel", dataMemory));
-            std::unique_ptr<VoxelOctree> tree(new VoxelOctree(data.get()));
-            tree->save(outputFile.c_str());
+            if (!buildOctreeFile(data.get(), builderSettings, outputFile))
+                return 1;
         } 
         else {      //generate in memory
             std::unique_ptr<PlyLoader> loader(new PlyLoader(inputFile.c_str()));
-            std::unique_ptr<VoxelData> data(new VoxelData(loader.get(), resolution, dataMemory));
-            std::unique_ptr<VoxelOctree> tree(new VoxelOctree(data.get()));
-            tree->save(outputFile.c_str());
+            std::unique_ptr<VoxelData> data(new VoxelData(loader.get(), builderSettings.resolution, dataMemory));
+            if (!buildOctreeFile(data.get(), builderSettings, outputFile))
+                return 1;
         }
         timer.bench("Octree initialization took");
         return 0;
     }
 
-    if (std::string(argv[1]) == "-viewer")  {
-        std::unique_ptr<VoxelOctree> tree(new VoxelOctree(inputFile.c_str()));
+    if (std::string(argv[1]) == "-convert") {
+        ThreadUtils::startThreads(ThreadUtils::idealThreadCount());
+
+        std::unique_ptr<VoxelOctree> tree(loadOctree(inputFile, 0));
+        if (!tree || !convertOctree(tree.get(), builderSettings))
+            return 1;
+        tree->save(outputFile.c_str(), builderSettings.compress, builderSettings.blockSize);
+
+        timer.bench("Octree conversion took");
+        return 0;
+    }
+
+    if (std::string(argv[1]) == "-render") {
+        ThreadUtils::startThreads(ThreadUtils::idealThreadCount());
+
+        std::unique_ptr<VoxelOctree> tree(loadOctree(inputFile, renderSettings.cacheSize));
+        if (!tree || !prepareOctree(tree.get(), renderSettings.ropes, renderSettings.topGrid))
+            return 1;
 
         timer.bench("Octree initialization took");
 
-        SDL_Init(SDL_INIT_VIDEO);
+        selectTraversalKernels(renderSettings.isa);
+        std::cout << "Tracing with " << isaName(traversalKernels().isa) << " kernels" << std::endl;
 
-        SDL_WM_SetCaption("Sparse Voxel Octrees", "Sparse Voxel Octrees");
-        backBuffer = SDL_SetVideoMode(GWidth, GHeight, 32, SDL_SWSURFACE);
+        return renderHeadless(tree.get(), renderSettings);
+    }
 
-        SDL_Thread *threads[NumThreads - 1];
-        BatchData threadData[NumThreads];
+    if (std::string(argv[1]) == "-benchmark") {
+        ThreadUtils::startThreads(benchmarkSettings.threads - 1);
 
-        barrier = new ThreadBarrier(NumThreads);
-        doTerminate = false;
+        std::unique_ptr<VoxelOctree> tree(loadOctree(inputFile, 0));
+        if (!tree || !prepareOctree(tree.get(), benchmarkSettings.ropes, benchmarkSettings.topGrid))
+            return 1;
 
-        if (SDL_MUSTLOCK(backBuffer))
-            SDL_LockSurface(backBuffer);
+        timer.bench("Octree initialization took");
 
-        int stride = (GHeight - 1) / NumThreads + 1;
-        for (int i = 0; i < NumThreads; i++) {
-            threadData[i].id = i;
-            threadData[i].tree = tree.get();
-            threadData[i].x0 = 0;
-            threadData[i].x1 = GWidth;
-            threadData[i].y0 = i*stride;
-            threadData[i].y1 = std::min((i + 1)*stride, GHeight);
-            threadData[i].tilesX = (threadData[i].x1 - threadData[i].x0 - 1) / TileSize + 2;
-            threadData[i].tilesY = (threadData[i].y1 - threadData[i].y0 - 1) / TileSize + 2;
-            threadData[i].depthBuffer = new float[threadData[i].tilesX*threadData[i].tilesY];
-        }
+        selectTraversalKernels(benchmarkSettings.isa);
+        return runBenchmark(tree.get(), benchmarkSettings);
+    }
+
+    if (std::string(argv[1]) == "-query") {
+        ThreadUtils::startThreads(ThreadUtils::idealThreadCount());
+
+        std::unique_ptr<VoxelOctree> tree(loadOctree(inputFile, 0));
+        if (!tree || !prepareOctree(tree.get(), querySettings.ropes, querySettings.topGrid))
+            return 1;
+
+        timer.bench("Octree initialization took");
 
-        for (int i = 1; i < NumThreads; i++)
-            threads[i - 1] = SDL_CreateThread(&renderLoop, (void *)&threadData[i]);
+        selectTraversalKernels(querySettings.isa);
+        return runQuery(tree.get(), querySettings, rayFile, hitFile);
+    }
 
-        renderLoop((void *)&threadData[0]);
+    if (std::string(argv[1]) == "-viewer")  {
+#ifdef HAVE_SDL
+        ThreadUtils::startThreads(ThreadUtils::idealThreadCount());
 
-        for (int i = 1; i < NumThreads; i++)
-            SDL_WaitThread(threads[i - 1], 0);
+        std::unique_ptr<VoxelOctree> tree(loadOctree(inputFile, renderSettings.cacheSize));
+        if (!tree || !prepareOctree(tree.get(), false, renderSettings.topGrid))
+            return 1;
 
-        if (SDL_MUSTLOCK(backBuffer))
-            SDL_UnlockSurface(backBuffer);
+        timer.bench("Octree initialization took");
 
-        SDL_Quit();
+        runViewer(tree.get(), renderSettings.frameTime);
+#else
+        std::cout << "This build has no SDL support. Use -render to render without a window." << std::endl;
+        return 1;
+#endif
     }
 
     return 0;
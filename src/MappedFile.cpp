@@ -0,0 +1,90 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#include "MappedFile.hpp"
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if _WIN32
+
+MappedFile::MappedFile(const char *path) : _data(0), _size(0), _file(INVALID_HANDLE_VALUE), _mapping(0) {
+    _file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (_file == INVALID_HANDLE_VALUE)
+        return;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size) || size.QuadPart == 0)
+        return;
+    _mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (!_mapping)
+        return;
+
+    _data = static_cast<const uint8 *>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+    if (_data)
+        _size = uint64(size.QuadPart);
+}
+
+MappedFile::~MappedFile() {
+    if (_data)
+        UnmapViewOfFile(_data);
+    if (_mapping)
+        CloseHandle(_mapping);
+    if (_file != INVALID_HANDLE_VALUE)
+        CloseHandle(_file);
+}
+
+#else
+
+MappedFile::MappedFile(const char *path) : _data(0), _size(0) {
+    _file = open(path, O_RDONLY);
+    if (_file < 0)
+        return;
+
+    struct stat info;
+    if (fstat(_file, &info) != 0 || info.st_size == 0)
+        return;
+
+    void *data = mmap(0, size_t(info.st_size), PROT_READ, MAP_SHARED, _file, 0);
+    if (data == MAP_FAILED)
+        return;
+
+    _data = static_cast<const uint8 *>(data);
+    _size = uint64(info.st_size);
+}
+
+MappedFile::~MappedFile() {
+    if (_data)
+        munmap(const_cast<uint8 *>(_data), size_t(_size));
+    if (_file >= 0)
+        close(_file);
+}
+
+#endif
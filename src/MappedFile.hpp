@@ -0,0 +1,60 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#ifndef MAPPEDFILE_HPP_
+#define MAPPEDFILE_HPP_
+
+#include "IntTypes.hpp"
+
+/* Read-only memory mapping of a whole file. Pages are loaded by the OS as
+ * they are touched and are shared between all processes mapping the same file.
+ */
+class MappedFile {
+    const uint8 *_data;
+    uint64 _size;
+#if _WIN32
+    void *_file;
+    void *_mapping;
+#else
+    int _file;
+#endif
+
+public:
+    MappedFile(const char *path);
+    ~MappedFile();
+
+    bool isOpen() const {
+        return _data != 0;
+    }
+
+    const uint8 *data() const {
+        return _data;
+    }
+
+    uint64 size() const {
+        return _size;
+    }
+};
+
+#endif /* MAPPEDFILE_HPP_ */
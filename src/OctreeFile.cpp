@@ -0,0 +1,183 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#include "OctreeFile.hpp"
+#include "OctreeStream.hpp"
+#include "Util.hpp"
+
+#include "third-party/lz4.h"
+
+#include <algorithm>
+#include <iostream>
+#include <cstring>
+#include <memory>
+
+static const char Magic[4] = {'S', 'V', 'O', 'C'};
+static const uint64 HeaderSize = sizeof(Magic) + 2*sizeof(uint32) + 3*sizeof(float) + 3*sizeof(uint64);
+
+/* Version 2 files were always compressed and had no flags field */
+static const uint32 UnflaggedVersion = 2;
+
+OctreeFile::OctreeFile(const char *path) : _isLegacy(false), _flags(0), _octreeSize(0), _blockSize(0) {
+    _file = fopen(path, "rb");
+    if (!_file)
+        return;
+
+    char magic[4];
+    uint32 version;
+    uint64 blockCount;
+    if (fread(magic, 1, sizeof(magic), _file) != sizeof(magic) || std::memcmp(magic, Magic, sizeof(Magic)) != 0) {
+        _isLegacy = true;
+    } else if (fread(&version, sizeof(uint32), 1, _file) != 1 || version < UnflaggedVersion || version > Version) {
+        std::cout << "Unsupported octree file version in " << path << std::endl;
+    } else {
+        if (version > UnflaggedVersion)
+            fread(&_flags, sizeof(uint32), 1, _file);
+        fread(_center.a, sizeof(float), 3, _file);
+        fread(&_octreeSize, sizeof(uint64), 1, _file);
+        fread(&_blockSize, sizeof(uint64), 1, _file);
+        fread(&blockCount, sizeof(uint64), 1, _file);
+
+        _blockOffsets.resize(size_t(blockCount + 1));
+        size_t read = fread(&_blockOffsets[0], sizeof(uint64), _blockOffsets.size(), _file);
+
+        if (read == _blockOffsets.size() && _blockSize > 0 && blockCount == (_octreeSize + _blockSize - 1)/_blockSize)
+            return;
+
+        std::cout << "Corrupt octree file header in " << path << std::endl;
+    }
+
+    fclose(_file);
+    _file = 0;
+    _blockOffsets.clear();
+}
+
+OctreeFile::~OctreeFile() {
+    if (_file)
+        fclose(_file);
+}
+
+uint64 OctreeFile::blockLength(uint64 block) const {
+    return std::min(_blockSize, _octreeSize - blockStart(block));
+}
+
+uint64 OctreeFile::compressedSize() const {
+    return _blockOffsets.empty() ? 0 : _blockOffsets.back();
+}
+
+bool OctreeFile::readCompressedBlock(uint64 block, uint32 *dst) {
+    uint64 compSize = _blockOffsets[size_t(block + 1)] - _blockOffsets[size_t(block)];
+    std::unique_ptr<char[]> buffer(new char[size_t(compSize)]);
+
+    {
+        std::unique_lock<std::mutex> lock(_readMutex);
+        seekFile(_file, _blockOffsets[size_t(block)]);
+        if (fread(buffer.get(), 1, size_t(compSize), _file) != compSize)
+            return false;
+    }
+
+    int size = int(blockLength(block)*sizeof(uint32));
+    return LZ4_decompress_safe(buffer.get(), reinterpret_cast<char *>(dst), int(compSize), size) == size;
+}
+
+bool OctreeFile::readBlock(uint64 block, uint32 *dst) {
+    if (isCompressed())
+        return readCompressedBlock(block, dst);
+
+    std::unique_lock<std::mutex> lock(_readMutex);
+    seekFile(_file, _blockOffsets[size_t(block)]);
+    return fread(dst, sizeof(uint32), size_t(blockLength(block)), _file) == blockLength(block);
+}
+
+bool OctreeFile::write(const char *path, const Vec3 &center, uint64 octreeSize, const uint32 *octree,
+        OctreeStream *stream, uint32 flags, uint64 blockSize) {
+    FILE *fp = fopen(path, "wb");
+    if (!fp)
+        return false;
+
+    uint64 blockCount = (octreeSize + blockSize - 1)/blockSize;
+    std::vector<uint64> blockOffsets(size_t(blockCount + 1));
+
+    uint32 version = Version;
+    bool compress = (flags & FlagUncompressed) == 0;
+    fwrite(Magic, 1, sizeof(Magic), fp);
+    fwrite(&version, sizeof(uint32), 1, fp);
+    fwrite(&flags, sizeof(uint32), 1, fp);
+    fwrite(center.a, sizeof(float), 3, fp);
+    fwrite(&octreeSize, sizeof(uint64), 1, fp);
+    fwrite(&blockSize, sizeof(uint64), 1, fp);
+    fwrite(&blockCount, sizeof(uint64), 1, fp);
+    /* The block table is filled in once all blocks are written */
+    fwrite(&blockOffsets[0], sizeof(uint64), blockOffsets.size(), fp);
+
+    int maxBlockBytes = int(blockSize*sizeof(uint32));
+    std::unique_ptr<char[]> buffer;
+    if (compress)
+        buffer.reset(new char[LZ4_compressBound(maxBlockBytes)]);
+    std::unique_ptr<uint32[]> block;
+    if (!octree)
+        block.reset(new uint32[size_t(blockSize)]);
+
+    uint64 offset = HeaderSize + blockOffsets.size()*sizeof(uint64);
+    if (!compress) {
+        /* Pad the header, so that the octree can be mapped straight into memory */
+        uint64 dataOffset = (offset + MappingAlignment - 1)/MappingAlignment*MappingAlignment;
+        std::vector<char> padding(size_t(dataOffset - offset), 0);
+        if (!padding.empty())
+            fwrite(&padding[0], 1, padding.size(), fp);
+        offset = dataOffset;
+    }
+
+    for (uint64 i = 0; i < blockCount; i++) {
+        uint64 start = i*blockSize;
+        uint64 length = std::min(blockSize, octreeSize - start);
+
+        const uint32 *src = octree + start;
+        if (!octree) {
+            stream->read(start, length, block.get());
+            src = block.get();
+        }
+
+        blockOffsets[size_t(i)] = offset;
+        if (compress) {
+            int compSize = LZ4_compress_default(reinterpret_cast<const char *>(src), buffer.get(),
+                    int(length*sizeof(uint32)), LZ4_compressBound(maxBlockBytes));
+            fwrite(buffer.get(), 1, size_t(compSize), fp);
+            offset += compSize;
+        } else {
+            fwrite(src, sizeof(uint32), size_t(length), fp);
+            offset += length*sizeof(uint32);
+        }
+    }
+    blockOffsets[size_t(blockCount)] = offset;
+
+    seekFile(fp, HeaderSize);
+    fwrite(&blockOffsets[0], sizeof(uint64), blockOffsets.size(), fp);
+    fclose(fp);
+
+    std::cout << "Octree size: " << prettyPrintMemory(octreeSize*sizeof(uint32))
+              << (compress ? " Compressed size: " : " File size: ") << prettyPrintMemory(offset) << std::endl;
+
+    return true;
+}
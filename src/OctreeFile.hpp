@@ -0,0 +1,165 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#ifndef OCTREEFILE_HPP_
+#define OCTREEFILE_HPP_
+
+#include "math/Vec3.hpp"
+
+#include "IntTypes.hpp"
+
+#include <stdio.h>
+#include <mutex>
+#include <vector>
+
+class OctreeStream;
+
+/* Reader and writer for .oct files. Files start with a header that holds the
+ * format version, flags, the model center and the octree size, followed by
+ * a table with the file offset of every block. Each block holds blockSize()
+ * words of the octree and is LZ4 compressed on its own, so blocks can be
+ * decompressed in any order and in parallel. Uncompressed files store the
+ * octree contiguously at a page aligned offset instead, so that it can be
+ * memory mapped and traversed in place.
+ *
+ * Files written before the header was introduced start right away with the
+ * center and are compressed as one dependent stream. They are reported as
+ * legacy files and have to be loaded sequentially.
+ */
+class OctreeFile {
+    FILE *_file;
+    std::mutex _readMutex;
+    bool _isLegacy;
+    uint32 _flags;
+
+    Vec3 _center;
+    uint64 _octreeSize;
+    uint64 _blockSize;
+    std::vector<uint64> _blockOffsets;
+
+    bool readCompressedBlock(uint64 block, uint32 *dst);
+
+public:
+    static const uint32 Version = 7;
+    static const uint64 DefaultBlockSize = 1024*1024;
+    /* Blocks are stored as is, one after the other, starting at a multiple
+     * of MappingAlignment bytes */
+    static const uint32 FlagUncompressed = 1;
+    /* The words hold a DAG as written by VoxelOctree::convertToDag */
+    static const uint32 FlagDag = 2;
+    /* The leaf materials of an octree follow its nodes, see
+     * VoxelOctree::convertAttributes. DAGs always store them that way */
+    static const uint32 FlagSeparateAttributes = 4;
+    /* The octree or DAG holds no leaf materials at all */
+    static const uint32 FlagNoAttributes = 8;
+    /* Interior nodes carry averaged materials, see
+     * VoxelOctree::prefilterAttributes */
+    static const uint32 FlagPrefiltered = 16;
+    /* No descriptor of the octree uses far pointers. Files written before
+     * this flag existed lack it either way */
+    static const uint32 FlagNoFarPointers = 32;
+    /* Some leaves of the octree are dense bricks, see
+     * VoxelOctree::convertToBricks */
+    static const uint32 FlagBricks = 64;
+    /* Covers the page size and the Windows allocation granularity */
+    static const uint64 MappingAlignment = 64*1024;
+
+    OctreeFile(const char *path);
+    ~OctreeFile();
+
+    bool isOpen() const {
+        return _file != 0;
+    }
+
+    bool isLegacy() const {
+        return _isLegacy;
+    }
+
+    bool isCompressed() const {
+        return (_flags & FlagUncompressed) == 0;
+    }
+
+    bool isDag() const {
+        return (_flags & FlagDag) != 0;
+    }
+
+    bool hasSeparateAttributes() const {
+        return (_flags & (FlagDag | FlagSeparateAttributes)) != 0;
+    }
+
+    bool hasAttributes() const {
+        return (_flags & FlagNoAttributes) == 0;
+    }
+
+    bool isPrefiltered() const {
+        return (_flags & FlagPrefiltered) != 0;
+    }
+
+    bool hasFarPointers() const {
+        return (_flags & FlagNoFarPointers) == 0;
+    }
+
+    bool hasBricks() const {
+        return (_flags & FlagBricks) != 0;
+    }
+
+    /* File offset of the octree in uncompressed files */
+    uint64 dataOffset() const {
+        return _blockOffsets.front();
+    }
+
+    const Vec3 &center() const {
+        return _center;
+    }
+
+    uint64 octreeSize() const {
+        return _octreeSize;
+    }
+
+    uint64 blockSize() const {
+        return _blockSize;
+    }
+
+    uint64 blockCount() const {
+        return _blockOffsets.size() - 1;
+    }
+
+    uint64 blockStart(uint64 block) const {
+        return block*_blockSize;
+    }
+
+    uint64 blockLength(uint64 block) const;
+    uint64 compressedSize() const;
+
+    /* Decompresses one block into dst, which has to hold blockLength(block)
+     * words. May be called from several threads at once.
+     */
+    bool readBlock(uint64 block, uint32 *dst);
+
+    /* Writes an octree that is either held in memory or read back from a stream */
+    static bool write(const char *path, const Vec3 &center, uint64 octreeSize, const uint32 *octree,
+            OctreeStream *stream = 0, uint32 flags = 0, uint64 blockSize = DefaultBlockSize);
+};
+
+#endif /* OCTREEFILE_HPP_ */
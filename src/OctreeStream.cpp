@@ -0,0 +1,125 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#include "OctreeStream.hpp"
+#include "Util.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+OctreeStream::OctreeStream(const char *path, uint64 windowSize)
+: _path(path),
+  _windowSize(std::max(windowSize, uint64(1024))),
+  _windowStart(0),
+  _patchCount(0)
+{
+    _file = fopen(path, "w+b");
+    if (_file)
+        _window.reset(new uint32[size_t(_windowSize)]());
+}
+
+OctreeStream::~OctreeStream() {
+    if (_file) {
+        fclose(_file);
+        remove(_path.c_str());
+    }
+}
+
+void OctreeStream::reserve(uint64 end) {
+    uint64 windowEnd = _windowStart + _windowSize;
+    if (end <= windowEnd)
+        return;
+
+    /* Slide by at least half a window, so that flushes stay large */
+    uint64 newStart = end - _windowSize/2;
+    uint64 flushCount = std::min(newStart, windowEnd) - _windowStart;
+
+    seekFile(_file, _windowStart*sizeof(uint32));
+    fwrite(_window.get(), sizeof(uint32), size_t(flushCount), _file);
+
+    uint64 keepCount = _windowSize - flushCount;
+    if (keepCount)
+        std::memmove(_window.get(), _window.get() + flushCount, size_t(keepCount)*sizeof(uint32));
+    std::memset(_window.get() + keepCount, 0, size_t(flushCount)*sizeof(uint32));
+
+    _windowStart = newStart;
+}
+
+void OctreeStream::set(uint64 idx, uint32 value) {
+    if (idx >= _windowStart) {
+        _window[idx - _windowStart] = value;
+    } else {
+        seekFile(_file, idx*sizeof(uint32));
+        fwrite(&value, sizeof(uint32), 1, _file);
+        _patchCount++;
+    }
+}
+
+void OctreeStream::combine(uint64 idx, uint32 value) {
+    if (idx >= _windowStart) {
+        _window[idx - _windowStart] |= value;
+    } else {
+        /* Words that were skipped over by a flush read back as zero */
+        uint32 old = 0;
+        seekFile(_file, idx*sizeof(uint32));
+        if (fread(&old, sizeof(uint32), 1, _file) != 1)
+            old = 0;
+        old |= value;
+        seekFile(_file, idx*sizeof(uint32));
+        fwrite(&old, sizeof(uint32), 1, _file);
+        _patchCount++;
+    }
+}
+
+void OctreeStream::write(uint64 idx, const uint32 *data, uint64 count) {
+    reserve(idx + count);
+
+    if (idx < _windowStart) {
+        uint64 fileCount = std::min(count, _windowStart - idx);
+        seekFile(_file, idx*sizeof(uint32));
+        fwrite(data, sizeof(uint32), size_t(fileCount), _file);
+        idx += fileCount;
+        data += fileCount;
+        count -= fileCount;
+    }
+    if (count)
+        std::memcpy(_window.get() + (idx - _windowStart), data, size_t(count)*sizeof(uint32));
+}
+
+void OctreeStream::finish(uint64 size) {
+    if (size > _windowStart) {
+        seekFile(_file, _windowStart*sizeof(uint32));
+        fwrite(_window.get(), sizeof(uint32), size_t(std::min(size - _windowStart, _windowSize)), _file);
+    }
+    fflush(_file);
+
+    _window.reset();
+}
+
+void OctreeStream::read(uint64 idx, uint64 count, uint32 *dst) {
+    seekFile(_file, idx*sizeof(uint32));
+    size_t readCount = fread(dst, sizeof(uint32), size_t(count), _file);
+    if (readCount < count)
+        std::memset(dst + readCount, 0, size_t(count - readCount)*sizeof(uint32));
+}
@@ -0,0 +1,77 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#ifndef OCTREESTREAM_HPP_
+#define OCTREESTREAM_HPP_
+
+#include "IntTypes.hpp"
+
+#include <stdio.h>
+#include <memory>
+#include <string>
+
+/* Backing store for octrees that are too large to be built in memory. Only a
+ * window of the octree following the most recently reserved words is kept in
+ * memory; everything before it lives in a temporary file. The exact layout
+ * builder only ever appends and then fills in words behind the append
+ * position, so most writes hit the window. Writes to words that were already
+ * flushed are patched into the file directly.
+ */
+class OctreeStream {
+    FILE *_file;
+    std::string _path;
+
+    std::unique_ptr<uint32[]> _window;
+    uint64 _windowSize;
+    uint64 _windowStart;
+    uint64 _patchCount;
+
+public:
+    /* Parallel subtrees have to be written into separate buffers first */
+    static const bool SupportsConcurrentWrites = false;
+
+    OctreeStream(const char *path, uint64 windowSize);
+    ~OctreeStream();
+
+    bool isOpen() const {
+        return _file != 0;
+    }
+
+    uint64 patchCount() const {
+        return _patchCount;
+    }
+
+    /* Makes sure all words before end can be written */
+    void reserve(uint64 end);
+    void set(uint64 idx, uint32 value);
+    void combine(uint64 idx, uint32 value);
+    void write(uint64 idx, const uint32 *data, uint64 count);
+
+    /* Flushes the window and releases its memory. The octree can only be read
+     * back afterwards */
+    void finish(uint64 size);
+    void read(uint64 idx, uint64 count, uint32 *dst);
+};
+
+#endif /* OCTREESTREAM_HPP_ */
@@ -0,0 +1,183 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#include "PageCache.hpp"
+
+#include <algorithm>
+#include <vector>
+#include <utility>
+
+PageCache::PageCache(const char *path, uint64 capacity)
+: _file(path),
+  _pageCount(0),
+  _pageBytes(0),
+  _pageShift(0),
+  _pageMask(0),
+  _frame(1),
+  _missed(false),
+  _capacity(capacity),
+  _residentBytes(0),
+  _refusedBytes(0),
+  _loading(0),
+  _terminate(false)
+{
+    if (!_file.isOpen() || _file.isLegacy() || _file.octreeSize() == 0)
+        return;
+
+    uint64 blockSize = _file.blockSize();
+    if (blockSize & (blockSize - 1))
+        return;
+    while ((uint64(1) << _pageShift) < blockSize)
+        _pageShift++;
+    _pageMask = blockSize - 1;
+    _pageBytes = blockSize*sizeof(uint32);
+    _pageCount = _file.blockCount();
+
+    _lastUse.reset(new std::atomic<uint32>[size_t(_pageCount)]);
+    _requested.reset(new std::atomic<bool>[size_t(_pageCount)]);
+    _pages.reset(new std::atomic<uint32 *>[size_t(_pageCount)]);
+    for (uint64 i = 0; i < _pageCount; ++i) {
+        _lastUse[i] = 0;
+        _requested[i] = false;
+        _pages[i] = nullptr;
+    }
+
+    /* The root page is needed by every ray, so load it right away */
+    _requested[0] = true;
+    if (!load(0)) {
+        _pages.reset();
+        return;
+    }
+
+    _loader = std::thread(&PageCache::loaderLoop, this);
+}
+
+PageCache::~PageCache() {
+    if (_loader.joinable()) {
+        {
+            std::unique_lock<std::mutex> lock(_queueMutex);
+            _terminate = true;
+        }
+        _queueCond.notify_all();
+        _loader.join();
+    }
+
+    if (_pages)
+        for (uint64 i = 0; i < _pageCount; ++i)
+            delete[] _pages[i].load();
+}
+
+void PageCache::request(uint64 page) {
+    _missed.store(true, std::memory_order_relaxed);
+    if (_requested[page].exchange(true))
+        return;
+
+    {
+        std::unique_lock<std::mutex> lock(_queueMutex);
+        _queue.push_back(page);
+    }
+    _queueCond.notify_one();
+}
+
+bool PageCache::load(uint64 page) {
+    uint64 length = _file.blockLength(page);
+    uint32 *data = new uint32[size_t(length)];
+    if (!_file.readBlock(page, data)) {
+        delete[] data;
+        return false;
+    }
+
+    _residentBytes += length*sizeof(uint32);
+    _lastUse[page].store(_frame.load());
+    _pages[page].store(data, std::memory_order_release);
+    return true;
+}
+
+void PageCache::loaderLoop() {
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    while (true) {
+        _queueCond.wait(lock, [&]{ return _terminate || !_queue.empty(); });
+        if (_terminate)
+            break;
+
+        uint64 page = _queue.front();
+        _queue.pop_front();
+        _loading++;
+        lock.unlock();
+
+        /* Pages that do not fit are dropped from the queue. They are
+         * requested again during the next frame, after update had the
+         * chance to make room for them.
+         */
+        uint64 bytes = _file.blockLength(page)*sizeof(uint32);
+        if (_residentBytes + bytes > _capacity) {
+            _refusedBytes += bytes;
+            _requested[page] = false;
+        } else if (!load(page)) {
+            _requested[page] = false;
+        }
+
+        lock.lock();
+        _loading--;
+        if (_queue.empty() && _loading == 0)
+            _idleCond.notify_all();
+    }
+}
+
+bool PageCache::update() {
+    bool missed = _missed.exchange(false);
+    uint32 frame = _frame.load();
+
+    uint64 pending = _refusedBytes.exchange(0);
+    {
+        std::unique_lock<std::mutex> lock(_queueMutex);
+        pending += (_queue.size() + _loading)*_pageBytes;
+    }
+
+    if (_residentBytes + pending > _capacity) {
+        /* Only pages the last frame did not touch are evicted, so the
+         * working set of a frame is never thrashed by its own requests */
+        std::vector<std::pair<uint32, uint64>> candidates;
+        for (uint64 i = 1; i < _pageCount; ++i)
+            if (_pages[i].load() && _lastUse[i].load() != frame)
+                candidates.push_back(std::make_pair(_lastUse[i].load(), i));
+        std::sort(candidates.begin(), candidates.end());
+
+        for (size_t i = 0; i < candidates.size() && _residentBytes + pending > _capacity; ++i) {
+            uint64 page = candidates[i].second;
+            _residentBytes -= _file.blockLength(page)*sizeof(uint32);
+            delete[] _pages[page].exchange(nullptr);
+            _requested[page] = false;
+        }
+    }
+
+    _frame.store(frame + 1);
+
+    return missed;
+}
+
+void PageCache::waitForLoads() {
+    std::unique_lock<std::mutex> lock(_queueMutex);
+    _idleCond.wait(lock, [&]{ return _queue.empty() && _loading == 0; });
+}
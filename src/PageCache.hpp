@@ -0,0 +1,126 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#ifndef PAGECACHE_HPP_
+#define PAGECACHE_HPP_
+
+#include "OctreeFile.hpp"
+
+#include "IntTypes.hpp"
+
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <deque>
+
+/* Keeps a bounded subset of the blocks of an octree file in memory. Blocks
+ * serve as pages: traversal looks up the page of every node it visits and
+ * requests missing pages, which a background thread loads in the order they
+ * were requested. The first page holds the root and stays resident.
+ *
+ * Pages are only ever evicted by update(), which has to be called between
+ * frames while no traversal is running. It drops the least recently used
+ * pages that were not touched in the last frame until the pending requests
+ * fit into the memory cap. If the pages needed by a single frame do not fit,
+ * some of them remain missing and traversal keeps falling back to coarser
+ * levels there.
+ */
+class PageCache {
+    OctreeFile _file;
+
+    uint64 _pageCount;
+    uint64 _pageBytes;
+    int _pageShift;
+    uint64 _pageMask;
+
+    std::unique_ptr<std::atomic<uint32 *>[]> _pages;
+    std::unique_ptr<std::atomic<uint32>[]> _lastUse;
+    std::unique_ptr<std::atomic<bool>[]> _requested;
+    std::atomic<uint32> _frame;
+    std::atomic<bool> _missed;
+
+    uint64 _capacity;
+    std::atomic<uint64> _residentBytes;
+    /* Size of the pages that were refused since the last update */
+    std::atomic<uint64> _refusedBytes;
+
+    std::mutex _queueMutex;
+    std::condition_variable _queueCond;
+    std::condition_variable _idleCond;
+    std::deque<uint64> _queue;
+    int _loading;
+    bool _terminate;
+    std::thread _loader;
+
+    void request(uint64 page);
+    bool load(uint64 page);
+    void loaderLoop();
+
+public:
+    /* capacity is the memory cap in bytes. Check isOpen afterwards, which
+     * fails for files that cannot be paged */
+    PageCache(const char *path, uint64 capacity);
+    ~PageCache();
+
+    bool isOpen() const {
+        return _pages != nullptr;
+    }
+
+    const OctreeFile &file() const {
+        return _file;
+    }
+
+    /* Returns the word at idx, or false if its page is not resident yet. In
+     * that case, the page is requested. Safe to call from any thread.
+     */
+    inline bool fetch(uint64 idx, uint32 &value) {
+        uint64 page = idx >> _pageShift;
+        const uint32 *data = _pages[page].load(std::memory_order_acquire);
+        if (!data) {
+            request(page);
+            return false;
+        }
+
+        uint32 frame = _frame.load(std::memory_order_relaxed);
+        if (_lastUse[page].load(std::memory_order_relaxed) != frame)
+            _lastUse[page].store(frame, std::memory_order_relaxed);
+
+        value = data[idx & _pageMask];
+        return true;
+    }
+
+    /* Starts a new frame and evicts pages if necessary. Returns whether any
+     * page was missing during the previous frame */
+    bool update();
+    /* Blocks until all requested pages are loaded or were refused for lack of space */
+    void waitForLoads();
+
+    uint64 residentBytes() const {
+        return _residentBytes;
+    }
+};
+
+#endif /* PAGECACHE_HPP_ */
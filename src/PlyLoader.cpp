@@ -444,6 +444,12 @@ void PlyLoader::processBlock(uint32 *data, int x, int y, int z, int w, int h, in
     _bufferH = h;
     _bufferD = d;
 
+    /* Builders that visit the volume twice load every block again */
+    if (_processedBlocks == _numNonZeroBlocks) {
+        _processedBlocks = 0;
+        _conversionTimer.start();
+    }
+
     ThreadUtils::pool->enqueue([&](uint32 i, uint32, uint32){
         int px = i % _partitionW;
         int py = (i/_partitionW) % _partitionH;
@@ -0,0 +1,89 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef RAYBATCH_HPP_
+#define RAYBATCH_HPP_
+
+#include "IntTypes.hpp"
+
+#include <cstddef>
+
+/* What a query needs to know about a ray. Any-hit queries, such as shadow
+ * rays, only report whether the ray hits; the other fields of their hits are
+ * left undefined, which saves the material lookup.
+ */
+enum RayQuery {
+    QUERY_CLOSEST_HIT,
+    QUERY_ANY_HIT
+};
+
+/* Result of a single ray query. x, y and z index the voxel grid of the
+ * octree level the ray stopped at, i.e. they range from 0 to (1 << level) - 1.
+ * material is zero if traversal stopped early because of the LOD scale.
+ */
+struct RayHit {
+    float t;
+    uint32 material;
+    int32 x, y, z;
+    int32 level;
+};
+
+/* Structure-of-arrays description of a set of rays. Rays are given in the
+ * same space as for VoxelOctree::raymarch, i.e. the octree spans [1, 2]^3.
+ * tMin, tMax and lodScale are optional and default to 0, infinity and 0
+ * respectively if null.
+ */
+struct RayBatch {
+    size_t count;
+
+    const float *ox, *oy, *oz;
+    const float *dx, *dy, *dz;
+    const float *tMin, *tMax;
+    const float *lodScale;
+
+    RayBatch()
+    : count(0), ox(0), oy(0), oz(0), dx(0), dy(0), dz(0),
+      tMin(0), tMax(0), lodScale(0)
+    {
+    }
+};
+
+/* Output arrays for a batch query, each with room for RayBatch::count
+ * entries. Any array may be null if the caller is not interested in it.
+ * hit is set to 0 or 1 for every ray; the remaining arrays are only written
+ * for rays that hit, and not at all by any-hit queries.
+ */
+struct HitBatch {
+    uint8 *hit;
+    float *t;
+    uint32 *material;
+    int32 *x, *y, *z;
+    int32 *level;
+
+    HitBatch()
+    : hit(0), t(0), material(0), x(0), y(0), z(0), level(0)
+    {
+    }
+};
+
+#endif /* RAYBATCH_HPP_ */
@@ -0,0 +1,65 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef RAYPACKET_HPP_
+#define RAYPACKET_HPP_
+
+#include "IntTypes.hpp"
+
+/* Fixed, so that the same packets can be passed to the kernels of every
+ * instruction set. Kernels with narrower registers trace a packet in parts.
+ */
+static const int PacketWidth = 8;
+
+/* A group of coherent rays stored in structure-of-arrays layout, so that the
+ * packet traversal can load each component straight into a SIMD register.
+ * Lanes that are not part of the active mask may contain garbage.
+ */
+struct RayPacket {
+    alignas(32) float ox[PacketWidth];
+    alignas(32) float oy[PacketWidth];
+    alignas(32) float oz[PacketWidth];
+    alignas(32) float dx[PacketWidth];
+    alignas(32) float dy[PacketWidth];
+    alignas(32) float dz[PacketWidth];
+    alignas(32) float tMin[PacketWidth];
+    alignas(32) float tMax[PacketWidth];
+    alignas(32) float rayScale[PacketWidth];
+};
+
+/* Per-lane results of a packet query. Only lanes in the returned hit mask
+ * are written. The voxel coordinates index the grid of the octree level the
+ * ray stopped at, i.e. they range from 0 to (1 << level) - 1.
+ */
+struct PacketHit {
+    alignas(32) float t[PacketWidth];
+    alignas(32) uint32 material[PacketWidth];
+    alignas(32) int32 x[PacketWidth];
+    alignas(32) int32 y[PacketWidth];
+    alignas(32) int32 z[PacketWidth];
+    alignas(32) int32 level[PacketWidth];
+};
+
+static const uint32 FullPacketMask = (1u << PacketWidth) - 1;
+
+#endif /* RAYPACKET_HPP_ */
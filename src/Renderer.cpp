@@ -0,0 +1,862 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#include "Renderer.hpp"
+#include "VoxelOctree.hpp"
+#include "Timer.hpp"
+#include "Util.hpp"
+
+#include "thread/ThreadUtils.hpp"
+#include "thread/ThreadPool.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <limits>
+#include <cmath>
+
+#ifndef M_PI
+#define M_PI        3.14159265358979323846
+#endif
+
+Vec3 shade(int intNormal, const Vec3 &ray, const Vec3 &light) {
+    Vec3 n;
+    float c;
+    decompressMaterial(intNormal, n, c);
+
+    float d = std::max(light.dot(ray.reflect(n)), 0.0f);
+    float specular = d*d;
+
+    return c*0.9f*std::abs(light.dot(n)) + specular*0.2f;
+}
+
+uint32 packColor(const Vec3 &col) {
+#ifdef __APPLE__
+    return
+         uint32(std::min(col.x, 1.0f)*255.0) <<  8   |
+        (uint32(std::min(col.y, 1.0f)*255.0) <<  16) |
+        (uint32(std::min(col.z, 1.0f)*255.0) <<  24) |
+        0x000000FFu;
+#else
+    return
+         uint32(std::min(col.x, 1.0f)*255.0)        |
+        (uint32(std::min(col.y, 1.0f)*255.0) <<  8) |
+        (uint32(std::min(col.z, 1.0f)*255.0) << 16) |
+        0xFF000000u;
+#endif
+}
+
+Vec3 unpackColor(uint32 color) {
+#ifdef __APPLE__
+    color >>= 8;
+#endif
+    return Vec3(
+        float((color >>  0) & 0xFF),
+        float((color >>  8) & 0xFF),
+        float((color >> 16) & 0xFF)
+    )*(1.0f/255.0f);
+}
+
+static const float TreeMiss = 1e10;
+/* Marks tiles whose starting distance is found by the beams */
+static const float NeedsBeams = -1.0f;
+/* Beam widths in pixels, from coarse to fine. Each width divides the one
+ * before it, and the finest divides TileSize. Frames rendered at a stride
+ * stop at the first level that spans at least MinBeamRays traced rays */
+static const int BeamSizes[] = {64, 16, 4};
+static const int BeamLevels = sizeof(BeamSizes)/sizeof(BeamSizes[0]);
+static const int FinestBeamSize = BeamSizes[BeamLevels - 1];
+static const int SubBeams = TileSize/FinestBeamSize;
+static const int MinBeamRays = FinestBeamSize;
+/* Frames rendered from reprojected depth before all beams are traced again */
+static const int MaxHistoryAge = 16;
+/* Camera movement relative to the closest hit of the previous frame above
+ * which it is treated as a cut and the history is dropped */
+static const float MaxHistoryShift = 0.2f;
+
+struct Renderer::FrameParams {
+    Mat4 tform;
+    Vec3 pos;
+    Vec3 light;
+    float scale;
+    float aspect;
+    float planeDist;
+    float zx, zy, zz;
+    /* Number of beam levels traced, the last of which is the finest */
+    int beamLevels;
+    /* Footprint of a pixel per unit of distance along a ray */
+    float lodScale;
+    int stride;
+};
+
+/* Share of its light that a surface keeps if the light is blocked */
+static const float ShadowLight = 0.35f;
+
+/* Traces a ray towards the light from every hit of a packet and returns the
+ * lanes whose light is blocked. Each ray starts where it leaves the voxel
+ * that was hit, so that the voxel does not shadow itself.
+ */
+static uint32 traceShadows(VoxelOctree *tree, const RayPacket &packet, uint32 hits, const PacketHit &hit,
+        const Vec3 &light, ShadowMode mode) {
+    RayPacket shadow;
+    for (int i = 0; i < PacketWidth; i++) {
+        if (!(hits & (1 << i)))
+            continue;
+
+        Vec3 p = Vec3(packet.ox[i], packet.oy[i], packet.oz[i]) + Vec3(packet.dx[i], packet.dy[i], packet.dz[i])*hit.t[i];
+        float size = std::ldexp(1.0f, -hit.level[i]);
+        int32 voxel[] = {hit.x[i], hit.y[i], hit.z[i]};
+        float exitT = std::numeric_limits<float>::infinity();
+        for (int axis = 0; axis < 3; axis++) {
+            float lo = 1.0f + voxel[axis]*size;
+            if (light.a[axis] > 0.0f)
+                exitT = std::min(exitT, (lo + size - p.a[axis])/light.a[axis]);
+            else if (light.a[axis] < 0.0f)
+                exitT = std::min(exitT, (lo - p.a[axis])/light.a[axis]);
+        }
+
+        shadow.ox[i] = p.x;
+        shadow.oy[i] = p.y;
+        shadow.oz[i] = p.z;
+        shadow.dx[i] = light.x;
+        shadow.dy[i] = light.y;
+        shadow.dz[i] = light.z;
+        shadow.tMin[i] = std::max(exitT, 0.0f) + size*1e-3f;
+        shadow.tMax[i] = std::numeric_limits<float>::infinity();
+        shadow.rayScale[i] = 0.0f;
+    }
+
+    if (mode == SHADOWS_PACKETS) {
+        PacketHit shadowHit;
+        return tree->raymarchPacket(shadow, hits, shadowHit, QUERY_ANY_HIT);
+    }
+
+    uint32 blocked = 0;
+    for (int i = 0; i < PacketWidth; i++) {
+        RayHit shadowHit;
+        if ((hits & (1 << i)) && tree->raymarch(Vec3(shadow.ox[i], shadow.oy[i], shadow.oz[i]), light,
+                shadow.tMin[i], shadow.tMax[i], 0.0f, shadowHit, QUERY_ANY_HIT))
+            blocked |= 1u << i;
+    }
+    return blocked;
+}
+
+/* Returns the number of rays traced. starts holds the distance at which rays
+ * start for each square of FinestBeamSize^2 pixels of the tile, or TreeMiss if
+ * they cannot hit anything. entry is the node the rays start in, if known.
+ * Packets are split into single rays if singleRays is set.
+ * Shadow rays are counted and timed in stats, if shadows enables them.
+ * nearT and farT receive the range of hit
+ * distances, or TreeMiss if nothing was hit, and diagonal the size of the
+ * largest voxel that was hit */
+static int traceTile(const RenderTarget &target, int x0, int y0, int x1, int y1, int stride, float scale,
+        float aspect, float zx, float zy, float zz, const Mat4 &tform, const Vec3 &light, VoxelOctree *tree,
+        const Vec3 &pos, const float *starts, const EntryNode *entry, float lodScale, ShadowMode shadows,
+        bool singleRays, RenderStats &stats, float &nearT, float &farT, float &diagonal) {
+    uint32 *buffer = target.color;
+    float *depth   = target.depth;
+    int pitch      = target.pitch;
+
+    RayPacket packet;
+    int pixels[PacketWidth];
+    int lanes = 0;
+    int rayCount = 0;
+    nearT = TreeMiss;
+    farT = 0.0f;
+    diagonal = 0.0f;
+
+    auto tracePacket = [&]() {
+        PacketHit hit;
+        uint32 hits = 0;
+        if (singleRays) {
+            for (int i = 0; i < lanes; i++) {
+                RayHit single;
+                if (!tree->raymarch(Vec3(packet.ox[i], packet.oy[i], packet.oz[i]),
+                        Vec3(packet.dx[i], packet.dy[i], packet.dz[i]), packet.tMin[i], packet.tMax[i],
+                        packet.rayScale[i], single, QUERY_CLOSEST_HIT, entry))
+                    continue;
+                hits |= 1u << i;
+                hit.t[i] = single.t;
+                hit.material[i] = single.material;
+                hit.x[i] = single.x;
+                hit.y[i] = single.y;
+                hit.z[i] = single.z;
+                hit.level[i] = single.level;
+            }
+        } else
+            hits = tree->raymarchPacket(packet, (1u << lanes) - 1, hit, QUERY_CLOSEST_HIT, entry);
+
+        uint32 shadowed = 0;
+        if (shadows != SHADOWS_NONE && hits) {
+            Timer shadowTimer;
+            shadowed = traceShadows(tree, packet, hits, hit, light, shadows);
+            shadowTimer.stop();
+            stats.shadowTime += shadowTimer.elapsed();
+        }
+
+        for (int i = 0; i < lanes; i++) {
+            Vec3 col;
+            /* Rays only stop early at prefiltered nodes, so material 0
+             * means the ray stopped at a node of a paged octree that is
+             * still loading, or that the octree stores no materials */
+            if ((hits & (1 << i)) && hit.material[i] == 0)
+                col = Vec3(0.5f);
+            else if (hits & (1 << i))
+                col = shade(hit.material[i], Vec3(packet.dx[i], packet.dy[i], packet.dz[i]), light);
+            if (shadowed & (1 << i))
+                col *= ShadowLight;
+            if (shadows != SHADOWS_NONE && (hits & (1 << i)))
+                stats.shadowRays++;
+            buffer[pixels[i]] = packColor(col);
+            if (depth)
+                depth[pixels[i]] = (hits & (1 << i)) ? hit.t[i] : std::numeric_limits<float>::infinity();
+
+            if (hits & (1 << i)) {
+                nearT = std::min(nearT, hit.t[i]);
+                farT  = std::max(farT,  hit.t[i]);
+                diagonal = std::max(diagonal, 1.7320508f*std::ldexp(1.0f, -hit.level[i]));
+            }
+        }
+        rayCount += lanes;
+        lanes = 0;
+    };
+
+    /* Trace one ray per stride x stride block in packets, then fill in the rest */
+    float dy = aspect - y0*scale;
+    for (int y = y0; y < y1; ++y, dy -= scale) {
+        if ((y - y0) % stride)
+            continue;
+
+        const float *rowStarts = starts + ((y - y0)/FinestBeamSize)*SubBeams;
+        float dx = -1.0f + x0*scale;
+        for (int x = x0; x < x1; ++x, dx += scale) {
+            if ((x - x0) % stride)
+                continue;
+
+            float minT = rowStarts[(x - x0)/FinestBeamSize];
+            if (minT == TreeMiss) {
+                buffer[x + y*pitch] = 0;
+                if (depth)
+                    depth[x + y*pitch] = std::numeric_limits<float>::infinity();
+                continue;
+            }
+
+            Vec3 dir = Vec3(
+                dx*tform.a11 + dy*tform.a12 + zx,
+                dx*tform.a21 + dy*tform.a22 + zy,
+                dx*tform.a31 + dy*tform.a32 + zz
+            );
+            dir *= invSqrt(dir.x*dir.x + dir.y*dir.y + dir.z*dir.z);
+
+            /* Rays start at the camera rather than at minT, so that the LOD
+             * cutoff grows with the actual distance to the camera */
+            packet.ox[lanes] = pos.x;
+            packet.oy[lanes] = pos.y;
+            packet.oz[lanes] = pos.z;
+            packet.dx[lanes] = dir.x;
+            packet.dy[lanes] = dir.y;
+            packet.dz[lanes] = dir.z;
+            packet.tMin[lanes] = minT;
+            packet.tMax[lanes] = std::numeric_limits<float>::infinity();
+            packet.rayScale[lanes] = lodScale;
+            pixels[lanes] = x + y*pitch;
+
+            if (++lanes == PacketWidth)
+                tracePacket();
+        }
+    }
+    if (lanes)
+        tracePacket();
+
+    if (stride == 1)
+        return rayCount;
+
+    for (int y = y0; y < y1; ++y) {
+        for (int x = x0; x < x1; ++x) {
+            int cornerX = x - ((x - x0) % stride);
+            int cornerY = y - ((y - y0) % stride);
+            if (cornerX != x || cornerY != y) {
+                buffer[x + y*pitch] = buffer[cornerX + cornerY*pitch];
+                if (depth)
+                    depth[x + y*pitch] = depth[cornerX + cornerY*pitch];
+            }
+        }
+    }
+
+    return rayCount;
+}
+
+static uint32 mortonCode(uint32 x, uint32 y) {
+    uint32 code = 0;
+    for (int i = 0; i < 16; i++)
+        code |= ((x >> i) & 1) << (2*i) | ((y >> i) & 1) << (2*i + 1);
+    return code;
+}
+
+Renderer::Renderer(VoxelOctree *tree, const RenderTarget &target)
+: _tree(tree),
+  _target(target),
+  _reproject(false),
+  _shadows(SHADOWS_NONE),
+  _singleRays(false),
+  _hasHistory(false),
+  _historyAge(0),
+  _historyStride(1)
+{
+    _tilesX = (target.width  + TileSize - 1)/TileSize;
+    _tilesY = (target.height + TileSize - 1)/TileSize;
+    for (int i = 0; i < BeamLevels; i++) {
+        BeamLevel beam;
+        beam.size = BeamSizes[i];
+        beam.cellsX = (target.width  + beam.size - 1)/beam.size;
+        beam.cellsY = (target.height + beam.size - 1)/beam.size;
+        beam.corners.resize((beam.cellsX + 1)*(beam.cellsY + 1), TreeMiss);
+        beam.needed.resize(beam.cellsX*beam.cellsY, 0);
+        _beams.push_back(beam);
+    }
+    _tileStart.resize(_tilesX*_tilesY, NeedsBeams);
+    _tileNear.resize(_tilesX*_tilesY, TreeMiss);
+    _tileFar.resize(_tilesX*_tilesY, 0.0f);
+    _tileDiagonal.resize(_tilesX*_tilesY, 0.0f);
+
+    std::vector<std::pair<uint32, uint32>> codes;
+    for (int y = 0; y < _tilesY; y++)
+        for (int x = 0; x < _tilesX; x++)
+            codes.push_back(std::make_pair(mortonCode(x, y), uint32(x + y*_tilesX)));
+    std::sort(codes.begin(), codes.end());
+    for (size_t i = 0; i < codes.size(); i++)
+        _tileOrder.push_back(codes[i].second);
+
+    /* Threads waiting on the pool run tasks as well */
+    _workerCount = ThreadUtils::pool ? int(ThreadUtils::pool->threadCount()) + 1 : 1;
+    _queues.reset(new TileQueue[_workerCount]);
+    _workerStats.resize(_workerCount);
+}
+
+/* Converts a point relative to the camera into pixel coordinates. Returns
+ * false if the point is behind the camera */
+static bool projectPoint(const Mat4 &tform, float planeDist, float scale, float aspect, const Vec3 &p,
+        float &x, float &y) {
+    float cx = p.x*tform.a11 + p.y*tform.a21 + p.z*tform.a31;
+    float cy = p.x*tform.a12 + p.y*tform.a22 + p.z*tform.a32;
+    float cz = p.x*tform.a13 + p.y*tform.a23 + p.z*tform.a33;
+    if (cz <= 1e-4f*std::max(std::fabs(cx), std::fabs(cy)))
+        return false;
+    x = (1.0f + planeDist*cx/cz)/scale;
+    y = (aspect - planeDist*cy/cz)/scale;
+    return true;
+}
+
+/* Finds starting distances for the tiles of the new frame from the tiles of
+ * the previous one. The part of the cone of an old tile between its closest
+ * and farthest hit is projected into the new view, and every new tile it
+ * lands on starts its rays no further than the closest distance that part of
+ * the cone has from the new camera. New tiles that see parts of the scene
+ * outside of the previous view, or that nothing projects onto, are left to
+ * the beams.
+ *
+ * Surfaces that were hidden behind all hits of a tile are not accounted for,
+ * which only matters once the camera moves far enough to uncover more than a
+ * tile. Returns false without touching any tile if the camera moved that far.
+ */
+bool Renderer::reprojectHistory(const FrameParams &params) {
+    const Mat4 &last = _historyTform;
+    const Mat4 &tform = params.tform;
+    Vec3 shift = params.pos - _historyPos;
+    float shiftSq = shift.dot(shift);
+    float shiftLength = std::sqrt(shiftSq);
+
+    float closestHit = *std::min_element(_tileNear.begin(), _tileNear.end());
+    if (shiftLength > closestHit*MaxHistoryShift)
+        return false;
+
+    /* Rays were only traced every stride pixels, so hits may lie up to half
+     * a stride beyond the rays that saw them */
+    float slack = 0.5f*_historyStride;
+
+    auto cornerDir = [&](const Mat4 &m, int tileX, int tileY, int corner) {
+        int x = corner & 1 ? std::min((tileX + 1)*TileSize, _target.width) - 1 : tileX*TileSize;
+        int y = corner & 2 ? std::min((tileY + 1)*TileSize, _target.height) - 1 : tileY*TileSize;
+        float dx = -1.0f + x*params.scale;
+        float dy = params.aspect - y*params.scale;
+        Vec3 dir = Vec3(
+            dx*m.a11 + dy*m.a12 + params.planeDist*m.a13,
+            dx*m.a21 + dy*m.a22 + params.planeDist*m.a23,
+            dx*m.a31 + dy*m.a32 + params.planeDist*m.a33
+        );
+        return dir*invSqrt(dir.x*dir.x + dir.y*dir.y + dir.z*dir.z);
+    };
+
+    for (int tileY = 0; tileY < _tilesY; tileY++) {
+        for (int tileX = 0; tileX < _tilesX; tileX++) {
+            int tile = tileX + tileY*_tilesX;
+            float nearT = _tileNear[tile];
+            if (nearT == TreeMiss)
+                continue;
+
+            /* Bounding box in pixels of the hits between the outermost rays of the tile */
+            float minX = float(_target.width), maxX = -1.0f;
+            float minY = float(_target.height), maxY = -1.0f;
+            float maxShift = -shiftLength;
+            bool behind = false;
+            for (int corner = 0; corner < 4; corner++) {
+                Vec3 dir = cornerDir(last, tileX, tileY, corner);
+                maxShift = std::max(maxShift, dir.dot(shift));
+
+                for (int i = 0; i < 2; i++) {
+                    float x, y;
+                    if (!projectPoint(tform, params.planeDist, params.scale, params.aspect,
+                            _historyPos + dir*(i ? _tileFar[tile] : nearT) - params.pos, x, y)) {
+                        behind = true;
+                        continue;
+                    }
+                    minX = std::min(minX, x);
+                    maxX = std::max(maxX, x);
+                    minY = std::min(minY, y);
+                    maxY = std::max(maxY, y);
+                }
+            }
+
+            /* A point at distance t along direction u is at distance
+             * sqrt(t^2 - 2t*dot(u, shift) + |shift|^2) from the new camera.
+             * dot(u, shift) is bounded over the whole tile by its corners plus
+             * the angle the tile spans, and the expression is smallest for t
+             * closest to that bound. Hits may be anywhere on their voxel */
+            maxShift += shiftLength*TileSize*params.scale;
+            float t = std::min(std::max(maxShift, nearT), _tileFar[tile]);
+            float start = std::sqrt(std::max(t*t - 2.0f*t*maxShift + shiftSq, 0.0f)) - _tileDiagonal[tile];
+            start = std::max(start, 0.0f);
+
+            int x0 = 0, x1 = _tilesX - 1, y0 = 0, y1 = _tilesY - 1;
+            if (!behind) {
+                if (maxX + slack < 0.0f || maxY + slack < 0.0f)
+                    continue;
+                x0 = std::max(int(std::ceil(std::max(minX - slack, 0.0f)))/TileSize, x0);
+                y0 = std::max(int(std::ceil(std::max(minY - slack, 0.0f)))/TileSize, y0);
+                x1 = std::min(int(std::floor(std::min(maxX + slack, float(_target.width))))/TileSize, x1);
+                y1 = std::min(int(std::floor(std::min(maxY + slack, float(_target.height))))/TileSize, y1);
+            }
+
+            for (int y = y0; y <= y1; y++) {
+                for (int x = x0; x <= x1; x++) {
+                    float &dst = _tileStart[x + y*_tilesX];
+                    dst = dst < 0.0f ? start : std::min(dst, start);
+                }
+            }
+        }
+    }
+
+    /* The rays of a tile only pass through the previous view if all of its
+     * corner rays do, both where they start and at infinity */
+    float width = float(_target.width), height = float(_target.height);
+    for (int tileY = 0; tileY < _tilesY; tileY++) {
+        for (int tileX = 0; tileX < _tilesX; tileX++) {
+            float &start = _tileStart[tileX + tileY*_tilesX];
+            if (start < 0.0f)
+                continue;
+
+            for (int corner = 0; corner < 8 && start >= 0.0f; corner++) {
+                Vec3 dir = cornerDir(tform, tileX, tileY, corner & 3);
+                float x, y;
+                if (!projectPoint(last, params.planeDist, params.scale, params.aspect,
+                        corner & 4 ? dir : params.pos + dir*start - _historyPos, x, y) ||
+                        x < -slack || y < -slack || x > width - 1.0f + slack || y > height - 1.0f + slack)
+                    start = NeedsBeams;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* Returns the smallest reprojected starting distance of the tiles that
+ * overlap a cell, or a negative value if any of them has none */
+float Renderer::reprojectedStart(const BeamLevel &beam, int cellX, int cellY) const {
+    int tileX0 = cellX*beam.size/TileSize, tileX1 = std::min(((cellX + 1)*beam.size - 1)/TileSize, _tilesX - 1);
+    int tileY0 = cellY*beam.size/TileSize, tileY1 = std::min(((cellY + 1)*beam.size - 1)/TileSize, _tilesY - 1);
+
+    float start = TreeMiss;
+    for (int tileY = tileY0; tileY <= tileY1; tileY++) {
+        for (int tileX = tileX0; tileX <= tileX1; tileX++) {
+            float tile = _tileStart[tileX + tileY*_tilesX];
+            if (tile < 0.0f)
+                return tile;
+            start = std::min(start, tile);
+        }
+    }
+    return start;
+}
+
+/* Flags the cells of every beam level that have to be traced. Cells with a
+ * reprojected starting distance only need the finest level, which starts
+ * from that distance */
+void Renderer::markBeams(int levels) {
+    BeamLevel &finest = _beams[levels - 1];
+    std::fill(finest.needed.begin(), finest.needed.end(), 1);
+
+    for (int i = levels - 2; i >= 0; i--) {
+        BeamLevel &beam = _beams[i];
+        const BeamLevel &child = _beams[i + 1];
+        int ratio = beam.size/child.size;
+
+        std::fill(beam.needed.begin(), beam.needed.end(), 0);
+        for (int y = 0; y < child.cellsY; y++) {
+            for (int x = 0; x < child.cellsX; x++) {
+                bool needed = i == levels - 2
+                    ? reprojectedStart(child, x, y) < 0.0f
+                    : child.needed[x + y*child.cellsX] != 0;
+                if (needed)
+                    beam.needed[x/ratio + (y/ratio)*beam.cellsX] = 1;
+            }
+        }
+    }
+}
+
+float Renderer::cellStart(const BeamLevel &beam, int cellX, int cellY) const {
+    int cornersX = beam.cellsX + 1;
+    int idx = cellX + cellY*cornersX;
+    return std::min(std::min(beam.corners[idx], beam.corners[idx + 1]),
+        std::min(beam.corners[idx + cornersX], beam.corners[idx + cornersX + 1]));
+}
+
+/* Returns the distance at which the rays of a cell can start before its own
+ * corners are traced */
+float Renderer::parentStart(const FrameParams &params, int level, int cellX, int cellY) const {
+    if (level == params.beamLevels - 1) {
+        float start = reprojectedStart(_beams[level], cellX, cellY);
+        if (start >= 0.0f)
+            return start;
+    }
+    if (level == 0)
+        return 0.0f;
+
+    const BeamLevel &parent = _beams[level - 1];
+    int ratio = parent.size/_beams[level].size;
+    return cellStart(parent, cellX/ratio, cellY/ratio);
+}
+
+/* Traces the corner rays of one beam level, starting where the level above
+ * left off. Rays stop at the first node about as wide as a cell, and the
+ * start of the cell is moved back by the size of that node, since the rays
+ * inside the cell may enter it anywhere. Only the finest level treats rays
+ * that leave the octree as a miss; coarser rays are too far apart for that
+ * to say anything about the rays between them */
+void Renderer::beamPass(const FrameParams &params, int level, uint32 worker) {
+    Timer timer;
+
+    BeamLevel &beam = _beams[level];
+    bool finest = level == params.beamLevels - 1;
+    int cornersX = beam.cellsX + 1;
+    int cornersY = beam.cellsY + 1;
+    int rowStart = (cornersY*worker)/_workerCount;
+    int rowEnd   = (cornersY*(worker + 1))/_workerCount;
+    float beamScale = beam.size*params.scale;
+    float lodScale = 2.0f*beam.size/(params.planeDist*_target.height);
+
+    /* Corner rays are shared by up to four cells and have to start early
+     * enough for all of them. Returns a negative value if no cell needs it */
+    auto cornerStart = [&](int x, int y) {
+        float start = -1.0f;
+        for (int cellY = std::max(y - 1, 0); cellY <= std::min(y, beam.cellsY - 1); cellY++) {
+            for (int cellX = std::max(x - 1, 0); cellX <= std::min(x, beam.cellsX - 1); cellX++) {
+                if (!beam.needed[cellX + cellY*beam.cellsX])
+                    continue;
+                float cell = parentStart(params, level, cellX, cellY);
+                start = start < 0.0f ? cell : std::min(start, cell);
+            }
+        }
+        return start;
+    };
+
+    RayPacket packet;
+    int corners[PacketWidth];
+    int lanes = 0;
+    uint64 rayCount = 0;
+
+    auto tracePacket = [&]() {
+        PacketHit hit;
+        uint32 hits = _tree->raymarchPacket(packet, (1u << lanes) - 1, hit);
+
+        for (int i = 0; i < lanes; i++) {
+            float &dst = beam.corners[corners[i]];
+            if (hits & (1 << i))
+                dst = std::max(hit.t[i] - 1.7320508f*std::ldexp(1.0f, -hit.level[i]), packet.tMin[i]);
+            else
+                dst = finest ? TreeMiss : packet.tMin[i];
+        }
+        rayCount += lanes;
+        lanes = 0;
+    };
+
+    const Mat4 &tform = params.tform;
+    for (int y = rowStart; y < rowEnd; y++) {
+        float dy = params.aspect - y*beamScale;
+        float dx = -1.0f;
+        for (int x = 0; x < cornersX; x++, dx += beamScale) {
+            float minT = cornerStart(x, y);
+            if (minT < 0.0f)
+                continue;
+            if (minT == TreeMiss) {
+                beam.corners[x + y*cornersX] = TreeMiss;
+                continue;
+            }
+
+            Vec3 dir = Vec3(
+                dx*tform.a11 + dy*tform.a12 + params.zx,
+                dx*tform.a21 + dy*tform.a22 + params.zy,
+                dx*tform.a31 + dy*tform.a32 + params.zz
+            );
+            dir *= invSqrt(dir.x*dir.x + dir.y*dir.y + dir.z*dir.z);
+
+            packet.ox[lanes] = params.pos.x;
+            packet.oy[lanes] = params.pos.y;
+            packet.oz[lanes] = params.pos.z;
+            packet.dx[lanes] = dir.x;
+            packet.dy[lanes] = dir.y;
+            packet.dz[lanes] = dir.z;
+            packet.tMin[lanes] = minT;
+            packet.tMax[lanes] = std::numeric_limits<float>::infinity();
+            packet.rayScale[lanes] = lodScale;
+            corners[lanes] = x + y*cornersX;
+
+            if (++lanes == PacketWidth)
+                tracePacket();
+        }
+    }
+    if (lanes)
+        tracePacket();
+
+    timer.stop();
+    _workerStats[worker].coarseTime += timer.elapsed();
+    _workerStats[worker].coarseRays += rayCount;
+}
+
+bool Renderer::acquireTile(uint32 worker, uint32 &tile) {
+    std::atomic<uint64> &own = _queues[worker].range;
+
+    uint64 range = own.load();
+    while (uint32(range) < uint32(range >> 32)) {
+        uint64 next = range + 1;
+        if (own.compare_exchange_weak(range, next)) {
+            tile = uint32(range);
+            return true;
+        }
+    }
+
+    for (int i = 1; i < _workerCount; i++) {
+        std::atomic<uint64> &victim = _queues[(worker + i) % _workerCount].range;
+
+        range = victim.load();
+        while (true) {
+            uint32 head = uint32(range), tail = uint32(range >> 32);
+            if (head >= tail)
+                break;
+
+            uint32 mid = tail - (tail - head + 1)/2;
+            if (victim.compare_exchange_weak(range, uint64(head) | (uint64(mid) << 32))) {
+                /* Our own queue is empty, so no thief can be modifying it */
+                own.store(uint64(mid + 1) | (uint64(tail) << 32));
+                tile = mid;
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+/* Finds the node that the rays of a tile start in. They start between the
+ * closest and the farthest start of its beams, within the rays through the
+ * corner pixels of the tile, and the deepest node around that part of the
+ * frustum lets them skip most of the descent from the root. Rays that start
+ * elsewhere still find the same hit, see EntryNode.
+ */
+bool Renderer::tileEntry(const FrameParams &params, int x0, int y0, int x1, int y1, const float *starts,
+        EntryNode &entry) const {
+    float nearStart = TreeMiss, farStart = 0.0f;
+    for (int i = 0; i < SubBeams*SubBeams; i++) {
+        if (starts[i] != TreeMiss) {
+            nearStart = std::min(nearStart, starts[i]);
+            farStart = std::max(farStart, starts[i]);
+        }
+    }
+
+    const Mat4 &tform = params.tform;
+    Vec3 lo(TreeMiss), hi(-TreeMiss);
+    for (int corner = 0; corner < 4; corner++) {
+        float dx = -1.0f + (corner & 1 ? x1 - 1 : x0)*params.scale;
+        float dy = params.aspect - (corner & 2 ? y1 - 1 : y0)*params.scale;
+        Vec3 dir = Vec3(
+            dx*tform.a11 + dy*tform.a12 + params.zx,
+            dx*tform.a21 + dy*tform.a22 + params.zy,
+            dx*tform.a31 + dy*tform.a32 + params.zz
+        );
+        dir *= invSqrt(dir.x*dir.x + dir.y*dir.y + dir.z*dir.z);
+
+        for (int i = 0; i < 2; i++) {
+            Vec3 p = params.pos + dir*(i ? farStart : nearStart);
+            for (int axis = 0; axis < 3; axis++) {
+                lo.a[axis] = std::min(lo.a[axis], p.a[axis]);
+                hi.a[axis] = std::max(hi.a[axis], p.a[axis]);
+            }
+        }
+    }
+
+    /* The rays in between bulge out slightly at the far end */
+    float margin = 1e-4f*farStart;
+    return _tree->findEntryNode(lo - Vec3(margin), hi + Vec3(margin), entry);
+}
+
+void Renderer::renderTile(const FrameParams &params, uint32 tile, RenderStats &stats) {
+    int tileX = tile % _tilesX;
+    int tileY = tile / _tilesX;
+    int x0 = tileX*TileSize, x1 = std::min(x0 + TileSize, _target.width);
+    int y0 = tileY*TileSize, y1 = std::min(y0 + TileSize, _target.height);
+
+    const BeamLevel &beam = _beams[params.beamLevels - 1];
+    float starts[SubBeams*SubBeams];
+    bool empty = true;
+    for (int y = 0; y < SubBeams; y++) {
+        for (int x = 0; x < SubBeams; x++) {
+            int cellX = (x0 + x*FinestBeamSize)/beam.size;
+            int cellY = (y0 + y*FinestBeamSize)/beam.size;
+            float start = TreeMiss;
+            if (cellX < beam.cellsX && cellY < beam.cellsY)
+                start = cellStart(beam, cellX, cellY);
+            starts[x + y*SubBeams] = start;
+            empty = empty && start == TreeMiss;
+        }
+    }
+
+    if (empty) {
+        for (int y = y0; y < y1; y++) {
+            std::memset(_target.color + y*_target.pitch + x0, 0, (x1 - x0)*sizeof(uint32));
+            if (_target.depth)
+                std::fill(_target.depth + y*_target.pitch + x0, _target.depth + y*_target.pitch + x1,
+                        std::numeric_limits<float>::infinity());
+        }
+        _tileNear[tile] = TreeMiss;
+        return;
+    }
+
+    Timer timer;
+    EntryNode entry;
+    bool hasEntry = tileEntry(params, x0, y0, x1, y1, starts, entry);
+    stats.tileRays += traceTile(_target, x0, y0, x1, y1, params.stride, params.scale, params.aspect,
+            params.zx, params.zy, params.zz, params.tform, params.light, _tree, params.pos,
+            starts, hasEntry ? &entry : 0, params.lodScale, _shadows, _singleRays, stats, _tileNear[tile], _tileFar[tile],
+            _tileDiagonal[tile]);
+    timer.stop();
+    stats.tileTime += timer.elapsed();
+}
+
+void Renderer::tilePass(const FrameParams &params, uint32 worker) {
+    RenderStats &stats = _workerStats[worker];
+
+    uint32 tile;
+    while (acquireTile(worker, tile))
+        renderTile(params, _tileOrder[tile], stats);
+}
+
+void Renderer::render(const Mat4 &invModelView, const RenderQuality &quality) {
+    FrameParams params;
+    params.tform = invModelView;
+    params.pos = params.tform*Vec3() + _tree->center() + Vec3(1.0);
+    params.tform.a14 = params.tform.a24 = params.tform.a34 = 0.0f;
+
+    float planeDist = 1.0f/std::tan(float(M_PI)/6.0f);
+    params.planeDist = planeDist;
+    params.scale = 2.0f/_target.width;
+    params.aspect = _target.height/float(_target.width);
+    params.zx = planeDist*params.tform.a13;
+    params.zy = planeDist*params.tform.a23;
+    params.zz = planeDist*params.tform.a33;
+    params.stride = std::max(quality.stride, 1);
+    params.beamLevels = 1;
+    while (params.beamLevels < BeamLevels && BeamSizes[params.beamLevels] >= MinBeamRays*params.stride)
+        params.beamLevels++;
+    /* Without prefiltered materials, rays that stop early have nothing to show */
+    params.lodScale = _tree->isPrefiltered() ? quality.lodScale*params.scale*params.stride/planeDist : 0.0f;
+    params.light = (params.tform*Vec3(-1.0, 1.0, -1.0)).normalize();
+
+    /* Tiles rendered at a coarser stride may have missed voxels that a
+     * finer frame would see, so their history is not used for it */
+    std::fill(_tileStart.begin(), _tileStart.end(), NeedsBeams);
+    if (_reproject && _hasHistory && _historyAge < MaxHistoryAge && params.stride >= _historyStride &&
+            reprojectHistory(params)) {
+        _historyAge++;
+    } else {
+        _historyAge = 0;
+    }
+    _hasHistory = true;
+    _historyTform = params.tform;
+    _historyPos = params.pos;
+    _historyStride = params.stride;
+
+    uint32 tileCount = uint32(_tileOrder.size());
+    for (int i = 0; i < _workerCount; i++) {
+        uint64 head = (uint64(tileCount)*i)/_workerCount;
+        uint64 tail = (uint64(tileCount)*(i + 1))/_workerCount;
+        _queues[i].range.store(head | (tail << 32));
+        _workerStats[i] = RenderStats();
+    }
+
+    markBeams(params.beamLevels);
+
+    if (_workerCount == 1) {
+        for (int level = 0; level < params.beamLevels; level++)
+            beamPass(params, level, 0);
+        tilePass(params, 0);
+        return;
+    }
+
+    /* Each level starts from the one above, so they run one after another */
+    ThreadPool *pool = ThreadUtils::pool;
+    for (int level = 0; level < params.beamLevels; level++) {
+        pool->yield(*pool->enqueue([&](uint32 worker, uint32, uint32) {
+            beamPass(params, level, worker);
+        }, _workerCount));
+    }
+    pool->yield(*pool->enqueue([&](uint32 worker, uint32, uint32) {
+        tilePass(params, worker);
+    }, _workerCount));
+}
+
+void Renderer::setReprojection(bool enabled) {
+    _reproject = enabled;
+}
+
+void Renderer::setShadows(ShadowMode mode) {
+    _shadows = mode;
+}
+
+void Renderer::setSingleRays(bool enabled) {
+    _singleRays = enabled;
+}
+
+RenderStats Renderer::stats() const {
+    RenderStats result;
+    for (int i = 0; i < _workerCount; i++)
+        result += _workerStats[i];
+    return result;
+}
@@ -0,0 +1,210 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#ifndef RENDERER_HPP_
+#define RENDERER_HPP_
+
+#include "math/Mat4.hpp"
+#include "math/Vec3.hpp"
+
+#include "IntTypes.hpp"
+
+#include <atomic>
+#include <memory>
+#include <vector>
+
+class VoxelOctree;
+struct EntryNode;
+
+/* Framebuffer the renderer writes into. pitch is given in pixels. The depth
+ * buffer is optional and receives the distance from the camera to the first
+ * hit along each ray, or infinity for pixels that miss the octree.
+ */
+struct RenderTarget {
+    int width, height;
+    int pitch;
+    uint32 *color;
+    float *depth;
+};
+
+/* Work done while rendering a frame, split into the coarse pass that traces
+ * the beams to find where rays can start and the per-pixel tracing in the
+ * tiles. Shadow rays are traced in the tiles, so their time is also part of
+ * the tile time.
+ * Times are summed over all threads.
+ */
+struct RenderStats {
+    double coarseTime, tileTime, shadowTime;
+    uint64 coarseRays, tileRays, shadowRays;
+
+    RenderStats() : coarseTime(0.0), tileTime(0.0), shadowTime(0.0), coarseRays(0), tileRays(0), shadowRays(0) {}
+
+    RenderStats &operator+=(const RenderStats &o) {
+        coarseTime += o.coarseTime;
+        tileTime   += o.tileTime;
+        shadowTime += o.shadowTime;
+        coarseRays += o.coarseRays;
+        tileRays   += o.tileRays;
+        shadowRays += o.shadowRays;
+        return *this;
+    }
+};
+
+/* How much detail a frame is rendered with. Only one ray is traced for each
+ * stride x stride block of pixels, and on prefiltered octrees rays stop at
+ * nodes that cover about lodScale such blocks on screen. The default is full
+ * quality.
+ */
+struct RenderQuality {
+    int stride;
+    float lodScale;
+
+    RenderQuality() : stride(1), lodScale(1.0f) {}
+    RenderQuality(int stride_, float lodScale_) : stride(stride_), lodScale(lodScale_) {}
+
+    bool isFull() const {
+        return stride == 1 && lodScale <= 1.0f;
+    }
+};
+
+/* How shadow rays towards the light are traced from every hit, if at all.
+ * Packets use the vectorized stack walk. Single rays go through
+ * VoxelOctree::raymarch one at a time, which follows the neighbor links of
+ * octrees that have them, see VoxelOctree::buildRopes. Both give the same
+ * image.
+ */
+enum ShadowMode {
+    SHADOWS_NONE,
+    SHADOWS_PACKETS,
+    SHADOWS_SINGLE_RAYS
+};
+
+static const int TileSize = 8;
+
+Vec3 shade(int intNormal, const Vec3 &ray, const Vec3 &light);
+uint32 packColor(const Vec3 &col);
+Vec3 unpackColor(uint32 color);
+
+/* Renders frames on the thread pool, or on the calling thread if none is
+ * running. Before any pixel is traced, a hierarchy of beams finds how far
+ * the rays of each part of the screen can skip ahead; see BeamLevel. The
+ * screen is then split into tiles of TileSize^2 pixels which are handed out
+ * in Morton order. Every worker starts on its own contiguous run
+ * of tiles and steals half of the remaining run of another worker once it
+ * runs out, so a few expensive tiles do not hold up the whole frame.
+ */
+class Renderer {
+    /* Remaining tiles of a worker, stored as head | (tail << 32) so that the
+     * owner and thieves can update it with a single compare and swap.
+     * Padded to avoid false sharing between workers.
+     */
+    struct TileQueue {
+        std::atomic<uint64> range;
+        uint8 padding[64 - sizeof(std::atomic<uint64>)];
+    };
+
+    /* One level of the beam hierarchy, from coarse to fine. A ray is traced
+     * through every corner of its cells, starting where the level above
+     * found the first surface near that corner, and stops at the first node
+     * about as large as a cell. Rays within a cell can start at the closest
+     * of these stops, minus the size of the node they stopped at.
+     */
+    struct BeamLevel {
+        int size;
+        int cellsX, cellsY;
+        /* Starting distance found by the ray through each corner, or
+         * TreeMiss if it left the octree */
+        std::vector<float> corners;
+        /* Cells whose corners are traced this frame. Coarser levels skip
+         * tiles with a reprojected starting distance */
+        std::vector<uint8> needed;
+    };
+
+    VoxelOctree *_tree;
+    RenderTarget _target;
+
+    int _tilesX, _tilesY;
+    std::vector<BeamLevel> _beams;
+    std::vector<uint32> _tileOrder;
+    /* Reprojected distance at which the finest beams of each tile start, or
+     * a negative value if the coarser beams have to find it */
+    std::vector<float> _tileStart;
+
+    /* Range of hit distances and size of the largest voxel hit in each tile
+     * of the previous frame, and the camera it was rendered with */
+    bool _reproject;
+    ShadowMode _shadows;
+    bool _singleRays;
+    bool _hasHistory;
+    int _historyAge;
+    int _historyStride;
+    Mat4 _historyTform;
+    Vec3 _historyPos;
+    std::vector<float> _tileNear, _tileFar, _tileDiagonal;
+
+    int _workerCount;
+    std::unique_ptr<TileQueue[]> _queues;
+    std::vector<RenderStats> _workerStats;
+
+    struct FrameParams;
+
+    bool reprojectHistory(const FrameParams &params);
+    float reprojectedStart(const BeamLevel &beam, int cellX, int cellY) const;
+    void markBeams(int levels);
+    float cellStart(const BeamLevel &beam, int cellX, int cellY) const;
+    float parentStart(const FrameParams &params, int level, int cellX, int cellY) const;
+    void beamPass(const FrameParams &params, int level, uint32 worker);
+    void tilePass(const FrameParams &params, uint32 worker);
+    bool tileEntry(const FrameParams &params, int x0, int y0, int x1, int y1, const float *starts,
+            EntryNode &entry) const;
+    bool acquireTile(uint32 worker, uint32 &tile);
+    void renderTile(const FrameParams &params, uint32 tile, RenderStats &stats);
+
+public:
+    Renderer(VoxelOctree *tree, const RenderTarget &target);
+
+    void render(const Mat4 &invModelView, const RenderQuality &quality = RenderQuality());
+
+    /* If enabled, the starting distances of most tiles are found by
+     * reprojecting the depth of the previous frame to the new camera, and
+     * only the finest beams are traced for tiles that have history. Meant for
+     * successive frames of a moving camera; all beams are still traced
+     * every few frames and whenever a frame is finer than the one before, so
+     * that a refined image does not depend on the history.
+     */
+    void setReprojection(bool enabled);
+
+    /* Shadow rays are off by default */
+    void setShadows(ShadowMode mode);
+
+    /* Traces primary rays one at a time with VoxelOctree::raymarch instead
+     * of in packets. The image is the same; this only exists to measure
+     * what the packets gain */
+    void setSingleRays(bool enabled);
+
+    /* Statistics of the last frame */
+    RenderStats stats() const;
+};
+
+#endif /* RENDERER_HPP_ */
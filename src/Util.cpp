@@ -55,3 +55,33 @@ std::string prettyPrintMemory(uint64 size)
 
     return out.str();
 }
+
+void seekFile(FILE *fp, uint64 offset)
+{
+#ifdef _MSC_VER
+    _fseeki64(fp, offset, SEEK_SET);
+#elif __APPLE__
+    fseeko(fp, offset, SEEK_SET);
+#else
+    fseeko64(fp, offset, SEEK_SET);
+#endif
+}
+
+uint64 fileSize(FILE *fp)
+{
+#ifdef _MSC_VER
+    uint64 position = _ftelli64(fp);
+    _fseeki64(fp, 0, SEEK_END);
+    uint64 size = _ftelli64(fp);
+#elif __APPLE__
+    uint64 position = ftello(fp);
+    fseeko(fp, 0, SEEK_END);
+    uint64 size = ftello(fp);
+#else
+    uint64 position = ftello64(fp);
+    fseeko64(fp, 0, SEEK_END);
+    uint64 size = ftello64(fp);
+#endif
+    seekFile(fp, position);
+    return size;
+}
@@ -29,8 +29,16 @@ freely, subject to the following restrictions:
 #include "IntTypes.hpp"
 
 #include <string>
+#include <stdio.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
 
 std::string prettyPrintMemory(uint64 size);
+/* fseek with 64 bit offsets on all platforms */
+void seekFile(FILE *fp, uint64 offset);
+/* Size of the whole file in bytes. Leaves the file position unchanged */
+uint64 fileSize(FILE *fp);
 
 static inline float uintBitsToFloat(uint32 i) {
     union { uint32 i; float f; } unionHack;
@@ -116,4 +124,31 @@ static inline int findHighestBit(uint32 v) {
     return r;
 }
 
+/* Index of the least significant set bit. v must not be zero */
+static inline int findLowestBit(uint32 v) {
+#if defined(__GNUC__)
+    return __builtin_ctz(v);
+#elif defined(_MSC_VER)
+    unsigned long r;
+    _BitScanForward(&r, v);
+    return int(r);
+#else
+    int r = 0;
+    while (!(v & 1))
+        v >>= 1, r++;
+    return r;
+#endif
+}
+
+/* Hints the CPU to pull the cache line containing p into the cache. Never faults */
+static inline void prefetchMemory(const void *p) {
+#if defined(__GNUC__)
+    __builtin_prefetch(p);
+#elif defined(_MSC_VER)
+    _mm_prefetch((const char *)p, _MM_HINT_T0);
+#else
+    (void)p;
+#endif
+}
+
 #endif /* UTIL_H_ */
@@ -0,0 +1,137 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+
+#include "VoxelOctree.hpp"
+#include "FrameGovernor.hpp"
+#include "Renderer.hpp"
+#include "Viewer.hpp"
+#include "Events.hpp"
+#include "Timer.hpp"
+
+#include "math/MatrixStack.hpp"
+#include "math/Mat4.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <SDL.h>
+
+/* Screen resolution */
+static const int GWidth  = 1280;
+static const int GHeight = 720;
+/* Stop refining a view of a paged octree after this many frames if the cache
+ * is too small to hold everything that is visible */
+static const int MaxRefinementPasses = 64;
+
+void runViewer(VoxelOctree *tree, double targetFrameTime) {
+    SDL_Init(SDL_INIT_VIDEO);
+
+    SDL_WM_SetCaption("Sparse Voxel Octrees", "Sparse Voxel Octrees");
+    SDL_Surface *backBuffer = SDL_SetVideoMode(GWidth, GHeight, 32, SDL_SWSURFACE);
+
+    if (SDL_MUSTLOCK(backBuffer))
+        SDL_LockSurface(backBuffer);
+
+    RenderTarget target;
+    target.width  = GWidth;
+    target.height = GHeight;
+    target.pitch  = backBuffer->pitch/4;
+    target.color  = (uint32 *)backBuffer->pixels;
+    target.depth  = 0;
+
+    Renderer renderer(tree, target);
+    FrameGovernor governor(targetFrameTime, tree->isPrefiltered());
+    renderer.setReprojection(true);
+
+    float radius = 1.0f;
+    float pitch = 0.0f;
+    float yaw = 0.0f;
+    bool moving = false;
+    int refinementPasses = 0;
+
+    MatrixStack::set(VIEW_STACK, Mat4::translate(Vec3(0.0f, 0.0f, -radius)));
+    MatrixStack::set(MODEL_STACK, Mat4());
+
+    while (true) {
+        Mat4 tform;
+        MatrixStack::get(INV_MODELVIEW_STACK, tform);
+
+        Timer frameTimer;
+        RenderQuality quality = governor.nextFrame(moving);
+        renderer.render(tform, quality);
+        frameTimer.stop();
+        governor.frameDone(frameTimer.elapsed());
+        moving = false;
+
+        if (SDL_MUSTLOCK(backBuffer))
+            SDL_UnlockSurface(backBuffer);
+
+        SDL_UpdateRect(backBuffer, 0, 0, 0, 0);
+
+        bool missingPages = tree->updatePages() && ++refinementPasses < MaxRefinementPasses;
+        if (missingPages || !governor.isRefined()) {
+            /* The frame was rendered at reduced quality, or some nodes of a
+             * paged octree were not loaded yet. Render the same view again,
+             * one step finer or once the nodes arrived, unless the user did
+             * something */
+            if (missingPages)
+                tree->waitForPages();
+            if (!checkEvents()) {
+                if (SDL_MUSTLOCK(backBuffer))
+                    SDL_LockSurface(backBuffer);
+                continue;
+            }
+        } else {
+            int event;
+            while ((event = waitEvent()) && (event == SDL_MOUSEMOTION && !getMouseDown(0) && !getMouseDown(1)));
+        }
+        refinementPasses = 0;
+
+        if (getKeyDown(SDLK_ESCAPE))
+            break;
+
+        float mx = float(getMouseXSpeed());
+        float my = float(getMouseYSpeed());
+        if (getMouseDown(0) && (mx != 0 || my != 0)) {
+            pitch = std::fmod(pitch - my, 360.0f);
+            yaw = std::fmod(yaw + (std::fabs(pitch) > 90.0f ? mx : -mx), 360.0f);
+
+                 if (pitch >  180.0f) pitch -= 360.0f;
+            else if (pitch < -180.0f) pitch += 360.0f;
+
+            MatrixStack::set(MODEL_STACK, Mat4::rotXYZ(Vec3(pitch, 0.0f, 0.0f))*
+                    Mat4::rotXYZ(Vec3(0.0f, yaw, 0.0f)));
+            moving = true;
+        } else if (getMouseDown(1) && my != 0) {
+            radius *= std::min(std::max(1.0f - my*0.01f, 0.5f), 1.5f);
+            radius = std::min(radius, 25.0f);
+            MatrixStack::set(VIEW_STACK, Mat4::translate(Vec3(0.0f, 0.0f, -radius)));
+            moving = true;
+        }
+
+        if (SDL_MUSTLOCK(backBuffer))
+            SDL_LockSurface(backBuffer);
+    }
+
+    SDL_Quit();
+}
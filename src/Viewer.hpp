@@ -21,26 +21,17 @@ freely, subject to the following restrictions:
    distribution.
 */
 
-#ifndef THREADBARRIER_HPP_
-#define THREADBARRIER_HPP_
 
-#include <SDL.h> /* Cannot use forward declaration for thread primitives, unfortunately */
+#ifndef VIEWER_HPP_
+#define VIEWER_HPP_
 
-#include <atomic>
+class VoxelOctree;
 
-class ThreadBarrier {
-    int _numThreads;
-    std::atomic<int> _waitCount;
+/* Opens an SDL window and renders the octree interactively until escape is
+ * pressed. While the camera moves, the quality of each frame is lowered as
+ * far as needed to render it within targetFrameTime seconds; when it stops,
+ * the image is refined back to full quality.
+ */
+void runViewer(VoxelOctree *tree, double targetFrameTime);
 
-    SDL_mutex *_barrierMutex;
-    SDL_sem *_turnstile1, *_turnstile2;
-public:
-    ThreadBarrier(int numThreads);
-     ~ThreadBarrier();
-
-    void waitPre();
-    void waitPost();
-    void releaseAll();
-};
-
-#endif /* THREADBARRIER_HPP_ */
+#endif /* VIEWER_HPP_ */
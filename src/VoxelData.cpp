@@ -158,6 +158,11 @@ void VoxelData::buildTopLut() {
 }
 
 void VoxelData::buildLowLut() {
+    /* Only occupied cells are set below, so stale entries of a previously
+     * cached block have to go first. Destructive reads clear most of them,
+     * but non-destructive passes over the data leave them all in place */
+    std::memset(_lowTable[_lowLutLevels - 1], 0, size_t(1) << size_t((_lowLutLevels - 1)*3));
+
     int threadCount = ThreadUtils::pool->threadCount();
     ThreadUtils::pool->enqueue([&](uint32 id, uint32, uint32) {
         int start = (((_bufferD/2)*id)/threadCount)*2;
@@ -176,6 +181,8 @@ void VoxelData::buildLowLut() {
 
 void VoxelData::cacheData(int x, int y, int z, int w, int h, int d) {
     if (_loader)  {
+        /* The loader accumulates into empty cells */
+        std::memset(_bufferedData.get(), 0, size_t(w)*size_t(h)*size_t(d)*sizeof(uint32));
         _loader->processBlock(_bufferedData.get(), x, y, z, w, h, d);
         return;
     }
@@ -294,6 +301,10 @@ int VoxelData::sideLength() const {
     return std::max(_virtualDataW, std::max(_virtualDataH, _virtualDataD));
 }
 
+int VoxelData::cacheBlockSize() const {
+    return int(std::min(_maxCacheableSize, size_t(sideLength())));
+}
+
 Vec3 VoxelData::getCenter() const {
     return Vec3(
         _dataW*0.5f/sideLength(),
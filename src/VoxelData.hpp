@@ -120,6 +120,20 @@ public:
         return value;
     }
 
+    /* Same as cubeContainsVoxelsDestructive, but leaves the lookup table untouched */
+    inline bool cubeContainsVoxels(int x, int y, int z, int size) {
+        if (x >= _dataW || y >= _dataH || z >= _dataD)
+            return false;
+
+        int bit = findHighestBit(size);
+        if (size == 1)
+            return getVoxel(x, y, z) != 0;
+        else if (bit < _lowLutLevels)
+            return getLowLut(_lowLutLevels - bit, (x - _bufferX) >> bit, (y - _bufferY) >> bit, (z - _bufferZ) >> bit) != 0;
+        else
+            return getTopLut(_highestVirtualBit - bit, x >> bit, y >> bit, z >> bit) != 0;
+    }
+
     inline bool cubeContainsVoxelsDestructive(int x, int y, int z, int size) {
         if (x >= _dataW || y >= _dataH || z >= _dataD)
             return false;
@@ -140,6 +154,8 @@ public:
     void prepareDataAccess(int x, int y, int z, int size);
 
     int sideLength() const;
+    /* Side length of the largest cube that is cached in memory as a whole */
+    int cacheBlockSize() const;
     Vec3 getCenter() const;
 };
 
@@ -23,127 +23,302 @@ freely, subject to the following restrictions:
 
 #include "VoxelOctree.hpp"
 #include "VoxelData.hpp"
+#include "OctreeStream.hpp"
+#include "OctreeFile.hpp"
+#include "MappedFile.hpp"
+#include "PageCache.hpp"
 #include "Debug.hpp"
 #include "Util.hpp"
 
+#include "thread/ThreadUtils.hpp"
+
 #include "third-party/lz4.h"
 
+#include <unordered_set>
 #include <algorithm>
+#include <cstring>
+#include <atomic>
 #include <iostream>
+#include <limits>
+#include <string>
 #include <stdio.h>
 #include <cmath>
 
-static const uint32 BitCount[] = {
-    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
-    4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
+/* Block size of the original .oct format, where blocks were compressed as one stream */
+static const size_t LegacyCompressionBlockSize = 64*1024*1024;
+/* LZ4 never shrinks data by more than this factor */
+static const uint64 LZ4MaxCompressionRatio = 255;
+
+/* Arrays behind OctreeRopes */
+struct RopeStorage {
+    std::vector<RopeNode> nodes;
+    std::vector<uint32> neighbors;
+    std::vector<uint64> octreeNodes;
 };
 
-static const size_t CompressionBlockSize = 64*1024*1024;
+static AttributeLayout fileAttributeLayout(const OctreeFile &file) {
+    if (!file.hasAttributes())
+        return ATTRIBUTES_NONE;
+    return file.hasSeparateAttributes() ? ATTRIBUTES_SEPARATE : ATTRIBUTES_INTERLEAVED;
+}
 
-VoxelOctree::VoxelOctree(const char *path) : _voxels(0) {
-    FILE *fp = fopen(path, "rb");
+VoxelOctree::VoxelOctree(const char *path) : _octreeSize(0), _nodes(0), _isDag(false), _dagRoot(0), _attributeOffset(0), _attributes(ATTRIBUTES_INTERLEAVED), _prefiltered(false), _bricks(false), _farPointers(true), _voxels(0), _nextSubtree(0), _subtreeSize(0), _nextExtent(0) {
+    load(path);
+}
 
-    if (fp) {
+bool VoxelOctree::load(const char *path) {
+    OctreeFile file(path);
 
-        fread(_center.a, sizeof(float), 3, fp);
-        fread(&_octreeSize, sizeof(uint64), 1, fp);
+    if (file.isLegacy())
+        return loadLegacy(path);
+    if (!file.isOpen()) {
+        std::cout << "Failed to open octree file " << path << std::endl;
+        return false;
+    }
 
-        _octree.reset(new uint32[_octreeSize]);
+    _center = file.center();
+    _octreeSize = file.octreeSize();
+    _isDag = file.isDag();
+    _attributes = fileAttributeLayout(file);
+    _prefiltered = file.isPrefiltered();
+    _bricks = file.hasBricks();
+    _farPointers = file.hasFarPointers();
+
+    if (!file.isCompressed()) {
+        _mapping.reset(new MappedFile(path));
+        if (_mapping->isOpen() && _mapping->size() >= file.dataOffset() + _octreeSize*sizeof(uint32)) {
+            _nodes = reinterpret_cast<const uint32 *>(_mapping->data() + file.dataOffset());
+            readDagHeader();
+            std::cout << "Octree size: " << prettyPrintMemory(_octreeSize*sizeof(uint32))
+                      << " (memory mapped)" << std::endl;
+            return true;
+        }
+        _mapping.reset();
+    }
 
-        std::unique_ptr<char[]> buffer(new char[LZ4_compressBound(CompressionBlockSize)]);
-        char *dst = reinterpret_cast<char *>(_octree.get());
+    _octree.reset(new uint32[size_t(_octreeSize)]);
+    _nodes = _octree.get();
 
-        LZ4_streamDecode_t *stream = LZ4_createStreamDecode();
-        LZ4_setStreamDecode(stream, dst, 0);
+    uint32 blockCount = uint32(file.blockCount());
+    std::atomic<bool> success(true);
+    ThreadUtils::parallelFor(0, blockCount, ThreadUtils::pool ? std::max(blockCount, 1u) : 1, [&](uint32 i) {
+        if (!file.readBlock(i, _octree.get() + file.blockStart(i)))
+            success = false;
+    });
 
-        uint64 compressedSize = 0;
-        for (uint64 offset = 0; offset < _octreeSize*sizeof(uint32); offset += CompressionBlockSize) {
-            uint64 compSize;
-            fread(&compSize, sizeof(uint64), 1, fp);
-            fread(buffer.get(), sizeof(char), size_t(compSize), fp);
+    if (!success) {
+        std::cout << "Failed to decompress octree file " << path << std::endl;
+        unload();
+        return false;
+    }
+    readDagHeader();
+    /* Files from before FlagNoFarPointers may still get by without them */
+    if (_farPointers)
+        updateFarPointers();
 
-            int outSize = std::min<int>(_octreeSize*sizeof(uint32) - offset, CompressionBlockSize);
-            LZ4_decompress_fast_continue(stream, buffer.get(), dst + offset, outSize);
-            compressedSize += compSize + 8;
-        }
-        LZ4_freeStreamDecode(stream);
+    std::cout << "Octree size: " << prettyPrintMemory(_octreeSize*sizeof(uint32))
+              << " Compressed size: " << prettyPrintMemory(file.compressedSize()) << std::endl;
+    return true;
+}
 
-        fclose(fp);
+void VoxelOctree::unload() {
+    _octree.reset();
+    _mapping.reset();
+    _nodes = 0;
+    _octreeSize = 0;
+    _isDag = false;
+}
 
-        std::cout << "Octree size: " << prettyPrintMemory(_octreeSize*sizeof(uint32))
-                  << " Compressed size: " << prettyPrintMemory(compressedSize) << std::endl;
+VoxelOctree::VoxelOctree(const char *path, size_t cacheSize)
+: _octreeSize(0),
+  _nodes(0),
+  _isDag(false),
+  _dagRoot(0),
+  _attributeOffset(0),
+  _attributes(ATTRIBUTES_INTERLEAVED),
+  _prefiltered(false),
+  _bricks(false),
+  _farPointers(true),
+  _voxels(0),
+  _nextSubtree(0),
+  _subtreeSize(0),
+  _nextExtent(0)
+{
+    _pages.reset(new PageCache(path, cacheSize));
+    if (!_pages->isOpen()) {
+        _pages.reset();
+        std::cout << "Octree file " << path << " does not support paging, loading it completely" << std::endl;
+        load(path);
+        return;
     }
+
+    _center = _pages->file().center();
+    _octreeSize = _pages->file().octreeSize();
+    _isDag = _pages->file().isDag();
+    _attributes = fileAttributeLayout(_pages->file());
+    _prefiltered = _pages->file().isPrefiltered();
+    _bricks = _pages->file().hasBricks();
+    _farPointers = _pages->file().hasFarPointers();
+    readDagHeader();
+
+    std::cout << "Octree size: " << prettyPrintMemory(_octreeSize*sizeof(uint32))
+              << " (paged, " << prettyPrintMemory(cacheSize) << " cache)" << std::endl;
 }
 
-void VoxelOctree::save(const char *path) {
-    FILE *fp = fopen(path, "wb");
+VoxelOctree::~VoxelOctree() {
+}
 
-    if (fp) {
-        fwrite(_center.a, sizeof(float), 3, fp);
-        fwrite(&_octreeSize, sizeof(uint64), 1, fp);
+bool VoxelOctree::loadLegacy(const char *path) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        std::cout << "Failed to open octree file " << path << std::endl;
+        return false;
+    }
 
-        LZ4_stream_t *stream = LZ4_createStream();
-        LZ4_resetStream(stream);
+    bool success = fread(_center.a, sizeof(float), 3, fp) == 3 && fread(&_octreeSize, sizeof(uint64), 1, fp) == 1;
+    /* Anything without the magic of the block-indexed format ends up here, so
+     * reject sizes that this file cannot possibly hold before allocating */
+    success = success && _octreeSize > 0 && _octreeSize*sizeof(uint32) <= fileSize(fp)*LZ4MaxCompressionRatio;
 
-        std::unique_ptr<char[]> buffer(new char[LZ4_compressBound(CompressionBlockSize)]);
-        const char *src = reinterpret_cast<char *>(_octree.get());
+    uint64 compressedSize = 0;
+    if (success) {
+        _octree.reset(new uint32[_octreeSize]);
+        _nodes = _octree.get();
 
-        uint64 compressedSize = 0;
-        for (uint64 offset = 0; offset < _octreeSize*sizeof(uint32); offset += CompressionBlockSize) {
-            int outSize = int(std::min(_octreeSize*sizeof(uint32) - offset, uint64(CompressionBlockSize)));
-            uint64 compSize = LZ4_compress_continue(stream, src + offset, buffer.get(), outSize);
+        std::unique_ptr<char[]> buffer(new char[LZ4_compressBound(LegacyCompressionBlockSize)]);
+        char *dst = reinterpret_cast<char *>(_octree.get());
 
-            fwrite(&compSize, sizeof(uint64), 1, fp);
-            fwrite(buffer.get(), sizeof(char), size_t(compSize), fp);
+        LZ4_streamDecode_t *stream = LZ4_createStreamDecode();
+        LZ4_setStreamDecode(stream, dst, 0);
 
+        for (uint64 offset = 0; success && offset < _octreeSize*sizeof(uint32); offset += LegacyCompressionBlockSize) {
+            uint64 compSize;
+            int outSize = std::min<int>(_octreeSize*sizeof(uint32) - offset, LegacyCompressionBlockSize);
+            success = fread(&compSize, sizeof(uint64), 1, fp) == 1
+                   && compSize <= uint64(LZ4_compressBound(LegacyCompressionBlockSize))
+                   && fread(buffer.get(), sizeof(char), size_t(compSize), fp) == compSize
+                   && LZ4_decompress_safe_continue(stream, buffer.get(), dst + offset, int(compSize), outSize) == outSize;
             compressedSize += compSize + 8;
         }
+        LZ4_freeStreamDecode(stream);
+    }
+    fclose(fp);
 
-        LZ4_freeStream(stream);
+    if (!success) {
+        std::cout << "Failed to decompress octree file " << path << std::endl;
+        unload();
+        return false;
+    }
+    updateFarPointers();
 
-        fclose(fp);
+    std::cout << "Octree size: " << prettyPrintMemory(_octreeSize*sizeof(uint32))
+              << " Compressed size: " << prettyPrintMemory(compressedSize) << std::endl;
+    return true;
+}
 
-        std::cout << "Octree size: " << prettyPrintMemory(_octreeSize*sizeof(uint32))
-                  << " Compressed size: " << prettyPrintMemory(compressedSize) << std::endl;
+void VoxelOctree::save(const char *path, bool compress, uint64 blockSize) {
+    if (_pages) {
+        std::cout << "Paged octrees cannot be saved" << std::endl;
+        return;
     }
+    uint32 flags = compress ? 0 : uint32(OctreeFile::FlagUncompressed);
+    if (_isDag)
+        flags |= OctreeFile::FlagDag;
+    else if (_attributes == ATTRIBUTES_SEPARATE)
+        flags |= OctreeFile::FlagSeparateAttributes;
+    if (_attributes == ATTRIBUTES_NONE)
+        flags |= OctreeFile::FlagNoAttributes;
+    if (_prefiltered)
+        flags |= OctreeFile::FlagPrefiltered;
+    if (_bricks)
+        flags |= OctreeFile::FlagBricks;
+    if (!_farPointers)
+        flags |= OctreeFile::FlagNoFarPointers;
+    OctreeFile::write(path, _center, _octreeSize, _nodes, 0, flags, blockSize);
+}
+
+VoxelOctree::VoxelOctree()
+: _octreeSize(0),
+  _nodes(0),
+  _isDag(false),
+  _dagRoot(0),
+  _attributeOffset(0),
+  _attributes(ATTRIBUTES_INTERLEAVED),
+  _prefiltered(false),
+  _bricks(false),
+  _farPointers(true),
+  _voxels(0),
+  _nextSubtree(0),
+  _subtreeSize(0),
+  _nextExtent(0)
+{
 }
 
-VoxelOctree::VoxelOctree(VoxelData *voxels)
-: _voxels(voxels)
+VoxelOctree::VoxelOctree(VoxelData *voxels, OctreeLayout layout)
+: _nodes(0),
+  _isDag(false),
+  _dagRoot(0),
+  _attributeOffset(0),
+  _attributes(ATTRIBUTES_INTERLEAVED),
+  _prefiltered(false),
+  _bricks(false),
+  _farPointers(true),
+  _voxels(voxels),
+  _nextSubtree(0),
+  _subtreeSize(0),
+  _nextExtent(0)
 {
-    std::unique_ptr<ChunkedAllocator<uint32>> octreeAllocator(new ChunkedAllocator<uint32>());
-    octreeAllocator->pushBack(0);
+    if (layout == LAYOUT_EXACT) {
+        buildExactLayout();
+    } else {
+        std::unique_ptr<ChunkedAllocator<uint32>> octreeAllocator(new ChunkedAllocator<uint32>());
+        octreeAllocator->pushBack(0);
 
-    buildOctree(*octreeAllocator, 0, 0, 0, _voxels->sideLength(), 0);
-    (*octreeAllocator)[0] |= 1 << 18;
+        buildOctree(*octreeAllocator, 0, 0, 0, _voxels->sideLength(), 0);
+        (*octreeAllocator)[0] |= 1 << 18;
 
-    _octreeSize = octreeAllocator->size() + octreeAllocator->insertionCount();
-    _octree = octreeAllocator->finalize();
+        _octreeSize = octreeAllocator->size() + octreeAllocator->insertionCount();
+        _octree = octreeAllocator->finalize();
+    }
+    _nodes = _octree.get();
     _center = _voxels->getCenter();
+    updateFarPointers();
+}
+
+/* Subtrees of cache blocks are built in parallel once they are at most this
+ * many levels below the block, and never smaller than MinSubtreeSize.
+ */
+static const int SubtreeLevels = 3;
+static const int MinSubtreeSize = 8;
+
+static inline void childPositions(int x, int y, int z, int halfSize, int *posX, int *posY, int *posZ) {
+    for (int i = 0; i < 8; i++) {
+        posX[i] = x + ((i & 1) ? 0 : halfSize);
+        posY[i] = y + ((i & 2) ? 0 : halfSize);
+        posZ[i] = z + ((i & 4) ? 0 : halfSize);
+    }
+}
+
+bool VoxelOctree::splitsIntoSubtrees(int size) const {
+    return ThreadUtils::pool && _subtreeSize == 0 && size == _voxels->cacheBlockSize() &&
+            (size >> SubtreeLevels) >= MinSubtreeSize;
 }
 
 uint64 VoxelOctree::buildOctree(ChunkedAllocator<uint32> &allocator, int x, int y, int z, int size, uint64 descriptorIndex) {
+    if (size == _subtreeSize)
+        return spliceSubtree(allocator, descriptorIndex);
+
     _voxels->prepareDataAccess(x, y, z, size);
 
+    /* Once a cache block is loaded, its subtrees can be built independently */
+    bool parallelBlock = splitsIntoSubtrees(size);
+    if (parallelBlock)
+        buildSubtrees(x, y, z, size);
+
     int halfSize = size >> 1;
 
-    int posX[] = {x + halfSize, x, x + halfSize, x, x + halfSize, x, x + halfSize, x};
-    int posY[] = {y + halfSize, y + halfSize, y, y, y + halfSize, y + halfSize, y, y};
-    int posZ[] = {z + halfSize, z + halfSize, z + halfSize, z + halfSize, z, z, z, z};
+    int posX[8], posY[8], posZ[8];
+    childPositions(x, y, z, halfSize, posX, posY, posZ);
 
     uint64 childOffset = uint64(allocator.size()) - descriptorIndex;
 
@@ -201,146 +376,1669 @@ uint64 VoxelOctree::buildOctree(ChunkedAllocator<uint32> &allocator, int x, int
     if (hasLargeChildren)
         allocator[descriptorIndex] |= 0x10000;
 
+    if (parallelBlock) {
+        _subtrees.clear();
+        _nextSubtree = 0;
+        _subtreeSize = 0;
+    }
+
     return childOffset;
 }
 
-bool VoxelOctree::raymarch(const Vec3 &o, const Vec3 &d, float rayScale, uint32 &normal, float &t) {
-    struct StackEntry {
-        uint64 offset;
-        float maxT;
-    };
-    StackEntry rayStack[MaxScale + 1];
-
-    float ox = o.x, oy = o.y, oz = o.z;
-    float dx = d.x, dy = d.y, dz = d.z;
-
-    if (std::fabs(dx) < 1e-4f) dx = 1e-4f;
-    if (std::fabs(dy) < 1e-4f) dy = 1e-4f;
-    if (std::fabs(dz) < 1e-4f) dz = 1e-4f;
-
-    float dTx = 1.0f/-std::fabs(dx);
-    float dTy = 1.0f/-std::fabs(dy);
-    float dTz = 1.0f/-std::fabs(dz);
-
-    float bTx = dTx*ox;
-    float bTy = dTy*oy;
-    float bTz = dTz*oz;
-
-    uint8 octantMask = 7;
-    if (dx > 0.0f) octantMask ^= 1, bTx = 3.0f*dTx - bTx;
-    if (dy > 0.0f) octantMask ^= 2, bTy = 3.0f*dTy - bTy;
-    if (dz > 0.0f) octantMask ^= 4, bTz = 3.0f*dTz - bTz;
-
-    float minT = std::max(2.0f*dTx - bTx, std::max(2.0f*dTy - bTy, 2.0f*dTz - bTz));
-    float maxT = std::min(     dTx - bTx, std::min(     dTy - bTy,      dTz - bTz));
-    minT = std::max(minT, 0.0f);
-
-    uint32 current = 0;
-    uint64 parent  = 0;
-    int idx     = 0;
-    float posX  = 1.0f;
-    float posY  = 1.0f;
-    float posZ  = 1.0f;
-    int scale   = MaxScale - 1;
-
-    float scaleExp2 = 0.5f;
-
-    if (1.5f*dTx - bTx > minT) idx ^= 1, posX = 1.5f;
-    if (1.5f*dTy - bTy > minT) idx ^= 2, posY = 1.5f;
-    if (1.5f*dTz - bTz > minT) idx ^= 4, posZ = 1.5f;
-
-    while (scale < MaxScale) {
-        if (current == 0)
-            current = _octree[parent];
-
-        float cornerTX = posX*dTx - bTx;
-        float cornerTY = posY*dTy - bTy;
-        float cornerTZ = posZ*dTz - bTz;
-        float maxTC = std::min(cornerTX, std::min(cornerTY, cornerTZ));
-
-        int childShift = idx ^ octantMask;
-        uint32 childMasks = current << childShift;
-
-        if ((childMasks & 0x8000) && minT <= maxT) {
-            if (maxTC*rayScale >= scaleExp2) {
-                t = maxTC;
-                return true;
+/* Finds the non-empty cubes of the given size below a node in the same order
+ * in which buildOctree will visit them. The lookup tables are left intact, so
+ * that buildOctree sees the same occupancy afterwards.
+ */
+void VoxelOctree::collectSubtrees(int x, int y, int z, int size, int subtreeSize) {
+    if (size == subtreeSize) {
+        Subtree subtree;
+        subtree.x = x;
+        subtree.y = y;
+        subtree.z = z;
+        subtree.size = 0;
+        subtree.descriptorIndex = 0;
+        subtree.offset = 0;
+        subtree.flagOffset = 0;
+        _subtrees.emplace_back(std::move(subtree));
+        return;
+    }
+
+    int halfSize = size >> 1;
+    int posX[8], posY[8], posZ[8];
+    childPositions(x, y, z, halfSize, posX, posY, posZ);
+
+    for (int i = 7; i >= 0; i--)
+        if (_voxels->cubeContainsVoxels(posX[i], posY[i], posZ[i], halfSize))
+            collectSubtrees(posX[i], posY[i], posZ[i], halfSize, subtreeSize);
+}
+
+/* Builds all subtrees of a cache block on the thread pool, each into its own
+ * allocator. Since child offsets are relative, the finished subtrees can
+ * later be copied into the main allocator as a whole by spliceSubtree.
+ */
+void VoxelOctree::buildSubtrees(int x, int y, int z, int size) {
+    int subtreeSize = size >> SubtreeLevels;
+    collectSubtrees(x, y, z, size, subtreeSize);
+
+    uint32 count = uint32(_subtrees.size());
+    ThreadUtils::parallelFor(0, count, std::max(count, 1u), [&](uint32 i) {
+        Subtree &subtree = _subtrees[i];
+
+        ChunkedAllocator<uint32> allocator;
+        allocator.pushBack(0);
+        buildOctree(allocator, subtree.x, subtree.y, subtree.z, subtreeSize, 0);
+
+        subtree.size = allocator.size() + allocator.insertionCount();
+        subtree.data = allocator.finalize();
+    });
+
+    _nextSubtree = 0;
+    _subtreeSize = subtreeSize;
+}
+
+uint64 VoxelOctree::spliceSubtree(ChunkedAllocator<uint32> &allocator, uint64 descriptorIndex) {
+    Subtree &subtree = _subtrees[_nextSubtree++];
+
+    /* The subtree root sits at index 0 of its own array and its children
+     * start right after it, so its child offset still needs to be set */
+    uint64 childOffset = uint64(allocator.size()) - descriptorIndex;
+    allocator[descriptorIndex] = subtree.data[0];
+    for (uint64 i = 1; i < subtree.size; i++)
+        allocator.pushBack(subtree.data[i]);
+
+    subtree.data.reset();
+
+    return childOffset;
+}
+
+/* The exact layout builder produces the same octree as buildOctree, but in
+ * two passes. measureOctree computes the size of every subtree and decides
+ * for every interior node whether its children need far pointers, using the
+ * same criterion as buildOctree. writeOctree then knows where every node
+ * ends up and writes descriptors, far pointers and leaves directly to their
+ * final position in an output - either the octree array itself, or an
+ * OctreeStream for trees that do not fit into memory. Neither pass modifies
+ * the voxel data, so blocks can simply be loaded again for the second pass.
+ */
+/* writeOctree output that fills in an octree held in memory */
+struct ArrayOutput {
+    static const bool SupportsConcurrentWrites = true;
+
+    uint32 *data;
+
+    void reserve(uint64) {}
+    void set(uint64 idx, uint32 value) { data[idx] = value; }
+    void combine(uint64 idx, uint32 value) { data[idx] |= value; }
+    void write(uint64 idx, const uint32 *src, uint64 count) {
+        std::memcpy(data + idx, src, size_t(count)*sizeof(uint32));
+    }
+};
+
+/* writeOctree output for a single subtree that is written separately from
+ * the rest of the octree. The root descriptor of the subtree lives in its
+ * parent's child block, so it is kept in front of the subtree's own words.
+ */
+struct SubtreeOutput {
+    static const bool SupportsConcurrentWrites = true;
+
+    uint64 rootIndex;
+    uint64 base;
+    uint32 *data;
+
+    uint32 &at(uint64 idx) { return idx == rootIndex ? data[0] : data[idx - base + 1]; }
+
+    void reserve(uint64) {}
+    void set(uint64 idx, uint32 value) { at(idx) = value; }
+    void combine(uint64 idx, uint32 value) { at(idx) |= value; }
+    void write(uint64 idx, const uint32 *src, uint64 count) {
+        std::memcpy(&at(idx), src, size_t(count)*sizeof(uint32));
+    }
+};
+
+void VoxelOctree::buildExactLayout() {
+    std::vector<bool> farFlags;
+    _octreeSize = 1 + measureOctree(0, 0, 0, _voxels->sideLength(), farFlags);
+
+    std::cout << "Octree layout computed, writing " << prettyPrintMemory(_octreeSize*sizeof(uint32))
+              << " of nodes" << std::endl;
+
+    /* Descriptors are assembled with |=, so the array has to start out zeroed */
+    _octree.reset(new uint32[size_t(_octreeSize)]());
+
+    ArrayOutput output = {_octree.get()};
+    writeLayout(output, farFlags);
+}
+
+bool VoxelOctree::buildToFile(VoxelData *voxels, const char *path, size_t memoryBudget, bool compress,
+        uint64 blockSize) {
+    VoxelOctree tree;
+    tree._voxels = voxels;
+    tree._center = voxels->getCenter();
+
+    std::vector<bool> farFlags;
+    tree._octreeSize = 1 + tree.measureOctree(0, 0, 0, voxels->sideLength(), farFlags);
+
+    std::cout << "Octree layout computed, streaming " << prettyPrintMemory(tree._octreeSize*sizeof(uint32))
+              << " of nodes to disk" << std::endl;
+
+    std::string tempPath = std::string(path) + ".tmp";
+    OctreeStream stream(tempPath.c_str(), memoryBudget/sizeof(uint32));
+    if (!stream.isOpen()) {
+        std::cout << "Unable to create temporary file " << tempPath << std::endl;
+        return false;
+    }
+
+    tree.writeLayout(stream, farFlags);
+    stream.finish(tree._octreeSize);
+
+    std::cout << "Patched " << stream.patchCount() << " nodes after they were flushed" << std::endl;
+
+    uint32 flags = compress ? 0 : uint32(OctreeFile::FlagUncompressed);
+    if (std::find(farFlags.begin(), farFlags.end(), true) == farFlags.end())
+        flags |= OctreeFile::FlagNoFarPointers;
+    return OctreeFile::write(path, tree._center, tree._octreeSize, 0, &stream, flags, blockSize);
+}
+
+/* Returns the number of words the children of this node and everything
+ * below them take up, and appends the far pointer flags of all interior
+ * nodes of the subtree in pre-order.
+ */
+uint64 VoxelOctree::measureOctree(int x, int y, int z, int size, std::vector<bool> &farFlags) {
+    if (size == _subtreeSize) {
+        Subtree &subtree = _subtrees[_nextSubtree++];
+        farFlags.insert(farFlags.end(), subtree.farFlags.begin(), subtree.farFlags.end());
+        _subtreeExtents.emplace_back(subtree.size, subtree.farFlags.size());
+        return subtree.size;
+    }
+
+    _voxels->prepareDataAccess(x, y, z, size);
+
+    bool parallelBlock = splitsIntoSubtrees(size);
+    if (parallelBlock)
+        measureSubtrees(x, y, z, size);
+
+    int halfSize = size >> 1;
+
+    int posX[8], posY[8], posZ[8];
+    childPositions(x, y, z, halfSize, posX, posY, posZ);
+
+    int childCount = 0;
+    int childIndices[8];
+    for (int i = 0; i < 8; i++)
+        if (_voxels->cubeContainsVoxels(posX[i], posY[i], posZ[i], halfSize))
+            childIndices[childCount++] = i;
+
+    uint64 contentSize = childCount;
+    if (halfSize > 1) {
+        size_t flagIndex = farFlags.size();
+        farFlags.push_back(false);
+
+        /* Offsets from each child to its own children, not counting far
+         * pointer slots of this node - the same value buildOctree checks */
+        bool hasLargeChildren = false;
+        uint64 childrenSize = 0;
+        for (int i = 0; i < childCount; i++) {
+            int idx = childIndices[childCount - i - 1];
+            if (childCount - i + childrenSize > 0x3FFF)
+                hasLargeChildren = true;
+            childrenSize += measureOctree(posX[idx], posY[idx], posZ[idx], halfSize, farFlags);
+        }
+
+        farFlags[flagIndex] = hasLargeChildren;
+        if (hasLargeChildren)
+            contentSize += childCount;
+        contentSize += childrenSize;
+    }
+
+    if (parallelBlock) {
+        _subtrees.clear();
+        _nextSubtree = 0;
+        _subtreeSize = 0;
+    }
+
+    return contentSize;
+}
+
+void VoxelOctree::measureSubtrees(int x, int y, int z, int size) {
+    int subtreeSize = size >> SubtreeLevels;
+    collectSubtrees(x, y, z, size, subtreeSize);
+
+    uint32 count = uint32(_subtrees.size());
+    ThreadUtils::parallelFor(0, count, std::max(count, 1u), [&](uint32 i) {
+        Subtree &subtree = _subtrees[i];
+        subtree.size = measureOctree(subtree.x, subtree.y, subtree.z, subtreeSize, subtree.farFlags);
+    });
+
+    _nextSubtree = 0;
+    _subtreeSize = subtreeSize;
+}
+
+/* Writes the children of the node at descriptorIndex, starting at offset,
+ * and returns the child offset of the node. The descriptor itself is only
+ * partially written here; the parent adds the child offset afterwards.
+ */
+template<typename Output>
+uint64 VoxelOctree::writeOctree(Output &output, int x, int y, int z, int size, uint64 descriptorIndex,
+        uint64 &offset, size_t &flagIndex, const std::vector<bool> &farFlags) {
+    uint64 childOffset = offset - descriptorIndex;
+
+    /* Subtrees of parallel blocks are only reserved here and written by writeSubtrees */
+    if (size == _subtreeSize) {
+        Subtree &subtree = _subtrees[_nextSubtree++];
+        const std::pair<uint64, size_t> &extent = _subtreeExtents[_nextExtent++];
+        subtree.descriptorIndex = descriptorIndex;
+        subtree.offset = offset;
+        subtree.flagOffset = flagIndex;
+        subtree.size = extent.first;
+        offset += extent.first;
+        flagIndex += extent.second;
+        return childOffset;
+    }
+
+    _voxels->prepareDataAccess(x, y, z, size);
+
+    bool parallelBlock = splitsIntoSubtrees(size);
+    if (parallelBlock) {
+        collectSubtrees(x, y, z, size, size >> SubtreeLevels);
+        _nextSubtree = 0;
+        _subtreeSize = size >> SubtreeLevels;
+    }
+
+    int halfSize = size >> 1;
+
+    int posX[8], posY[8], posZ[8];
+    childPositions(x, y, z, halfSize, posX, posY, posZ);
+
+    int childCount = 0;
+    int childIndices[8];
+    uint32 childMask = 0;
+    for (int i = 0; i < 8; i++) {
+        if (_voxels->cubeContainsVoxels(posX[i], posY[i], posZ[i], halfSize)) {
+            childMask |= 128 >> i;
+            childIndices[childCount++] = i;
+        }
+    }
+
+    bool hasLargeChildren = false;
+    uint32 leafMask;
+    if (halfSize == 1) {
+        leafMask = 0;
+
+        output.reserve(offset + childCount);
+        for (int i = 0; i < childCount; i++) {
+            int idx = childIndices[childCount - i - 1];
+            output.set(offset++, _voxels->getVoxel(posX[idx], posY[idx], posZ[idx]));
+        }
+    } else {
+        leafMask = childMask;
+        hasLargeChildren = farFlags[flagIndex++];
+
+        uint64 stride = hasLargeChildren ? 2 : 1;
+        uint64 firstChild = offset;
+        offset += childCount*stride;
+        output.reserve(offset);
+
+        for (int i = 0; i < childCount; i++) {
+            int idx = childIndices[childCount - i - 1];
+            uint64 childIndex = firstChild + i*stride;
+            uint64 grandChildOffset = writeOctree(output, posX[idx], posY[idx], posZ[idx], halfSize,
+                    childIndex, offset, flagIndex, farFlags);
+
+            uint32 descriptor = 0;
+            if (hasLargeChildren) {
+                output.set(childIndex + 1, uint32(grandChildOffset));
+                descriptor |= 0x20000;
+                grandChildOffset >>= 32;
+            }
+            output.combine(childIndex, descriptor | uint32(grandChildOffset << 18));
+        }
+    }
+
+    output.combine(descriptorIndex, (childMask << 8) | leafMask | (hasLargeChildren ? 0x10000 : 0));
+
+    if (parallelBlock) {
+        _subtreeSize = 0;
+        writeSubtrees(output, farFlags);
+        _subtrees.clear();
+        _nextSubtree = 0;
+    }
+
+    return childOffset;
+}
+
+/* All subtrees of the block have their place reserved at this point. They
+ * touch disjoint parts of the octree, apart from their root descriptors,
+ * whose child offsets the parent has already or-ed in. Outputs that cannot
+ * be written from several threads get each subtree in a separate buffer,
+ * which is copied over once all of them are done.
+ */
+template<typename Output>
+void VoxelOctree::writeSubtrees(Output &output, const std::vector<bool> &farFlags) {
+    int subtreeSize = _voxels->cacheBlockSize() >> SubtreeLevels;
+
+    uint32 count = uint32(_subtrees.size());
+    ThreadUtils::parallelFor(0, count, std::max(count, 1u), [&](uint32 i) {
+        Subtree &subtree = _subtrees[i];
+        uint64 offset = subtree.offset;
+        size_t flagIndex = subtree.flagOffset;
+
+        if (Output::SupportsConcurrentWrites) {
+            writeOctree(output, subtree.x, subtree.y, subtree.z, subtreeSize,
+                    subtree.descriptorIndex, offset, flagIndex, farFlags);
+        } else {
+            subtree.data.reset(new uint32[size_t(subtree.size + 1)]());
+            SubtreeOutput buffer = {subtree.descriptorIndex, subtree.offset, subtree.data.get()};
+            writeOctree(buffer, subtree.x, subtree.y, subtree.z, subtreeSize,
+                    subtree.descriptorIndex, offset, flagIndex, farFlags);
+        }
+    });
+
+    if (!Output::SupportsConcurrentWrites) {
+        for (Subtree &subtree : _subtrees) {
+            output.combine(subtree.descriptorIndex, subtree.data[0]);
+            output.write(subtree.offset, subtree.data.get() + 1, subtree.size);
+            subtree.data.reset();
+        }
+    }
+}
+
+template<typename Output>
+void VoxelOctree::writeLayout(Output &output, const std::vector<bool> &farFlags) {
+    uint64 offset = 1;
+    size_t flagIndex = 0;
+    _nextExtent = 0;
+
+    output.reserve(offset);
+    writeOctree(output, 0, 0, 0, _voxels->sideLength(), 0, offset, flagIndex, farFlags);
+    output.combine(0, 1 << 18);
+
+    _subtreeExtents.clear();
+}
+
+static inline uint64 readChildOffset(const uint32 *nodes, uint64 descriptorIndex, uint32 descriptor) {
+    uint64 offset = descriptor >> 18;
+    if (descriptor & 0x20000)
+        offset = (offset << 32) | uint64(nodes[descriptorIndex + 1]);
+    return offset;
+}
+
+/* With separate attributes, nodes whose children are all leaves have no
+ * child array. Instead, bits 18 to 23 of their descriptor hold the number of
+ * leaves of the siblings stored before them, and bits 24 to 26 the number of
+ * siblings stored after them. Every array of such nodes is followed by the
+ * 64 bit word index of the material of its first leaf, low word first, and
+ * the materials of the array are stored contiguously, in the order of the
+ * nodes. If the root only has leaf children, the index directly follows the
+ * root. Octrees without attributes leave out the leaf counts and indices.
+ */
+struct AttributeSplit {
+    AttributeLayout layout;
+    ChunkedAllocator<uint32> nodes;
+    ChunkedAllocator<uint32> attributes;
+    /* Positions of the material indices in nodes. They are stored relative
+     * to the attribute array until the size of all nodes is known */
+    std::vector<uint64> bases;
+};
+
+/* Word index of the material of the first leaf below a node whose children are all leaves */
+uint64 VoxelOctree::firstLeafMaterial(uint64 descriptorIndex, uint32 descriptor) const {
+    if (_attributes == ATTRIBUTES_INTERLEAVED)
+        return descriptorIndex + readChildOffset(_nodes, descriptorIndex, descriptor);
+
+    uint64 baseIndex = descriptorIndex + ((descriptor >> 24) & 7) + 1;
+    uint64 base = (uint64(_nodes[baseIndex + 1]) << 32) | uint64(_nodes[baseIndex]);
+    return base + ((descriptor >> 18) & 63);
+}
+
+/* Appends an array of count nodes whose children are all leaves */
+void VoxelOctree::splitLeafParents(AttributeSplit &split, uint64 sourceIndex, uint32 count, uint32 stride) {
+    uint64 firstAttribute = split.attributes.size();
+    uint32 leavesBefore = 0;
+    for (uint32 i = 0; i < count; i++) {
+        uint64 nodeIndex = sourceIndex + i*stride;
+        uint32 descriptor = _nodes[nodeIndex];
+        uint32 leafCount = BitCount[(descriptor >> 8) & 0xFF];
+
+        uint32 encoded = descriptor & 0xFF00;
+        if (split.layout == ATTRIBUTES_SEPARATE) {
+            encoded |= (leavesBefore << 18) | ((count - i - 1) << 24);
+            uint64 material = firstLeafMaterial(nodeIndex, descriptor);
+            for (uint32 j = 0; j < leafCount; j++)
+                split.attributes.pushBack(_nodes[material + j]);
+        }
+        split.nodes.pushBack(encoded);
+        leavesBefore += leafCount;
+    }
+
+    if (split.layout == ATTRIBUTES_SEPARATE) {
+        split.bases.push_back(split.nodes.size());
+        split.nodes.pushBack(uint32(firstAttribute));
+        split.nodes.pushBack(uint32(firstAttribute >> 32));
+    }
+}
+
+/* Copies the subtree below the node at sourceIndex in the layout of the
+ * split, which has to hold children. Works just like buildOctree.
+ */
+uint64 VoxelOctree::splitSubtree(AttributeSplit &split, uint64 sourceIndex, uint64 descriptorIndex) {
+    uint32 descriptor = _nodes[sourceIndex];
+    uint32 childMask = (descriptor >> 8) & 0xFF;
+    uint32 childCount = BitCount[childMask];
+    uint64 sourceChildren = sourceIndex + readChildOffset(_nodes, sourceIndex, descriptor);
+    uint32 stride = (descriptor & 0x10000) ? 2 : 1;
+
+    ChunkedAllocator<uint32> &allocator = split.nodes;
+    uint64 childOffset = uint64(allocator.size()) - descriptorIndex;
+
+    bool hasLargeChildren = false;
+    if ((_nodes[sourceChildren] & 0xFF) == 0) {
+        splitLeafParents(split, sourceChildren, childCount, stride);
+    } else {
+        for (uint32 i = 0; i < childCount; i++)
+            allocator.pushBack(0);
+
+        uint64 grandChildOffsets[8];
+        uint64 delta = 0;
+        uint64 insertionCount = allocator.insertionCount();
+        for (uint32 i = 0; i < childCount; i++) {
+            grandChildOffsets[i] = delta + splitSubtree(split, sourceChildren + i*stride, descriptorIndex + childOffset + i);
+            delta += allocator.insertionCount() - insertionCount;
+            insertionCount = allocator.insertionCount();
+            if (grandChildOffsets[i] > 0x3FFF)
+                hasLargeChildren = true;
+        }
+
+        for (uint32 i = 0; i < childCount; i++) {
+            uint64 childIndex = descriptorIndex + childOffset + i;
+            uint64 offset = grandChildOffsets[i];
+            if (hasLargeChildren) {
+                offset += childCount - i;
+                allocator.insert(childIndex + 1, uint32(offset));
+                allocator[childIndex] |= 0x20000;
+                offset >>= 32;
+            }
+            allocator[childIndex] |= uint32(offset << 18);
+        }
+    }
+
+    allocator[descriptorIndex] = descriptor & 0xFFFF;
+    if (hasLargeChildren)
+        allocator[descriptorIndex] |= 0x10000;
+
+    return childOffset;
+}
+
+bool VoxelOctree::convertAttributes(AttributeLayout layout) {
+    if (layout == _attributes)
+        return true;
+    if (!_nodes || _octreeSize == 0 || layout == ATTRIBUTES_INTERLEAVED || _attributes == ATTRIBUTES_NONE || _bricks) {
+        std::cout << "Leaf materials of this octree cannot be converted" << std::endl;
+        return false;
+    }
+
+    uint64 geometrySize, attributeCount;
+    std::unique_ptr<uint32[]> octree;
+    if (_isDag) {
+        /* DAG nodes do not depend on the materials, so they are simply cut
+         * off, along with the leaf counts that only served to find them */
+        attributeCount = 0;
+        octree = dropDagLeafCounts(geometrySize);
+    } else {
+        AttributeSplit split;
+        split.layout = layout;
+
+        uint32 root = _nodes[0];
+        if ((root & 0xFF) == 0) {
+            splitLeafParents(split, 0, 1, 1);
+        } else {
+            split.nodes.pushBack(0);
+            splitSubtree(split, 0, 0);
+            split.nodes[0] |= 1 << 18;
+        }
+
+        geometrySize = split.nodes.size() + split.nodes.insertionCount();
+        for (uint64 index : split.bases) {
+            uint64 base = geometrySize + ((uint64(split.nodes[index + 1]) << 32) | uint64(split.nodes[index]));
+            split.nodes[index] = uint32(base);
+            split.nodes[index + 1] = uint32(base >> 32);
+        }
+
+        attributeCount = split.attributes.size();
+        octree.reset(new uint32[size_t(geometrySize + attributeCount)]);
+        std::unique_ptr<uint32[]> geometry = split.nodes.finalize();
+        std::copy(geometry.get(), geometry.get() + geometrySize, octree.get());
+        geometry.reset();
+        for (uint64 i = 0; i < attributeCount; i++)
+            octree[size_t(geometrySize + i)] = split.attributes[size_t(i)];
+    }
+
+    std::cout << "Geometry: " << prettyPrintMemory(geometrySize*sizeof(uint32))
+              << ", materials: " << prettyPrintMemory(attributeCount*sizeof(uint32))
+              << ", before: " << prettyPrintMemory(_octreeSize*sizeof(uint32)) << std::endl;
+
+    _octree = std::move(octree);
+    _mapping.reset();
+    _ropes.reset();
+    _topGrid.reset();
+    _nodes = _octree.get();
+    _octreeSize = geometrySize + attributeCount;
+    _attributes = layout;
+    _prefiltered = false;
+    readDagHeader();
+    updateFarPointers();
+
+    return true;
+}
+
+/* Prefiltered octrees follow every array of interior descriptors, including
+ * their far pointers, with one material per child that holds the average
+ * normal and shade of all leaves below it. Arrays of leaves need no such
+ * block, since the leaves are their own materials.
+ */
+struct MaterialSum {
+    double normalX, normalY, normalZ;
+    double shade;
+    uint64 count;
+
+    MaterialSum() : normalX(0.0), normalY(0.0), normalZ(0.0), shade(0.0), count(0) {}
+
+    void add(uint32 material) {
+        Vec3 n;
+        float c;
+        decompressMaterial(material, n, c);
+        normalX += n.x;
+        normalY += n.y;
+        normalZ += n.z;
+        shade += c;
+        count++;
+    }
+
+    void add(const MaterialSum &o) {
+        normalX += o.normalX;
+        normalY += o.normalY;
+        normalZ += o.normalZ;
+        shade += o.shade;
+        count += o.count;
+    }
+
+    uint32 average() const {
+        Vec3 n = Vec3(float(normalX), float(normalY), float(normalZ));
+        /* Opposite normals of thin walls cancel out, so some normal has to be picked */
+        if (n.dot(n) < 1e-12f)
+            n = Vec3(0.0f, 1.0f, 0.0f);
+        fastNormalization(n);
+        return compressMaterial(n, float(shade/double(count)));
+    }
+};
+
+/* Copies the subtree below the node at sourceIndex and adds the averaged
+ * materials of its children. Works just like buildOctree.
+ */
+uint64 VoxelOctree::prefilterSubtree(ChunkedAllocator<uint32> &allocator, uint64 sourceIndex, uint64 descriptorIndex,
+        MaterialSum &sum) {
+    uint32 descriptor = _nodes[sourceIndex];
+    uint32 childCount = BitCount[(descriptor >> 8) & 0xFF];
+    uint64 sourceChildren = sourceIndex + readChildOffset(_nodes, sourceIndex, descriptor);
+    uint32 stride = (descriptor & 0x10000) ? 2 : 1;
+
+    uint64 childOffset = uint64(allocator.size()) - descriptorIndex;
+
+    bool hasLargeChildren = false;
+    if ((descriptor & 0xFF) == 0) {
+        for (uint32 i = 0; i < childCount; i++) {
+            allocator.pushBack(_nodes[sourceChildren + i]);
+            sum.add(_nodes[sourceChildren + i]);
+        }
+    } else {
+        for (uint32 i = 0; i < childCount; i++)
+            allocator.pushBack(0);
+        uint64 averageIndex = allocator.size();
+        for (uint32 i = 0; i < childCount; i++)
+            allocator.pushBack(0);
+
+        uint64 grandChildOffsets[8];
+        uint64 delta = 0;
+        uint64 insertionCount = allocator.insertionCount();
+        for (uint32 i = 0; i < childCount; i++) {
+            MaterialSum childSum;
+            grandChildOffsets[i] = delta + prefilterSubtree(allocator, sourceChildren + i*stride,
+                    descriptorIndex + childOffset + i, childSum);
+            delta += allocator.insertionCount() - insertionCount;
+            insertionCount = allocator.insertionCount();
+            if (grandChildOffsets[i] > 0x3FFF)
+                hasLargeChildren = true;
+
+            allocator[averageIndex + i] = childSum.average();
+            sum.add(childSum);
+        }
+
+        for (uint32 i = 0; i < childCount; i++) {
+            uint64 childIndex = descriptorIndex + childOffset + i;
+            uint64 offset = grandChildOffsets[i];
+            if (hasLargeChildren) {
+                offset += childCount - i;
+                allocator.insert(childIndex + 1, uint32(offset));
+                allocator[childIndex] |= 0x20000;
+                offset >>= 32;
+            }
+            allocator[childIndex] |= uint32(offset << 18);
+        }
+    }
+
+    allocator[descriptorIndex] = descriptor & 0xFFFF;
+    if (hasLargeChildren)
+        allocator[descriptorIndex] |= 0x10000;
+
+    return childOffset;
+}
+
+bool VoxelOctree::prefilterAttributes() {
+    if (_prefiltered)
+        return true;
+    if (!_nodes || _octreeSize == 0 || _isDag || _attributes != ATTRIBUTES_INTERLEAVED) {
+        std::cout << "Only octrees with interleaved materials can be prefiltered" << std::endl;
+        return false;
+    }
+    if (_bricks) {
+        std::cout << "Octrees with bricks cannot be prefiltered" << std::endl;
+        return false;
+    }
+
+    ChunkedAllocator<uint32> allocator;
+    allocator.pushBack(0);
+    MaterialSum sum;
+    prefilterSubtree(allocator, 0, 0, sum);
+    allocator[0] |= 1 << 18;
+
+    uint64 size = allocator.size() + allocator.insertionCount();
+    std::cout << "Prefiltered octree size: " << prettyPrintMemory(size*sizeof(uint32))
+              << ", before: " << prettyPrintMemory(_octreeSize*sizeof(uint32)) << std::endl;
+
+    _octree = allocator.finalize();
+    _mapping.reset();
+    _ropes.reset();
+    _topGrid.reset();
+    _nodes = _octree.get();
+    _octreeSize = size;
+    _prefiltered = true;
+    updateFarPointers();
+
+    return true;
+}
+
+/* Bricks are built in a separate array and appended to the nodes once their
+ * size is known, see BrickLevels.
+ */
+struct BrickConversion {
+    ChunkedAllocator<uint32> nodes;
+    ChunkedAllocator<uint32> bricks;
+    /* Positions of the brick indices in nodes. They are stored relative to
+     * the brick array until the size of all nodes is known */
+    std::vector<uint64> slots;
+    /* Bricks of the children of the node that is being converted, which are
+     * only kept if they are smaller than its subtree */
+    std::vector<uint32> candidates;
+    uint64 brickCount;
+    uint64 skippedCount;
+
+    BrickConversion() : brickCount(0), skippedCount(0) {}
+};
+
+/* Sets the occupancy bits of the voxels below the node at sourceIndex, which
+ * is level levels below a brick and reached through the coordinates in
+ * voxel, and copies their materials. Adds the size of the child arrays below
+ * the node to octreeWords. Fails if some leaf is not BrickLevels levels below
+ * the brick.
+ */
+bool VoxelOctree::fillBrick(uint64 sourceIndex, int level, uint32 voxel, uint32 *masks, uint32 *materials,
+        uint64 &octreeWords) const {
+    uint32 descriptor = _nodes[sourceIndex];
+    uint32 childMask = (descriptor >> 8) & 0xFF;
+    bool isLast = level == BrickLevels - 1;
+    if ((descriptor & 0xFF) != (isLast ? 0 : childMask))
+        return false;
+
+    uint64 children = sourceIndex + readChildOffset(_nodes, sourceIndex, descriptor);
+    uint32 stride = (descriptor & 0x10000) ? 2 : 1;
+    octreeWords += childArraySize(sourceIndex, descriptor, stride == 2);
+    for (int childIndex = 0; childIndex < 8; childIndex++) {
+        if (!(childMask & (0x80 >> childIndex)))
+            continue;
+        uint64 child = children + stride*BitCount[(childMask << childIndex) & 127];
+        uint32 childVoxel = (voxel << 1) | (childIndex & 1) | ((childIndex & 2) << 2) | ((childIndex & 4) << 4);
+        if (isLast) {
+            masks[childVoxel >> 5] |= 1u << (childVoxel & 31);
+            materials[childVoxel] = _nodes[child];
+        } else if (!fillBrick(child, level + 1, childVoxel, masks, materials, octreeWords)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Appends the brick that replaces the node at sourceIndex to the candidates
+ * of the conversion, see fillBrick.
+ */
+bool VoxelOctree::appendBrick(BrickConversion &conversion, uint64 sourceIndex, uint64 &octreeWords) const {
+    uint32 masks[BrickMaskWords] = {};
+    uint32 materials[1 << 3*BrickLevels];
+    if (!fillBrick(sourceIndex, 0, 0, masks, materials, octreeWords))
+        return false;
+
+    conversion.candidates.insert(conversion.candidates.end(), masks, masks + BrickMaskWords);
+    for (uint32 voxel = 0; voxel < (1 << 3*BrickLevels); voxel++)
+        if (masks[voxel >> 5] & (1u << (voxel & 31)))
+            conversion.candidates.push_back(materials[voxel]);
+    return true;
+}
+
+/* Copies the subtree below the node at sourceIndex. The children of nodes
+ * whose children are all BrickLevels levels above the leaves are replaced by
+ * bricks if these take less space than the nodes below the children.
+ * Otherwise works just like buildOctree.
+ */
+uint64 VoxelOctree::brickSubtree(BrickConversion &conversion, uint64 sourceIndex, uint64 descriptorIndex) {
+    uint32 descriptor = _nodes[sourceIndex];
+    uint32 childMask = (descriptor >> 8) & 0xFF;
+    uint32 childCount = BitCount[childMask];
+    uint64 sourceChildren = sourceIndex + readChildOffset(_nodes, sourceIndex, descriptor);
+    uint32 stride = (descriptor & 0x10000) ? 2 : 1;
+
+    ChunkedAllocator<uint32> &allocator = conversion.nodes;
+    uint64 childOffset = uint64(allocator.size()) - descriptorIndex;
+
+    if ((descriptor & 0xFF) == 0) {
+        for (uint32 i = 0; i < childCount; i++)
+            allocator.pushBack(_nodes[sourceChildren + i]);
+        allocator[descriptorIndex] = descriptor & 0xFFFF;
+        return childOffset;
+    }
+
+    if ((descriptor & 0xFF) == childMask) {
+        uint64 brickStarts[8];
+        uint64 octreeWords = 0;
+        bool dense = true;
+        conversion.candidates.clear();
+        for (uint32 i = 0; i < childCount && dense; i++) {
+            brickStarts[i] = conversion.candidates.size();
+            dense = appendBrick(conversion, sourceChildren + i*stride, octreeWords);
+        }
+
+        if (dense && conversion.candidates.size() < octreeWords) {
+            for (uint32 i = 0; i < childCount; i++) {
+                conversion.slots.push_back(allocator.size());
+                allocator.pushBack(uint32(conversion.bricks.size() + brickStarts[i]));
             }
+            for (uint32 word : conversion.candidates)
+                conversion.bricks.pushBack(word);
+            conversion.brickCount += childCount;
+            allocator[descriptorIndex] = (descriptor & 0xFF00) | 0x10000;
+            return childOffset;
+        }
+        if (dense)
+            conversion.skippedCount += childCount;
+    }
+
+    for (uint32 i = 0; i < childCount; i++)
+        allocator.pushBack(0);
+
+    bool hasLargeChildren = false;
+    uint64 grandChildOffsets[8];
+    uint64 delta = 0;
+    uint64 insertionCount = allocator.insertionCount();
+    for (uint32 i = 0; i < childCount; i++) {
+        grandChildOffsets[i] = delta + brickSubtree(conversion, sourceChildren + i*stride,
+                descriptorIndex + childOffset + i);
+        delta += allocator.insertionCount() - insertionCount;
+        insertionCount = allocator.insertionCount();
+        if (grandChildOffsets[i] > 0x3FFF)
+            hasLargeChildren = true;
+    }
+
+    for (uint32 i = 0; i < childCount; i++) {
+        uint64 childIndex = descriptorIndex + childOffset + i;
+        uint64 offset = grandChildOffsets[i];
+        if (hasLargeChildren) {
+            offset += childCount - i;
+            allocator.insert(childIndex + 1, uint32(offset));
+            allocator[childIndex] |= 0x20000;
+            offset >>= 32;
+        }
+        allocator[childIndex] |= uint32(offset << 18);
+    }
+
+    allocator[descriptorIndex] = descriptor & 0xFFFF;
+    if (hasLargeChildren)
+        allocator[descriptorIndex] |= 0x10000;
+
+    return childOffset;
+}
 
-            float maxTV = std::min(maxT, maxTC);
-            float half = scaleExp2*0.5f;
-            float centerTX = half*dTx + cornerTX;
-            float centerTY = half*dTy + cornerTY;
-            float centerTZ = half*dTz + cornerTZ;
+bool VoxelOctree::convertToBricks() {
+    if (_bricks)
+        return true;
+    if (!_nodes || _octreeSize == 0 || _isDag || _attributes != ATTRIBUTES_INTERLEAVED || _prefiltered) {
+        std::cout << "Only octrees with interleaved materials that are not prefiltered can be converted to bricks" << std::endl;
+        return false;
+    }
+
+    BrickConversion conversion;
+    conversion.nodes.pushBack(0);
+    brickSubtree(conversion, 0, 0);
+    conversion.nodes[0] |= 1 << 18;
+
+    uint64 geometrySize = conversion.nodes.size() + conversion.nodes.insertionCount();
+    uint64 brickSize = conversion.bricks.size();
+    if (geometrySize + brickSize > 0xFFFFFFFFull) {
+        std::cout << "Octree is too large to be converted to bricks" << std::endl;
+        return false;
+    }
+    for (uint64 slot : conversion.slots)
+        conversion.nodes[slot] += uint32(geometrySize);
+
+    std::unique_ptr<uint32[]> octree(new uint32[size_t(geometrySize + brickSize)]);
+    std::unique_ptr<uint32[]> geometry = conversion.nodes.finalize();
+    std::copy(geometry.get(), geometry.get() + geometrySize, octree.get());
+    geometry.reset();
+    for (uint64 i = 0; i < brickSize; i++)
+        octree[size_t(geometrySize + i)] = conversion.bricks[size_t(i)];
+
+    std::cout << "Bricks: " << conversion.brickCount << ", kept as nodes because they were smaller: "
+              << conversion.skippedCount << std::endl;
+    std::cout << "Nodes: " << prettyPrintMemory(geometrySize*sizeof(uint32))
+              << ", bricks: " << prettyPrintMemory(brickSize*sizeof(uint32))
+              << ", before: " << prettyPrintMemory(_octreeSize*sizeof(uint32)) << std::endl;
+
+    _octree = std::move(octree);
+    _mapping.reset();
+    _ropes.reset();
+    _topGrid.reset();
+    _nodes = _octree.get();
+    _octreeSize = geometrySize + brickSize;
+    _bricks = conversion.brickCount > 0;
+    updateFarPointers();
+
+    return true;
+}
+
+/* The relayout keeps the node format and only changes where the child array
+ * of every node is stored. Arrays are grouped into treelets: starting at a
+ * node, the arrays below it are placed breadth first until the treelet holds
+ * about RelayoutTreeletSize words, and every node left at the border of the
+ * treelet then starts a treelet of its own, depth first. The upper levels of
+ * a treelet share a few cache lines, instead of being scattered over the
+ * whole subtree like in the depth first order of buildOctree.
+ */
+static const uint64 RelayoutTreeletSize = 1024;
+
+struct NodeRelayout {
+    /* Source index of the node each child array belongs to, in the new order */
+    std::vector<uint64> owners;
+    /* Index of the child array of every node that has one, by source index
+     * of the node */
+    std::vector<uint32> arrays;
+    /* Whether the nodes in each array are followed by far pointers */
+    std::vector<bool> far;
+    std::vector<uint64> positions;
+};
+
+/* Whether the child array of a node holds descriptors whose child offsets
+ * need rewriting, rather than words that are copied as they are */
+bool VoxelOctree::hasChildDescriptors(uint64 nodeIndex, uint32 descriptor) const {
+    if ((descriptor & 0xFF) == 0)
+        return false;
+    if (_attributes == ATTRIBUTES_INTERLEAVED)
+        return true;
+    return (_nodes[nodeIndex + readChildOffset(_nodes, nodeIndex, descriptor)] & 0xFF) != 0;
+}
 
-            if (minT <= maxTV) {
-                uint64 childOffset = current >> 18;
-                if (current & 0x20000)
-                    childOffset = (childOffset << 32) | uint64(_octree[parent + 1]);
+/* Whether the children of a node are bricks, see BrickLevels */
+bool VoxelOctree::hasBrickChildren(uint32 descriptor) const {
+    return _bricks && (descriptor & 0xFF) == 0 && (descriptor & 0x10000) != 0;
+}
 
-                if (!(childMasks & 0x80)) {
-                    normal = _octree[childOffset + parent + BitCount[((childMasks >> (8 + childShift)) << childShift) & 127]];
+/* Number of words in the child array of a node, with or without far pointers */
+uint64 VoxelOctree::childArraySize(uint64 nodeIndex, uint32 descriptor, bool far) const {
+    uint64 childCount = BitCount[(descriptor >> 8) & 0xFF];
+    if (hasChildDescriptors(nodeIndex, descriptor))
+        return (far ? 2 : 1)*childCount + (_prefiltered ? childCount : 0);
+    if (_attributes == ATTRIBUTES_SEPARATE && (descriptor & 0xFF) != 0)
+        return childCount + 2;
+    return childCount;
+}
 
+/* Walks all descriptors of a resident octree to find out whether any of them
+ * uses far pointers. DAGs never do.
+ */
+void VoxelOctree::updateFarPointers() {
+    _farPointers = false;
+    if (_isDag)
+        return;
+
+    std::vector<uint64> stack(1, 0);
+    while (!stack.empty()) {
+        uint64 node = stack.back();
+        stack.pop_back();
+
+        uint32 descriptor = _nodes[node];
+        if ((descriptor & 0x20000) || ((descriptor & 0x10000) && !hasBrickChildren(descriptor))) {
+            _farPointers = true;
+            return;
+        }
+
+        if (!hasChildDescriptors(node, descriptor))
+            continue;
+        uint64 children = node + (descriptor >> 18);
+        for (uint32 i = 0; i < BitCount[(descriptor >> 8) & 0xFF]; i++)
+            if (_attributes == ATTRIBUTES_INTERLEAVED || (_nodes[children + i] & 0xFF) != 0)
+                stack.push_back(children + i);
+    }
+}
+
+void VoxelOctree::orderChildArrays(NodeRelayout &relayout) {
+    std::vector<uint64> treelets(1, 0);
+    std::vector<uint64> queue;
+    while (!treelets.empty()) {
+        queue.assign(1, treelets.back());
+        treelets.pop_back();
+
+        uint64 size = 0;
+        size_t head = 0;
+        for (; head < queue.size() && size < RelayoutTreeletSize; head++) {
+            uint64 node = queue[head];
+            uint32 descriptor = _nodes[node];
+
+            relayout.arrays[size_t(node)] = uint32(relayout.owners.size());
+            relayout.owners.push_back(node);
+            size += childArraySize(node, descriptor, (descriptor & 0x10000) != 0);
+
+            if (!hasChildDescriptors(node, descriptor))
+                continue;
+            uint64 children = node + readChildOffset(_nodes, node, descriptor);
+            uint32 stride = (descriptor & 0x10000) ? 2 : 1;
+            for (uint32 i = 0; i < BitCount[(descriptor >> 8) & 0xFF]; i++) {
+                uint64 child = children + i*stride;
+                if (_attributes == ATTRIBUTES_INTERLEAVED || (_nodes[child] & 0xFF) != 0)
+                    queue.push_back(child);
+            }
+        }
+
+        for (size_t i = queue.size(); i > head; i--)
+            treelets.push_back(queue[i - 1]);
+    }
+}
+
+bool VoxelOctree::relayout() {
+    if (!_nodes || _octreeSize == 0) {
+        std::cout << "Only octrees that are completely in memory can be relaid out" << std::endl;
+        return false;
+    }
+    if (_isDag) {
+        std::cout << "DAGs cannot be relaid out" << std::endl;
+        return false;
+    }
+    /* A root with only leaf children is followed directly by its leaves */
+    if ((_nodes[0] & 0xFF) == 0)
+        return true;
+
+    NodeRelayout relayout;
+    relayout.arrays.resize(size_t(_octreeSize));
+    orderChildArrays(relayout);
+
+    size_t arrayCount = relayout.owners.size();
+    uint64 sourceSize = 1;
+    for (uint64 node : relayout.owners)
+        sourceSize += childArraySize(node, _nodes[node], (_nodes[node] & 0x10000) != 0);
+
+    /* Moving arrays apart can push child offsets beyond 14 bits. Every array
+     * that needs a far pointer grows, which may push other offsets out of
+     * range, so the positions are recomputed until no array changes */
+    relayout.far.resize(arrayCount, false);
+    relayout.positions.resize(arrayCount);
+    uint64 geometrySize;
+    bool changed = true;
+    while (changed) {
+        geometrySize = 1;
+        for (size_t i = 0; i < arrayCount; i++) {
+            uint64 node = relayout.owners[i];
+            relayout.positions[i] = geometrySize;
+            geometrySize += childArraySize(node, _nodes[node], relayout.far[i]);
+        }
+
+        changed = false;
+        for (size_t i = 0; i < arrayCount; i++) {
+            uint64 node = relayout.owners[i];
+            uint32 descriptor = _nodes[node];
+            if (relayout.far[i] || !hasChildDescriptors(node, descriptor))
+                continue;
+
+            uint64 children = node + readChildOffset(_nodes, node, descriptor);
+            uint32 stride = (descriptor & 0x10000) ? 2 : 1;
+            for (uint32 j = 0; j < BitCount[(descriptor >> 8) & 0xFF]; j++) {
+                uint64 child = relayout.arrays[size_t(children + j*stride)];
+                if (relayout.positions[child] - (relayout.positions[i] + j) > 0x3FFF) {
+                    relayout.far[i] = true;
+                    changed = true;
                     break;
                 }
+            }
+        }
+    }
 
-                rayStack[scale].offset = parent;
-                rayStack[scale].maxT = maxT;
+    uint64 attributeCount = _octreeSize - sourceSize;
+    if (_bricks && geometrySize + attributeCount > 0xFFFFFFFFull) {
+        std::cout << "Octree is too large to be relaid out with bricks" << std::endl;
+        return false;
+    }
+    std::unique_ptr<uint32[]> octree(new uint32[size_t(geometrySize + attributeCount)]);
+    octree[0] = (_nodes[0] & 0xFFFF) | (1 << 18);
+    if (relayout.far[0])
+        octree[0] |= 0x10000;
+
+    for (size_t i = 0; i < arrayCount; i++) {
+        uint64 node = relayout.owners[i];
+        uint32 descriptor = _nodes[node];
+        uint32 childCount = BitCount[(descriptor >> 8) & 0xFF];
+        uint64 source = node + readChildOffset(_nodes, node, descriptor);
+        uint64 target = relayout.positions[i];
+
+        if (!hasChildDescriptors(node, descriptor)) {
+            uint64 size = childArraySize(node, descriptor, false);
+            std::copy(_nodes + source, _nodes + source + size, octree.get() + target);
+            /* Brick indices and material indices of separate attributes move
+             * with the end of the nodes */
+            if (hasBrickChildren(descriptor)) {
+                for (uint32 j = 0; j < childCount; j++)
+                    octree[size_t(target + j)] = uint32(_nodes[source + j] - sourceSize + geometrySize);
+            } else if (size > childCount) {
+                uint64 base = (uint64(_nodes[source + childCount + 1]) << 32) | uint64(_nodes[source + childCount]);
+                base = base - sourceSize + geometrySize;
+                octree[size_t(target + childCount)] = uint32(base);
+                octree[size_t(target + childCount + 1)] = uint32(base >> 32);
+            }
+            continue;
+        }
 
-                uint32 siblingCount = BitCount[childMasks & 127];
-                parent += childOffset + siblingCount;
-                if (current & 0x10000)
-                    parent += siblingCount;
+        uint32 sourceStride = (descriptor & 0x10000) ? 2 : 1;
+        uint32 targetStride = relayout.far[i] ? 2 : 1;
+        for (uint32 j = 0; j < childCount; j++) {
+            uint64 sourceChild = source + j*sourceStride;
+            uint64 targetChild = target + j*targetStride;
+
+            uint32 childArray = relayout.arrays[size_t(sourceChild)];
+            uint64 offset = relayout.positions[childArray] - targetChild;
+            uint32 result = _nodes[sourceChild] & 0xFFFF;
+            if (relayout.far[childArray] || hasBrickChildren(_nodes[sourceChild]))
+                result |= 0x10000;
+            if (relayout.far[i]) {
+                result |= 0x20000;
+                octree[size_t(targetChild + 1)] = uint32(offset);
+                offset >>= 32;
+            }
+            octree[size_t(targetChild)] = result | uint32(offset << 18);
+        }
+
+        if (_prefiltered)
+            std::copy(_nodes + source + childCount*sourceStride, _nodes + source + childCount*(sourceStride + 1),
+                    octree.get() + target + childCount*targetStride);
+    }
+
+    std::copy(_nodes + sourceSize, _nodes + _octreeSize, octree.get() + geometrySize);
+
+    std::cout << "Relaid out octree size: " << prettyPrintMemory((geometrySize + attributeCount)*sizeof(uint32))
+              << ", before: " << prettyPrintMemory(_octreeSize*sizeof(uint32)) << std::endl;
+
+    _octree = std::move(octree);
+    _mapping.reset();
+    _ropes.reset();
+    _topGrid.reset();
+    _nodes = _octree.get();
+    _octreeSize = geometrySize + attributeCount;
+    updateFarPointers();
+
+    return true;
+}
+
+/* DAG nodes start with a descriptor that only holds the child and non-leaf
+ * masks. Nodes above the leaves follow it with a pointer to each child node
+ * and then, for every child but the first, the number of leaves in the
+ * subtrees of the children before it, which is only needed to find leaf
+ * materials and is left out if the DAG has none. Nodes whose children are
+ * leaves have no further words. Children are stored in the same order as in
+ * the octree.
+ *
+ * The top bits of a pointer mirror the child along the x, y and z axes, in
+ * the same bit order as child indices. Mirroring a node moves child i to
+ * i ^ mirror and applies the mirror to the pointers of the node as well.
+ */
+
+static inline uint32 dagNodeSize(uint32 descriptor, bool leafCounts) {
+    uint32 childCount = BitCount[descriptor & 0xFF];
+    if (!childCount)
+        return 1;
+    return leafCounts ? 2*childCount : 1 + childCount;
+}
+
+/* Appends DAG nodes unless an identical node exists already. The hash set
+ * only stores node indices and compares nodes in place.
+ */
+class DagBuilder {
+    struct NodeHash {
+        const std::vector<uint32> *words;
+        bool leafCounts;
+
+        size_t operator()(uint32 index) const {
+            uint32 size = dagNodeSize((*words)[index], leafCounts);
+            uint64 hash = 0xCBF29CE484222325ull;
+            for (uint32 i = 0; i < size; i++)
+                hash = (hash ^ (*words)[index + i])*0x100000001B3ull;
+            return size_t(hash ^ (hash >> 32));
+        }
+    };
+
+    struct NodeEqual {
+        const std::vector<uint32> *words;
+        bool leafCounts;
 
-                idx = 0;
-                scale--;
-                scaleExp2 = half;
+        bool operator()(uint32 a, uint32 b) const {
+            uint32 size = dagNodeSize((*words)[a], leafCounts);
+            return std::equal(words->begin() + a, words->begin() + a + size, words->begin() + b);
+        }
+    };
+
+public:
+    std::vector<uint32> words;
+    std::vector<uint32> attributes;
+    /* False for DAGs without materials, see dagNodeSize */
+    const bool leafCounts;
+    bool overflow;
+
+private:
+    std::unordered_set<uint32, NodeHash, NodeEqual> _nodes;
+
+public:
+    DagBuilder(bool leafCounts)
+    : leafCounts(leafCounts), overflow(false),
+      _nodes(0, NodeHash{&words, leafCounts}, NodeEqual{&words, leafCounts}) {
+    }
+
+    uint32 insert(const uint32 *node) {
+        uint32 size = dagNodeSize(node[0], leafCounts);
+        if (words.size() + size > DagIndexMask) {
+            overflow = true;
+            return 0;
+        }
 
-                if (centerTX > minT) idx ^= 1, posX += scaleExp2;
-                if (centerTY > minT) idx ^= 2, posY += scaleExp2;
-                if (centerTZ > minT) idx ^= 4, posZ += scaleExp2;
+        uint32 index = uint32(words.size());
+        words.insert(words.end(), node, node + size);
 
-                maxT = maxTV;
-                current = 0;
+        auto existing = _nodes.insert(index);
+        if (!existing.second)
+            words.resize(index);
 
+        return *existing.first;
+    }
+
+    size_t nodeCount() const {
+        return _nodes.size();
+    }
+};
+
+uint32 VoxelOctree::mergeSubtree(DagBuilder &builder, uint64 descriptorIndex, uint64 &leafCount) {
+    uint32 descriptor = _nodes[descriptorIndex];
+    uint32 childMask = (descriptor >> 8) & 0xFF;
+    uint32 childCount = BitCount[childMask];
+    bool hasLeaves = (descriptor & 0xFF) == 0;
+
+    uint64 childIndex = hasLeaves ? 0 : descriptorIndex + readChildOffset(_nodes, descriptorIndex, descriptor);
+    uint64 materialIndex = hasLeaves && _attributes != ATTRIBUTES_NONE ? firstLeafMaterial(descriptorIndex, descriptor) : 0;
+    uint32 stride = (descriptor & 0x10000) ? 2 : 1;
+
+    /* Children of the subtree, in the order in which they are stored */
+    int slotOf[8];
+    uint32 pointers[8];
+    uint64 leafCounts[8];
+    size_t attributeStarts[9];
+    uint32 slot = 0;
+    leafCount = 0;
+    for (int octant = 7; octant >= 0; octant--) {
+        slotOf[octant] = -1;
+        if (!(childMask & (128 >> octant)))
+            continue;
+
+        slotOf[octant] = slot;
+        attributeStarts[slot] = builder.attributes.size();
+        if (hasLeaves) {
+            if (_attributes != ATTRIBUTES_NONE)
+                builder.attributes.push_back(_nodes[materialIndex + slot]);
+            leafCounts[slot] = 1;
+        } else {
+            pointers[slot] = mergeSubtree(builder, childIndex + slot*stride, leafCounts[slot]);
+        }
+        leafCount += leafCounts[slot];
+        slot++;
+    }
+    attributeStarts[childCount] = builder.attributes.size();
+
+    /* Of the eight mirror images of the node, the one with the smallest
+     * encoding is stored. Mirror images of each other therefore end up as
+     * the same node, referenced with different mirror bits.
+     */
+    uint32 best[16], candidate[16];
+    int bestOrder[8], order[8];
+    uint32 bestMirror = 0;
+    for (uint32 mirror = 0; mirror < 8; mirror++) {
+        uint32 mask = 0;
+        uint32 k = 0;
+        uint64 leavesBefore = 0;
+        for (int octant = 7; octant >= 0; octant--) {
+            int s = slotOf[octant ^ mirror];
+            if (s < 0)
                 continue;
+
+            mask |= 128 >> octant;
+            order[k] = s;
+            if (!hasLeaves) {
+                candidate[1 + k] = pointers[s] ^ (mirror << DagMirrorShift);
+                if (k > 0 && builder.leafCounts)
+                    candidate[childCount + k] = uint32(leavesBefore);
             }
+            leavesBefore += leafCounts[s];
+            k++;
         }
+        candidate[0] = (mask << 8) | (hasLeaves ? 0 : mask);
 
-        int stepMask = 0;
-        if (cornerTX <= maxTC) stepMask ^= 1, posX -= scaleExp2;
-        if (cornerTY <= maxTC) stepMask ^= 2, posY -= scaleExp2;
-        if (cornerTZ <= maxTC) stepMask ^= 4, posZ -= scaleExp2;
+        uint32 size = dagNodeSize(candidate[0], builder.leafCounts);
+        if (mirror == 0 || std::lexicographical_compare(candidate, candidate + size, best, best + size)) {
+            std::copy(candidate, candidate + size, best);
+            std::copy(order, order + childCount, bestOrder);
+            bestMirror = mirror;
+        }
+    }
+
+    /* Leaf materials are stored in the order of the stored node, so that its
+     * leaf counts are valid for every mirror image that references it */
+    if (bestMirror) {
+        std::vector<uint32> reordered;
+        reordered.reserve(attributeStarts[childCount] - attributeStarts[0]);
+        for (uint32 k = 0; k < childCount; k++)
+            reordered.insert(reordered.end(), builder.attributes.begin() + attributeStarts[bestOrder[k]],
+                    builder.attributes.begin() + attributeStarts[bestOrder[k] + 1]);
+        std::copy(reordered.begin(), reordered.end(), builder.attributes.begin() + attributeStarts[0]);
+    }
+
+    return builder.insert(best) | (bestMirror << DagMirrorShift);
+}
+
+bool VoxelOctree::convertToDag() {
+    if (_isDag)
+        return true;
+    if (!_nodes || _octreeSize == 0) {
+        std::cout << "Only octrees that are completely in memory can be converted to a DAG" << std::endl;
+        return false;
+    }
+    if (_bricks) {
+        std::cout << "Octrees with bricks cannot be converted to a DAG" << std::endl;
+        return false;
+    }
 
-        minT = maxTC;
-        idx ^= stepMask;
+    DagBuilder builder(_attributes != ATTRIBUTES_NONE);
+    /* Root index and attribute offset */
+    builder.words.resize(2);
 
-        if ((idx & stepMask) != 0) {
-            int differingBits = 0;
-            if (stepMask & 1) differingBits |= floatBitsToUint(posX) ^ floatBitsToUint(posX + scaleExp2);
-            if (stepMask & 2) differingBits |= floatBitsToUint(posY) ^ floatBitsToUint(posY + scaleExp2);
-            if (stepMask & 4) differingBits |= floatBitsToUint(posZ) ^ floatBitsToUint(posZ + scaleExp2);
-            scale = (floatBitsToUint((float)differingBits) >> 23) - 127;
-            scaleExp2 = uintBitsToFloat((scale - MaxScale + 127) << 23);
+    uint64 leafCount;
+    uint32 root = mergeSubtree(builder, 0, leafCount);
+    if (builder.overflow || leafCount > 0xFFFFFFFFull) {
+        std::cout << "Octree is too large to be converted to a DAG" << std::endl;
+        return false;
+    }
 
-            parent = rayStack[scale].offset;
-            maxT   = rayStack[scale].maxT;
+    uint64 geometrySize = builder.words.size();
+    builder.words[0] = root;
+    builder.words[1] = uint32(geometrySize);
+
+    uint64 size = geometrySize + builder.attributes.size();
+    std::unique_ptr<uint32[]> dag(new uint32[size_t(size)]);
+    std::copy(builder.words.begin(), builder.words.end(), dag.get());
+    std::copy(builder.attributes.begin(), builder.attributes.end(), dag.get() + geometrySize);
+
+    std::cout << "DAG geometry: " << prettyPrintMemory(geometrySize*sizeof(uint32)) << " in "
+              << builder.nodeCount() << " nodes, octree geometry: "
+              << prettyPrintMemory((_octreeSize - builder.attributes.size())*sizeof(uint32))
+              << ", materials: " << prettyPrintMemory(builder.attributes.size()*sizeof(uint32)) << std::endl;
+
+    _octree = std::move(dag);
+    _mapping.reset();
+    _ropes.reset();
+    _topGrid.reset();
+    _nodes = _octree.get();
+    _octreeSize = size;
+    _isDag = true;
+    _prefiltered = false;
+    if (_attributes == ATTRIBUTES_INTERLEAVED)
+        _attributes = ATTRIBUTES_SEPARATE;
+    readDagHeader();
+    updateFarPointers();
 
-            int shX = floatBitsToUint(posX) >> scale;
-            int shY = floatBitsToUint(posY) >> scale;
-            int shZ = floatBitsToUint(posZ) >> scale;
-            posX = uintBitsToFloat(shX << scale);
-            posY = uintBitsToFloat(shY << scale);
-            posZ = uintBitsToFloat(shZ << scale);
-            idx = (shX & 1) | ((shY & 1) << 1) | ((shZ & 1) << 2);
+    return true;
+}
 
-            current = 0;
+/* Copies the nodes of a DAG without their leaf counts, which leaves out the
+ * materials as well. Nodes keep their order, so only pointers change.
+ */
+std::unique_ptr<uint32[]> VoxelOctree::dropDagLeafCounts(uint64 &geometrySize) const {
+    std::vector<uint32> targets(size_t(_attributeOffset), 0);
+    geometrySize = 2;
+    for (uint64 node = 2; node < _attributeOffset; node += dagNodeSize(_nodes[node], true)) {
+        targets[size_t(node)] = uint32(geometrySize);
+        geometrySize += dagNodeSize(_nodes[node], false);
+    }
+
+    std::unique_ptr<uint32[]> dag(new uint32[size_t(geometrySize)]);
+    dag[0] = targets[_nodes[0] & DagIndexMask] | (_nodes[0] & ~DagIndexMask);
+    dag[1] = uint32(geometrySize);
+    for (uint64 node = 2; node < _attributeOffset; node += dagNodeSize(_nodes[node], true)) {
+        uint32 descriptor = _nodes[node];
+        uint32 target = targets[size_t(node)];
+        dag[target] = descriptor;
+        for (uint32 i = 1; i <= BitCount[descriptor & 0xFF]; i++) {
+            uint32 pointer = _nodes[node + i];
+            dag[target + i] = targets[pointer & DagIndexMask] | (pointer & ~DagIndexMask);
         }
     }
+    return dag;
+}
+
+void VoxelOctree::readDagHeader() {
+    if (!_isDag)
+        return;
+
+    uint32 attributeOffset = 0;
+    if (_pages) {
+        _pages->fetch(0, _dagRoot);
+        _pages->fetch(1, attributeOffset);
+    } else {
+        _dagRoot = _nodes[0];
+        attributeOffset = _nodes[1];
+    }
+    _attributeOffset = attributeOffset;
+}
 
-    if (scale >= MaxScale)
+bool VoxelOctree::raymarch(const Vec3 &o, const Vec3 &d, float rayScale, uint32 &normal, float &t) {
+    RayHit hit;
+    if (!raymarch(o, d, 0.0f, std::numeric_limits<float>::infinity(), rayScale, hit))
         return false;
 
-    t = minT;
+    normal = hit.material;
+    t = hit.t;
     return true;
 }
+
+OctreeView VoxelOctree::view() const {
+    OctreeView view = {_nodes, _pages.get(), _octreeSize, _isDag, _dagRoot, _attributeOffset, _attributes, _prefiltered,
+            _bricks, _farPointers, {nullptr, nullptr, nullptr}, _topGrid.get()};
+    if (_ropes) {
+        view.ropes.nodes = _ropes->nodes.data();
+        view.ropes.neighbors = _ropes->neighbors.data();
+        view.ropes.octreeNodes = _ropes->octreeNodes.data();
+    }
+    return view;
+}
+
+bool VoxelOctree::raymarch(const Vec3 &o, const Vec3 &d, float tMin, float tMax, float rayScale, RayHit &hit,
+        RayQuery query, const EntryNode *entry) {
+    return traversalKernels().raymarch(view(), o, d, tMin, tMax, rayScale, hit, query, entry);
+}
+
+uint32 VoxelOctree::raymarchPacket(const RayPacket &packet, uint32 activeMask, PacketHit &hit, RayQuery query,
+        const EntryNode *entry) {
+    return traversalKernels().raymarchPacket(view(), packet, activeMask, hit, query, entry);
+}
+
+bool VoxelOctree::findEntryNode(const Vec3 &lo, const Vec3 &hi, EntryNode &entry) const {
+    if (!_nodes || _octreeSize == 0 || _isDag)
+        return false;
+
+    uint64 node = 0;
+    Vec3 corner(1.0f);
+    float half = 0.5f;
+    entry.depth = 0;
+    entry.nodes[0] = 0;
+    while (entry.depth < MaxEntryDepth) {
+        uint32 descriptor = _nodes[node];
+
+        int childIndex = 0;
+        for (int axis = 0; axis < 3; axis++) {
+            float center = corner.a[axis] + half;
+            if (hi.a[axis] <= center)
+                childIndex |= 1 << axis;
+            else if (lo.a[axis] >= center)
+                corner.a[axis] = center;
+            else
+                return entry.depth > 0;
+        }
+        /* Leaves and empty children have no descriptor to start from */
+        if (!(descriptor & (0x80 >> childIndex)))
+            break;
+
+        uint32 siblingCount = BitCount[(descriptor << childIndex) & 127];
+        node += readChildOffset(_nodes, node, descriptor) + ((descriptor & 0x10000) ? 2 : 1)*siblingCount;
+
+        entry.childIndex[entry.depth] = uint8(childIndex);
+        entry.nodes[++entry.depth] = node;
+        half *= 0.5f;
+    }
+    return entry.depth > 0;
+}
+
+bool VoxelOctree::buildRopes() {
+    if (!_nodes || _octreeSize == 0) {
+        std::cout << "Only octrees that are completely in memory can have neighbor links" << std::endl;
+        return false;
+    }
+    if (_isDag) {
+        std::cout << "DAGs cannot have neighbor links, because their nodes can have several neighbors on each face" << std::endl;
+        return false;
+    }
+
+    std::unique_ptr<RopeStorage> ropes(new RopeStorage());
+    std::vector<RopeNode> &nodes = ropes->nodes;
+    std::vector<uint64> &octreeNodes = ropes->octreeNodes;
+    std::vector<uint32> &neighbors = ropes->neighbors;
+
+    RopeNode root = {_nodes[0], 22u << RopeScaleShift};
+    nodes.push_back(root);
+    octreeNodes.push_back(0);
+    for (size_t i = 0; i < nodes.size(); i++) {
+        uint64 node = octreeNodes[i];
+        uint32 descriptor = nodes[i].descriptor;
+        uint32 scale = nodes[i].children >> RopeScaleShift;
+        if (nodes.size() + BitCount[descriptor & 0xFF] > RopeIndexMask) {
+            std::cout << "Octree has too many nodes for neighbor links" << std::endl;
+            return false;
+        }
+
+        nodes[i].children |= uint32(nodes.size());
+        if (!(descriptor & 0xFF))
+            continue;
+        uint64 children = node + readChildOffset(_nodes, node, descriptor);
+        uint32 stride = (descriptor & 0x10000) ? 2 : 1;
+        /* Children that come first in the child array have the highest child index */
+        for (int childIndex = 7; childIndex >= 0; childIndex--) {
+            if (!(descriptor & (0x80 >> childIndex)))
+                continue;
+            uint64 childNode = children + stride*BitCount[(descriptor << childIndex) & 127];
+            RopeNode child = {_nodes[childNode], (scale - 1) << RopeScaleShift};
+            nodes.push_back(child);
+            octreeNodes.push_back(childNode);
+        }
+    }
+
+    /* A neighbor within the parent is a sibling, or the parent itself if the
+     * sibling has no descriptor. Otherwise, it is found the same way below
+     * the neighbor of the parent, if that one has the size of the parent.
+     * Parents come before their children, so their links are known already */
+    neighbors.resize(6*nodes.size(), NoNeighbor);
+    for (uint32 i = 0; i < nodes.size(); i++) {
+        uint32 descriptor = nodes[i].descriptor;
+        uint32 firstChild = nodes[i].children & RopeIndexMask;
+        for (int childIndex = 0; childIndex < 8; childIndex++) {
+            if (!(descriptor & (0x80 >> childIndex)))
+                continue;
+            uint32 child = firstChild + BitCount[(descriptor << childIndex) & 127];
+
+            for (int face = 0; face < 6; face++) {
+                int axis = face/2;
+                int sibling = childIndex ^ (1 << axis);
+                /* Child indices have the bit of an axis set for the lower half */
+                bool upperHalf = !(childIndex & (1 << axis));
+                uint32 outer = i;
+                if (upperHalf == ((face & 1) != 0)) {
+                    outer = neighbors[6*i + face];
+                    if (outer == NoNeighbor || (nodes[outer].children >> RopeScaleShift) != (nodes[i].children >> RopeScaleShift)) {
+                        neighbors[6*child + face] = outer;
+                        continue;
+                    }
+                }
+
+                uint32 outerDescriptor = nodes[outer].descriptor;
+                if (outerDescriptor & (0x80 >> sibling))
+                    neighbors[6*child + face] = (nodes[outer].children & RopeIndexMask) + BitCount[(outerDescriptor << sibling) & 127];
+                else
+                    neighbors[6*child + face] = outer;
+            }
+        }
+    }
+
+    _ropes = std::move(ropes);
+    return true;
+}
+
+bool VoxelOctree::buildTopGrid() {
+    if (!_nodes || _octreeSize == 0) {
+        std::cout << "Only octrees that are completely in memory can have a top grid" << std::endl;
+        return false;
+    }
+    if (_isDag) {
+        std::cout << "DAGs cannot have a top grid" << std::endl;
+        return false;
+    }
+    if (_octreeSize > 0xFFFFFFFFull) {
+        std::cout << "Octree is too large for a top grid" << std::endl;
+        return false;
+    }
+
+    std::unique_ptr<OctreeTopGrid> grid(new OctreeTopGrid());
+    std::memset(grid->occupancy, 0, sizeof(grid->occupancy));
+    std::memset(grid->nodes, 0, sizeof(grid->nodes));
+
+    /* code is the Morton code of the node within its level */
+    struct GridNode {
+        uint64 node;
+        uint32 code;
+        int level;
+    };
+    std::vector<GridNode> stack(1, GridNode{0, 0, 0});
+    while (!stack.empty()) {
+        GridNode parent = stack.back();
+        stack.pop_back();
+
+        if (parent.level > 0) {
+            uint32 byte = ((1u << 3*(parent.level - 1)) - 1)/7 + (parent.code >> 3);
+            grid->occupancy[byte] |= 1u << (parent.code & 7);
+        }
+        if (parent.level == TopGridLevels) {
+            grid->nodes[parent.code] = uint32(parent.node);
+            continue;
+        }
+
+        uint32 descriptor = _nodes[parent.node];
+        if ((descriptor & 0xFF) != ((descriptor >> 8) & 0xFF)) {
+            if (hasBrickChildren(descriptor))
+                std::cout << "Octree has bricks above the level of the top grid" << std::endl;
+            else
+                std::cout << "Octree has leaves above the level of the top grid" << std::endl;
+            return false;
+        }
+        if (!(descriptor & 0xFF))
+            continue;
+
+        uint64 children = parent.node + readChildOffset(_nodes, parent.node, descriptor);
+        uint32 stride = (descriptor & 0x10000) ? 2 : 1;
+        for (int childIndex = 0; childIndex < 8; childIndex++) {
+            if (!(descriptor & (0x80 >> childIndex)))
+                continue;
+            /* Child indices have the bit of an axis set for the lower half */
+            GridNode child = {
+                children + stride*BitCount[(descriptor << childIndex) & 127],
+                8*parent.code + (~childIndex & 7),
+                parent.level + 1
+            };
+            stack.push_back(child);
+        }
+    }
+
+    _topGrid = std::move(grid);
+    return true;
+}
+
+bool VoxelOctree::updatePages() {
+    return _pages && _pages->update();
+}
+
+void VoxelOctree::waitForPages() {
+    if (_pages)
+        _pages->waitForLoads();
+}
+
+void VoxelOctree::raymarchBatch(const RayBatch &rays, HitBatch &hits, RayQuery query) {
+    const uint32 ChunkSize = 1024;
+    uint32 numChunks = uint32((rays.count + ChunkSize - 1)/ChunkSize);
+
+    auto traceChunk = [&](uint32 chunk) {
+        size_t chunkStart = size_t(chunk)*ChunkSize;
+        size_t chunkEnd = std::min(chunkStart + ChunkSize, rays.count);
+
+        RayPacket packet;
+        PacketHit result;
+        for (size_t start = chunkStart; start < chunkEnd; start += PacketWidth) {
+            int lanes = int(std::min(chunkEnd - start, size_t(PacketWidth)));
+            for (int i = 0; i < lanes; i++) {
+                size_t r = start + i;
+                packet.ox[i] = rays.ox[r];
+                packet.oy[i] = rays.oy[r];
+                packet.oz[i] = rays.oz[r];
+                packet.dx[i] = rays.dx[r];
+                packet.dy[i] = rays.dy[r];
+                packet.dz[i] = rays.dz[r];
+                packet.tMin[i] = rays.tMin ? rays.tMin[r] : 0.0f;
+                packet.tMax[i] = rays.tMax ? rays.tMax[r] : std::numeric_limits<float>::infinity();
+                packet.rayScale[i] = rays.lodScale ? rays.lodScale[r] : 0.0f;
+            }
+
+            uint32 hitMask = raymarchPacket(packet, (1u << lanes) - 1, result, query);
+
+            for (int i = 0; i < lanes; i++) {
+                size_t r = start + i;
+                bool didHit = (hitMask & (1u << i)) != 0;
+                if (hits.hit)
+                    hits.hit[r] = didHit ? 1 : 0;
+                if (!didHit || query == QUERY_ANY_HIT)
+                    continue;
+
+                if (hits.t)        hits.t[r]        = result.t[i];
+                if (hits.material) hits.material[r] = result.material[i];
+                if (hits.x)        hits.x[r]        = result.x[i];
+                if (hits.y)        hits.y[r]        = result.y[i];
+                if (hits.z)        hits.z[r]        = result.z[i];
+                if (hits.level)    hits.level[r]    = result.level[i];
+            }
+        }
+    };
+
+    if (ThreadUtils::pool && numChunks > 1)
+        ThreadUtils::parallelFor(0, numChunks, numChunks, traceChunk);
+    else
+        for (uint32 i = 0; i < numChunks; i++)
+            traceChunk(i);
+}
@@ -24,37 +24,301 @@ freely, subject to the following restrictions:
 #ifndef VOXELOCTREE_HPP_
 #define VOXELOCTREE_HPP_
 
+#include "kernels/Traversal.hpp"
 #include "math/Vec3.hpp"
 
 #include "ChunkedAllocator.hpp"
+#include "OctreeFile.hpp"
+#include "RayPacket.hpp"
+#include "RayBatch.hpp"
 #include "IntTypes.hpp"
 
 #include <memory>
+#include <utility>
 #include <vector>
 
 class VoxelData;
+class MappedFile;
+class PageCache;
+class DagBuilder;
+struct AttributeSplit;
+struct MaterialSum;
+struct NodeRelayout;
+struct BrickConversion;
+struct RopeStorage;
 
-class VoxelOctree {
-    static const int32 MaxScale = 23;
+enum OctreeLayout {
+    /* Appends nodes as they are built and inserts far pointers afterwards.
+     * Finalizing the tree temporarily needs twice its size in memory.
+     */
+    LAYOUT_INSERTION,
+    /* Measures the tree first and then writes every node straight to its
+     * final position. Loads each cache block twice if the volume spans more
+     * than one block.
+     */
+    LAYOUT_EXACT
+};
 
+class VoxelOctree {
     uint64 _octreeSize;
+    /* Node storage owned by the octree. Uncompressed files are mapped instead,
+     * so traversal always goes through _nodes, which points to either one */
     std::unique_ptr<uint32[]> _octree;
+    std::unique_ptr<MappedFile> _mapping;
+    const uint32 *_nodes;
+    /* Set instead of _nodes if the octree is paged in from disk on demand */
+    std::unique_ptr<PageCache> _pages;
+
+    /* Octrees converted to a DAG store their nodes in a different layout,
+     * followed by the leaf materials, see convertToDag */
+    bool _isDag;
+    uint32 _dagRoot;
+    uint64 _attributeOffset;
+    AttributeLayout _attributes;
+    /* Interior nodes carry averaged materials of their subtrees, see
+     * prefilterAttributes */
+    bool _prefiltered;
+    /* Some nodes above the leaves are replaced by bricks, see convertToBricks */
+    bool _bricks;
+    /* False if no descriptor uses far pointers, so that rays can be traced
+     * without checking for them, see updateFarPointers */
+    bool _farPointers;
+    /* Neighbor links of all interior nodes, or null, see buildRopes */
+    std::unique_ptr<RopeStorage> _ropes;
+    /* Optional, see buildTopGrid */
+    std::unique_ptr<OctreeTopGrid> _topGrid;
 
     VoxelData *_voxels;
     Vec3 _center;
 
+    /* Subtrees of one cache block that were built in parallel, in the order
+     * in which buildOctree visits them. Only used during construction.
+     */
+    struct Subtree {
+        int x, y, z;
+        uint64 size;
+        std::unique_ptr<uint32[]> data;
+
+        /* Exact layout only: far pointer flags of the subtree during measuring
+         * and its final position during writing */
+        std::vector<bool> farFlags;
+        uint64 descriptorIndex, offset;
+        size_t flagOffset;
+    };
+    std::vector<Subtree> _subtrees;
+    size_t _nextSubtree;
+    int _subtreeSize;
+
+    /* Size and number of far pointer flags of every parallel subtree measured
+     * by measureOctree, in traversal order */
+    std::vector<std::pair<uint64, size_t>> _subtreeExtents;
+    size_t _nextExtent;
+
+    bool splitsIntoSubtrees(int size) const;
+
     uint64 buildOctree(ChunkedAllocator<uint32> &allocator, int x, int y, int z, int size, uint64 descriptorIndex);
+    void collectSubtrees(int x, int y, int z, int size, int subtreeSize);
+    void buildSubtrees(int x, int y, int z, int size);
+    uint64 spliceSubtree(ChunkedAllocator<uint32> &allocator, uint64 descriptorIndex);
+
+    void buildExactLayout();
+    uint64 measureOctree(int x, int y, int z, int size, std::vector<bool> &farFlags);
+    void measureSubtrees(int x, int y, int z, int size);
+    template<typename Output>
+    uint64 writeOctree(Output &output, int x, int y, int z, int size, uint64 descriptorIndex, uint64 &offset,
+            size_t &flagIndex, const std::vector<bool> &farFlags);
+    template<typename Output>
+    void writeSubtrees(Output &output, const std::vector<bool> &farFlags);
+    template<typename Output>
+    void writeLayout(Output &output, const std::vector<bool> &farFlags);
+    uint64 firstLeafMaterial(uint64 descriptorIndex, uint32 descriptor) const;
+    void splitLeafParents(AttributeSplit &split, uint64 sourceIndex, uint32 count, uint32 stride);
+    uint64 splitSubtree(AttributeSplit &split, uint64 sourceIndex, uint64 descriptorIndex);
+    uint64 prefilterSubtree(ChunkedAllocator<uint32> &allocator, uint64 sourceIndex, uint64 descriptorIndex, MaterialSum &sum);
+    uint32 mergeSubtree(DagBuilder &builder, uint64 descriptorIndex, uint64 &leafCount);
+    std::unique_ptr<uint32[]> dropDagLeafCounts(uint64 &geometrySize) const;
+    uint64 brickSubtree(BrickConversion &conversion, uint64 sourceIndex, uint64 descriptorIndex);
+    bool appendBrick(BrickConversion &conversion, uint64 sourceIndex, uint64 &octreeWords) const;
+    bool fillBrick(uint64 sourceIndex, int level, uint32 voxel, uint32 *masks, uint32 *materials,
+            uint64 &octreeWords) const;
+    bool hasBrickChildren(uint32 descriptor) const;
+    bool hasChildDescriptors(uint64 nodeIndex, uint32 descriptor) const;
+    uint64 childArraySize(uint64 nodeIndex, uint32 descriptor, bool far) const;
+    void orderChildArrays(NodeRelayout &relayout);
+    void updateFarPointers();
+    OctreeView view() const;
+
+    VoxelOctree();
+
+    bool load(const char *path);
+    bool loadLegacy(const char *path);
+    void unload();
+    void readDagHeader();
 
 public:
     VoxelOctree(const char *path);
-    VoxelOctree(VoxelData *voxels);
+    /* Keeps at most cacheSize bytes of the octree in memory and loads the
+     * rest on demand while rendering. Rays that need a node that has not
+     * been loaded yet stop at the deepest resident level and report
+     * material 0, like rays stopped by the LOD scale. Legacy files and files
+     * whose block size is not a power of two are loaded completely instead.
+     */
+    VoxelOctree(const char *path, size_t cacheSize);
+    VoxelOctree(VoxelData *voxels, OctreeLayout layout = LAYOUT_INSERTION);
+
+    /* Builds an octree with the exact layout and writes it to path without
+     * ever holding all of it in memory. Besides the voxel data, only about
+     * memoryBudget bytes of the octree are kept in memory, plus the nodes of
+     * one cache block and one file block when saving.
+     */
+    static bool buildToFile(VoxelData *voxels, const char *path, size_t memoryBudget, bool compress = true,
+            uint64 blockSize = OctreeFile::DefaultBlockSize);
 
-    void save(const char *path);
+    ~VoxelOctree();
+
+    /* Turns the octree into a directed acyclic graph by merging subtrees
+     * that are identical or mirror images of each other. Leaf materials move
+     * into a separate array indexed by the position of the leaf in depth
+     * first order, so shared geometry still finds the right material. Fails
+     * for paged octrees and if the DAG would need more than 2^29 words or
+     * 2^32 leaves.
+     */
+    bool convertToDag();
+    /* Moves the leaf materials into one array behind the nodes, or drops
+     * them for octrees that are only used for collision or visibility
+     * queries. Materials cannot be interleaved again once moved, and DAGs
+     * can only drop theirs. Fails for paged octrees.
+     */
+    bool convertAttributes(AttributeLayout layout);
+    /* Stores the average normal and shade of every interior node next to
+     * its descriptor, so that rays stopped by their LOD scale report a
+     * material that represents the subtree they stopped at. Only works for
+     * octrees with interleaved materials that are completely in memory.
+     * Converting the octree to a DAG or moving its materials drops the
+     * averaged materials again.
+     */
+    bool prefilterAttributes();
+    /* Replaces the nodes three levels above the leaves, and everything
+     * below them, by bricks of 8^3 voxels that hold a 512 bit occupancy mask
+     * followed by the materials of the set voxels, see BrickLevels. Rays
+     * walk a brick voxel by voxel, testing one bit per step, instead of
+     * descending through its nodes. Each group of siblings only becomes
+     * bricks if that takes less space than their nodes, so the octree never
+     * grows. Hits may differ from the octree for rays that pass within a
+     * rounding error of a voxel edge. Only works for octrees with interleaved
+     * materials that are completely in memory, and fails if the result needs
+     * more than 2^32 words. Octrees with bricks cannot be converted any
+     * further, except for relayout.
+     */
+    bool convertToBricks();
+    /* Reorders the nodes so that the upper levels of every subtree share
+     * cache lines, see NodeRelayout. The node format stays the same, so
+     * relaid out octrees are read and traversed like any other. Does not
+     * work for DAGs and paged octrees, and has to be repeated after any of
+     * the conversions above.
+     */
+    bool relayout();
+
+    /* Uncompressed files are larger, but are memory mapped when loaded.
+     * blockSize is in words, see OctreeFile; paged octrees are loaded one
+     * block at a time */
+    void save(const char *path, bool compress = true, uint64 blockSize = OctreeFile::DefaultBlockSize);
     bool raymarch(const Vec3 &o, const Vec3 &d, float rayScale, uint32 &normal, float &t);
+    /* Only reports hits with tMin <= t <= tMax. Stops early at nodes whose
+     * projected size falls below rayScale, i.e. once the node is smaller
+     * than t*rayScale. Such hits report the material of the node if it is a
+     * leaf or the octree is prefiltered, and material 0 otherwise.
+     */
+    bool raymarch(const Vec3 &o, const Vec3 &d, float tMin, float tMax, float rayScale, RayHit &hit,
+            RayQuery query = QUERY_CLOSEST_HIT, const EntryNode *entry = 0);
+    /* Traces all rays in activeMask together and returns the mask of rays that hit.
+     * Results are identical to calling raymarch on every ray individually.
+     */
+    uint32 raymarchPacket(const RayPacket &packet, uint32 activeMask, PacketHit &hit,
+            RayQuery query = QUERY_CLOSEST_HIT, const EntryNode *entry = 0);
+    /* Finds the deepest node whose cube contains the box from lo to hi, in
+     * the coordinates of the rays, so that rays starting inside the box can
+     * skip the descent to it. Returns false if no node below the root
+     * contains the box, or if the octree has no entry nodes, see EntryNode.
+     */
+    bool findEntryNode(const Vec3 &lo, const Vec3 &hi, EntryNode &entry) const;
+    /* Links every interior node to its neighbors, see OctreeRopes. Rays that
+     * start inside the octree, such as shadow and ambient occlusion rays
+     * leaving a surface, then move on to the next node directly instead of
+     * returning to the common ancestor. raymarch uses the links for rays
+     * without LOD scale or entry node; packets are still traced with the
+     * vectorized stack walk, which is faster than following links one ray
+     * at a time. Results are identical to the stack walk. The shadow rays of
+     * the renderer use the links if they are traced one at a time, see
+     * ShadowMode. The links take 40 bytes per interior node and are
+     * dropped by all of the conversions above. Fails for paged octrees and
+     * DAGs, whose nodes can have more than one neighbor on each face.
+     */
+    bool buildRopes();
+    /* Records which nodes of the upper six levels exist in a bit pyramid,
+     * together with the descriptors of the 64^3 nodes of the lowest of
+     * them, see OctreeTopGrid. Rays then walk the empty space near the root
+     * by testing bits and jump straight into the nodes six levels down,
+     * without reading the descriptors above them or keeping them on the
+     * stack. The grid is used by raymarch and by packets for rays without
+     * LOD scale or entry node, such as those of -query and the rays of the
+     * renderer that find no entry node. Results do not change. It takes about
+     * 1 MB and is dropped by all of the conversions above. Fails for paged
+     * octrees, DAGs, octrees with leaves or bricks in the upper six levels
+     * and octrees with more than 2^32 words.
+     */
+    bool buildTopGrid();
+    /* Traces an arbitrary number of independent rays. The batch is split into
+     * packets and distributed over the thread pool if one is running. Results
+     * are identical to calling raymarch on every ray individually. Any-hit
+     * queries only write the hit flags.
+     */
+    void raymarchBatch(const RayBatch &rays, HitBatch &hits, RayQuery query = QUERY_CLOSEST_HIT);
 
     Vec3 center() const {
         return _center;
     }
+
+    /* False if the file given to the constructor could not be read */
+    bool isLoaded() const {
+        return _nodes != 0 || _pages != nullptr;
+    }
+
+    bool isPaged() const {
+        return _pages != nullptr;
+    }
+
+    bool isDag() const {
+        return _isDag;
+    }
+
+    AttributeLayout attributeLayout() const {
+        return _attributes;
+    }
+
+    bool isPrefiltered() const {
+        return _prefiltered;
+    }
+
+    bool hasBricks() const {
+        return _bricks;
+    }
+
+    bool hasRopes() const {
+        return _ropes != nullptr;
+    }
+
+    bool hasTopGrid() const {
+        return _topGrid != nullptr;
+    }
+
+    /* Has to be called between frames of a paged octree, while no rays are
+     * in flight. Evicts pages that were not needed recently and returns
+     * whether the previous frame was missing any pages.
+     */
+    bool updatePages();
+    /* Blocks until all pages requested so far were loaded */
+    void waitForPages();
 };
 
 #endif /* VOXELOCTREE_HPP_ */
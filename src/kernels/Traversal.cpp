@@ -0,0 +1,66 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+/* Baseline kernels, compiled like the rest of the program */
+#include "kernels/TraversalKernels.inl"
+
+#include "PageCache.hpp"
+
+bool fetchPagedWord(PageCache *pages, uint64 idx, uint32 &value) {
+    return pages->fetch(idx, value);
+}
+
+const TraversalKernels *baselineTraversalKernels() {
+    static const TraversalKernels kernels = {ISA_BASELINE, raymarch, raymarchPacket};
+    return &kernels;
+}
+
+static const TraversalKernels *bestTraversalKernels(CpuIsa limit) {
+    typedef const TraversalKernels *(*KernelSet)();
+    static const KernelSet sets[] = {
+        avx512TraversalKernels,
+        avx2TraversalKernels,
+        sse42TraversalKernels
+    };
+
+    CpuIsa isa = detectCpuIsa();
+    for (KernelSet set : sets) {
+        const TraversalKernels *kernels = set();
+        if (kernels && kernels->isa <= isa && kernels->isa <= limit)
+            return kernels;
+    }
+    return baselineTraversalKernels();
+}
+
+static const TraversalKernels *&selectedKernels() {
+    static const TraversalKernels *kernels = bestTraversalKernels(ISA_AVX512);
+    return kernels;
+}
+
+const TraversalKernels &traversalKernels() {
+    return *selectedKernels();
+}
+
+void selectTraversalKernels(CpuIsa limit) {
+    selectedKernels() = bestTraversalKernels(limit);
+}
@@ -0,0 +1,204 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef KERNELS_TRAVERSAL_HPP_
+#define KERNELS_TRAVERSAL_HPP_
+
+#include "math/Vec3.hpp"
+
+#include "CpuFeatures.hpp"
+#include "RayPacket.hpp"
+#include "RayBatch.hpp"
+#include "IntTypes.hpp"
+
+class PageCache;
+
+enum AttributeLayout {
+    /* Leaf materials take the place of the child descriptors of the nodes
+     * above the leaves */
+    ATTRIBUTES_INTERLEAVED,
+    /* Leaf materials are stored in one array behind the nodes, so the nodes
+     * are more compact and traversals that skip the materials touch less
+     * memory */
+    ATTRIBUTES_SEPARATE,
+    /* Only the geometry is stored and every hit reports material 0 */
+    ATTRIBUTES_NONE
+};
+
+static const uint32 BitCount[] = {
+    0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    1, 2, 2, 3, 2, 3, 3, 4, 2, 3, 3, 4, 3, 4, 4, 5,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    2, 3, 3, 4, 3, 4, 4, 5, 3, 4, 4, 5, 4, 5, 5, 6,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    3, 4, 4, 5, 4, 5, 5, 6, 4, 5, 5, 6, 5, 6, 6, 7,
+    4, 5, 5, 6, 5, 6, 6, 7, 5, 6, 6, 7, 6, 7, 7, 8
+};
+
+/* DAG child pointers keep the mirror axes of the child in their top bits */
+static const int DagMirrorShift = 29;
+static const uint32 DagIndexMask = (1u << DagMirrorShift) - 1;
+
+/* Neighbor links of an octree, see VoxelOctree::buildRopes. Rays traced
+ * with them do not keep a stack: when they leave a node, they follow the link
+ * of the face they leave through and continue below the node it points to.
+ * Links point to the smallest interior node that contains the neighboring
+ * cube of the same size, or are NoNeighbor at the faces of the octree.
+ *
+ * Interior nodes are numbered breadth first. nodes holds a copy of the
+ * descriptor of every node and the number of its first non-leaf child, whose
+ * siblings follow in the order of their descriptors. The top bits of the
+ * child number hold the size of the children as the traversal counts it,
+ * from 22 for the children of the root down to 0. neighbors holds the links
+ * across the lower and upper x, y and z faces of every node, and octreeNodes
+ * the index of its descriptor in the octree, which is only needed to look up
+ * materials.
+ */
+static const int RopeScaleShift = 27;
+static const uint32 RopeIndexMask = (1u << RopeScaleShift) - 1;
+static const uint32 NoNeighbor = 0xFFFFFFFFu;
+struct RopeNode {
+    uint32 descriptor;
+    uint32 children;
+};
+struct OctreeRopes {
+    const RopeNode *nodes;
+    const uint32 *neighbors;
+    const uint64 *octreeNodes;
+};
+
+/* Dense grid over the nodes six levels below the root, see
+ * VoxelOctree::buildTopGrid. occupancy holds one bit per node for each of
+ * these levels, starting with the children of the root in byte 0, followed by
+ * the 4^3 nodes of the next level and so on. Within a level, nodes are sorted
+ * in Morton order, so that the children of a node share one byte, in which
+ * bit k of the child index is set for the upper half along axis k. Rays
+ * step through the empty nodes of these levels without reading descriptors
+ * or keeping a stack, and only enter the octree in occupied nodes of the
+ * finest level, at the descriptor given in nodes, which uses the same order.
+ * The packet traversal reads occupancy in whole words, which nodes keeps
+ * within the struct.
+ */
+static const int TopGridLevels = 6;
+static const int TopGridCells = 1 << 3*TopGridLevels;
+struct OctreeTopGrid {
+    uint8 occupancy[(TopGridCells - 1)/7];
+    uint32 nodes[TopGridCells];
+};
+
+/* Dense bricks at the bottom of an octree, see VoxelOctree::convertToBricks.
+ * A brick takes the place of a node BrickLevels levels above the leaves and
+ * of everything below it. The parent of bricks has an empty non-leaf mask and
+ * bit 16 of its descriptor set, which nodes with only leaf children do not
+ * use otherwise, and its child array holds the word index of one brick per
+ * child where leaf materials would be. A brick starts with BrickMaskWords
+ * words of occupancy, one bit per voxel, followed by the materials of the
+ * set voxels in the order of their bits. Voxel x, y, z is bit x + 8*y + 64*z,
+ * where bit 2 - k of x is bit 0 of the child index that leads to the voxel k
+ * levels below the brick, and likewise for y and z with bits 1 and 2.
+ */
+static const int BrickLevels = 3;
+static const int BrickMaskWords = (1 << 3*BrickLevels)/32;
+
+/* Everything the traversal kernels need to know about an octree. Exactly one
+ * of nodes and pages is set.
+ */
+struct OctreeView {
+    const uint32 *nodes;
+    PageCache *pages;
+    uint64 size;
+    bool isDag;
+    uint32 dagRoot;
+    uint64 attributeOffset;
+    AttributeLayout attributes;
+    bool prefiltered;
+    /* Some nodes have bricks as their leaves, see BrickLevels */
+    bool bricks;
+    /* False if no descriptor uses far pointers */
+    bool farPointers;
+    /* Optional, nodes is null if the octree has no neighbor links */
+    OctreeRopes ropes;
+    /* Optional */
+    const OctreeTopGrid *topGrid;
+};
+
+/* Node that a group of rays, such as the rays of a tile, is expected to start
+ * in, see VoxelOctree::findEntryNode. Rays traced with an entry node replay
+ * the descent to it without fetching any descriptors for as long as they
+ * would have taken the same way from the root, so results do not change.
+ * Only resident octrees that are not DAGs use entry nodes.
+ */
+static const int MaxEntryDepth = 16;
+struct EntryNode {
+    /* Number of levels below the root */
+    int depth;
+    /* Child index taken at each level, as the traversal numbers children:
+     * bit k is set for the lower half along axis k */
+    uint8 childIndex[MaxEntryDepth];
+    /* Descriptor index of every node on the way, starting with the root */
+    uint64 nodes[MaxEntryDepth + 1];
+};
+
+/* One set of traversal kernels, compiled for one instruction set. The
+ * functions behave like VoxelOctree::raymarch and raymarchPacket, and all
+ * sets return bit identical results. Internally, each set picks a variant of
+ * the traversal for the octree, the query and whether any ray has a LOD
+ * scale, so that the common cases skip the checks they do not need.
+ */
+struct TraversalKernels {
+    CpuIsa isa;
+    bool (*raymarch)(const OctreeView &view, const Vec3 &o, const Vec3 &d, float tMin, float tMax, float rayScale,
+            RayHit &hit, RayQuery query, const EntryNode *entry);
+    uint32 (*raymarchPacket)(const OctreeView &view, const RayPacket &packet, uint32 activeMask, PacketHit &hit,
+            RayQuery query, const EntryNode *entry);
+};
+
+/* Kernels of each instruction set, or null if the compiler could not build them */
+const TraversalKernels *baselineTraversalKernels();
+const TraversalKernels *sse42TraversalKernels();
+const TraversalKernels *avx2TraversalKernels();
+const TraversalKernels *avx512TraversalKernels();
+
+/* PageCache::fetch for the kernels. It is compiled for the baseline only,
+ * since the kernels of other instruction sets must not inline it */
+bool fetchPagedWord(PageCache *pages, uint64 idx, uint32 &value);
+
+/* Kernels used by all octrees. On first use, they are picked for the best
+ * instruction set of the CPU.
+ */
+const TraversalKernels &traversalKernels();
+/* Switches to the best kernels that need no more than limit, e.g. to compare
+ * instruction sets on one machine. Must not be called while rays are traced.
+ */
+void selectTraversalKernels(CpuIsa limit);
+
+#endif /* KERNELS_TRAVERSAL_HPP_ */
@@ -0,0 +1,46 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+/* Kernels for CPUs with AVX2. CMake compiles this file with the
+ * matching flags; if the compiler does not support them, the kernels are
+ * left out.
+ */
+#include "kernels/Traversal.hpp"
+
+#if defined(CPU_X86) && defined(__AVX2__)
+
+#define TRAVERSAL_POPCNT
+#include "kernels/TraversalKernels.inl"
+
+const TraversalKernels *avx2TraversalKernels() {
+    static const TraversalKernels kernels = {ISA_AVX2, raymarch, raymarchPacket};
+    return &kernels;
+}
+
+#else
+
+const TraversalKernels *avx2TraversalKernels() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,1673 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+/* Traversal kernels, included by one translation unit per instruction set.
+ * The includer defines TRAVERSAL_POPCNT if the CPU is known to have POPCNT.
+ *
+ * Every function here is in an anonymous namespace, and the kernels only call
+ * functions with internal linkage or builtins. Otherwise, unless everything is
+ * inlined, as in debug builds, the linker could keep the copy of a function
+ * compiled for a newer instruction set and run it on any CPU.
+ */
+
+#include "kernels/Traversal.hpp"
+#include "math/Simd.hpp"
+
+#include "Util.hpp"
+
+namespace {
+
+static const int32 MaxScale = 23;
+
+/* Same results as std::min and std::max, including for NaNs */
+static inline float minf(float a, float b) {
+    return b < a ? b : a;
+}
+
+static inline float maxf(float a, float b) {
+    return a < b ? b : a;
+}
+
+static inline float absf(float a) {
+    return uintBitsToFloat(floatBitsToUint(a) & 0x7FFFFFFF);
+}
+
+/* Number of set bits in the lower 8 bits of the child masks */
+static inline uint32 countBits(uint32 v) {
+#if defined(TRAVERSAL_POPCNT) && defined(__GNUC__)
+    return uint32(__builtin_popcount(v));
+#elif defined(TRAVERSAL_POPCNT) && defined(_MSC_VER)
+    return __popcnt(v);
+#else
+    return BitCount[v];
+#endif
+}
+
+/* Number of set bits in a whole word */
+static inline uint32 countWordBits(uint32 v) {
+#if defined(TRAVERSAL_POPCNT) && defined(__GNUC__)
+    return uint32(__builtin_popcount(v));
+#elif defined(TRAVERSAL_POPCNT) && defined(_MSC_VER)
+    return __popcnt(v);
+#else
+    return BitCount[v & 0xFF] + BitCount[(v >> 8) & 0xFF] + BitCount[(v >> 16) & 0xFF] + BitCount[v >> 24];
+#endif
+}
+
+/* Compile time variants of the traversal. Every kernel is instantiated for
+ * each combination, so that the common cases do not carry the branches that
+ * only the general case needs.
+ */
+enum TraversalVariant {
+    /* Some ray may stop early at its LOD scale */
+    VARIANT_LOD = 1,
+    /* Descriptors may use far pointers */
+    VARIANT_FAR_POINTERS = 2,
+    /* Only the hit mask is reported, so materials are never looked up */
+    VARIANT_ANY_HIT = 4,
+    VARIANT_GENERAL = VARIANT_LOD | VARIANT_FAR_POINTERS
+};
+
+/* Kernels take rays in this form rather than as Vec3, whose member functions
+ * have external linkage */
+struct Ray {
+    float ox, oy, oz;
+    float dx, dy, dz;
+    float tMin, tMax, rayScale;
+    /* Optional, see EntryNode */
+    const EntryNode *entry;
+    /* Optional, see OctreeTopGrid */
+    const OctreeTopGrid *grid;
+};
+
+/* Ray in the mirrored coordinate system of raymarchNodes */
+struct MirroredRay {
+    float dTx, dTy, dTz;
+    float bTx, bTy, bTz;
+    int octantMask;
+};
+
+/* Word access for octrees that are completely in memory */
+struct ResidentWords {
+    const uint32 *words;
+
+    bool fetch(uint64 idx, uint32 &value) const {
+        value = words[idx];
+        return true;
+    }
+
+    void prefetch(uint64 idx) const {
+        prefetchMemory(words + idx);
+    }
+};
+
+struct PagedWords {
+    PageCache *pages;
+
+    bool fetch(uint64 idx, uint32 &value) const {
+        return fetchPagedWord(pages, idx, value);
+    }
+
+    /* Pages are only brought in on demand */
+    void prefetch(uint64) const {}
+};
+
+/* Node access policies for raymarchNodes. Nodes are identified by a handle,
+ * and their descriptors use the octree layout for the child and non-leaf
+ * masks in the lower 16 bits. Nodes may be stored mirrored, in which case
+ * mirror returns the axes to flip child indices along. child and leaf take
+ * child indices of the stored node and return false if a word they need is
+ * not resident. Attributes selects where leaf materials are looked up.
+ * prefetch hints that the children of a node are about to be visited.
+ * Octree nodes may skip the checks for far pointers if FarPointers is false.
+ * entryNode and gridNode return a node on the way to an EntryNode and the
+ * node of a top grid cell, for policies with HasEntryNodes set. Policies with
+ * HasRopes set leave nodes through neighbor links instead of a stack, and
+ * neighbor and scale return the node across a face and the scale of its
+ * children. hasBricks tells whether the leaves of a node are bricks, whose
+ * index brick looks up and whose words are read with fetch.
+ */
+template<typename Words, AttributeLayout Attributes, bool FarPointers>
+struct OctreeNodes {
+    /* Index of the descriptor */
+    typedef uint64 Node;
+
+    static const bool HasEntryNodes = true;
+    static const bool HasRopes = false;
+
+    Words words;
+    bool prefiltered;
+    bool bricks;
+
+    Node root() const {
+        return 0;
+    }
+
+    Node entryNode(const EntryNode &entry, int depth) const {
+        return entry.nodes[depth];
+    }
+
+    Node gridNode(uint32 node) const {
+        return node;
+    }
+
+    bool neighbor(Node, int, Node &) const {
+        return false;
+    }
+
+    int scale(Node) const {
+        return MaxScale - 1;
+    }
+
+    int mirror(Node) const {
+        return 0;
+    }
+
+    bool hasBricks(uint32 descriptor) const {
+        return bricks && (descriptor & 0x10000) != 0;
+    }
+
+    bool fetch(uint64 idx, uint32 &value) const {
+        return words.fetch(idx, value);
+    }
+
+    bool descriptor(Node node, uint32 &descriptor) {
+        return words.fetch(node, descriptor);
+    }
+
+    bool childOffset(Node node, uint32 descriptor, uint64 &offset) {
+        offset = descriptor >> 18;
+        if (FarPointers && (descriptor & 0x20000)) {
+            uint32 farOffset;
+            if (!words.fetch(node + 1, farOffset))
+                return false;
+            offset = (offset << 32) | uint64(farOffset);
+        }
+        return true;
+    }
+
+    bool child(Node node, uint32 descriptor, int childIndex, Node &child, uint32 &childDescriptor) {
+        uint64 offset;
+        if (!childOffset(node, descriptor, offset))
+            return false;
+
+        uint32 siblingCount = countBits((descriptor << childIndex) & 127);
+        child = node + offset + siblingCount;
+        if (FarPointers && (descriptor & 0x10000))
+            child += siblingCount;
+
+        return words.fetch(child, childDescriptor);
+    }
+
+    bool leaf(Node node, uint32 descriptor, int childIndex, uint32 &material) {
+        if (Attributes == ATTRIBUTES_NONE) {
+            material = 0;
+            return true;
+        }
+
+        uint32 leafIndex = countBits(((descriptor >> 8) << childIndex) & 127);
+        if (Attributes == ATTRIBUTES_SEPARATE) {
+            uint64 baseIndex = node + ((descriptor >> 24) & 7) + 1;
+            uint32 baseLow, baseHigh;
+            if (!words.fetch(baseIndex, baseLow) || !words.fetch(baseIndex + 1, baseHigh))
+                return false;
+            uint64 base = (uint64(baseHigh) << 32) | uint64(baseLow);
+            return words.fetch(base + ((descriptor >> 18) & 63) + leafIndex, material);
+        }
+
+        uint64 offset;
+        if (!childOffset(node, descriptor, offset))
+            return false;
+
+        return words.fetch(node + offset + leafIndex, material);
+    }
+
+    /* Brick indices are stored like interleaved materials */
+    bool brick(Node node, uint32 descriptor, int childIndex, uint64 &brick) {
+        uint64 offset;
+        uint32 index;
+        if (!childOffset(node, descriptor, offset) ||
+                !words.fetch(node + offset + countBits(((descriptor >> 8) << childIndex) & 127), index))
+            return false;
+        brick = index;
+        return true;
+    }
+
+    /* Far offsets would need another fetch, and leaf materials are only read
+     * once a ray actually hits, so only near descriptor arrays are prefetched
+     */
+    void prefetch(Node node, uint32 descriptor) {
+        if ((descriptor & 0xFF) && !(FarPointers && (descriptor & 0x20000)))
+            words.prefetch(node + (descriptor >> 18));
+    }
+
+    /* Material of a child that a ray stops at because of its LOD scale.
+     * Bricks are never prefiltered, so they report material 0 like interior
+     * nodes */
+    bool lod(Node node, uint32 descriptor, int childIndex, uint32 &material) {
+        if (!((descriptor << childIndex) & 0x80) && !hasBricks(descriptor))
+            return leaf(node, descriptor, childIndex, material);
+        if (!prefiltered) {
+            material = 0;
+            return true;
+        }
+
+        uint64 offset;
+        if (!childOffset(node, descriptor, offset))
+            return false;
+
+        uint32 childCount = countBits(descriptor & 0xFF);
+        uint64 averages = node + offset + ((FarPointers && (descriptor & 0x10000)) ? 2*childCount : childCount);
+        return words.fetch(averages + countBits((descriptor << childIndex) & 127), material);
+    }
+};
+
+template<typename Words, AttributeLayout Attributes>
+struct DagNodes {
+    struct Node {
+        uint32 index;
+        /* Leaf ordinal of the first leaf below the node */
+        uint32 attributes;
+        uint32 mirror;
+    };
+
+    static const bool HasEntryNodes = false;
+    static const bool HasRopes = false;
+
+    Words words;
+    uint32 rootPointer;
+    uint64 attributeOffset;
+
+    Node root() const {
+        Node node = {rootPointer & DagIndexMask, 0, rootPointer >> DagMirrorShift};
+        return node;
+    }
+
+    Node entryNode(const EntryNode &, int) const {
+        return root();
+    }
+
+    Node gridNode(uint32) const {
+        return root();
+    }
+
+    bool neighbor(const Node &, int, Node &) const {
+        return false;
+    }
+
+    int scale(const Node &) const {
+        return MaxScale - 1;
+    }
+
+    int mirror(const Node &node) const {
+        return int(node.mirror);
+    }
+
+    bool hasBricks(uint32) const {
+        return false;
+    }
+
+    bool fetch(uint64 idx, uint32 &value) const {
+        return words.fetch(idx, value);
+    }
+
+    bool descriptor(const Node &node, uint32 &descriptor) {
+        return words.fetch(node.index, descriptor);
+    }
+
+    bool child(const Node &node, uint32 descriptor, int childIndex, Node &child, uint32 &childDescriptor) {
+        uint32 slot = countBits((descriptor << childIndex) & 127);
+        uint32 childCount = countBits(descriptor & 0xFF);
+
+        /* DAGs without materials have no leaf counts, but the pointers
+         * are in the same place */
+        child.attributes = node.attributes;
+        if (Attributes != ATTRIBUTES_NONE && slot) {
+            uint32 leavesBefore;
+            if (!words.fetch(node.index + childCount + slot, leavesBefore))
+                return false;
+            child.attributes += leavesBefore;
+        }
+
+        uint32 pointer;
+        if (!words.fetch(node.index + 1 + slot, pointer))
+            return false;
+        child.index = pointer & DagIndexMask;
+        child.mirror = node.mirror ^ (pointer >> DagMirrorShift);
+
+        return words.fetch(child.index, childDescriptor);
+    }
+
+    bool leaf(const Node &node, uint32 descriptor, int childIndex, uint32 &material) {
+        if (Attributes == ATTRIBUTES_NONE) {
+            material = 0;
+            return true;
+        }
+        return words.fetch(attributeOffset + node.attributes + countBits(((descriptor >> 8) << childIndex) & 127), material);
+    }
+
+    bool brick(const Node &, uint32, int, uint64 &) {
+        return false;
+    }
+
+    bool lod(const Node &node, uint32 descriptor, int childIndex, uint32 &material) {
+        if (!((descriptor << childIndex) & 0x80))
+            return leaf(node, descriptor, childIndex, material);
+        material = 0;
+        return true;
+    }
+
+    /* Child pointers are read right after the descriptor, so they are
+     * usually in the same cache line already
+     */
+    void prefetch(const Node &, uint32) {}
+};
+
+/* Octree nodes with neighbor links, see OctreeRopes. Descriptors and child
+ * numbers are read from the rope nodes, and only materials from the octree.
+ */
+template<typename Words, AttributeLayout Attributes, bool FarPointers>
+struct RopeNodes {
+    /* Number of the rope node */
+    typedef uint32 Node;
+
+    static const bool HasEntryNodes = false;
+    static const bool HasRopes = true;
+
+    OctreeRopes ropes;
+    OctreeNodes<Words, Attributes, FarPointers> octree;
+
+    Node root() const {
+        return 0;
+    }
+
+    Node entryNode(const EntryNode &, int) const {
+        return 0;
+    }
+
+    Node gridNode(uint32) const {
+        return 0;
+    }
+
+    bool neighbor(Node node, int face, Node &neighbor) const {
+        neighbor = ropes.neighbors[6*node + face];
+        return neighbor != NoNeighbor;
+    }
+
+    int scale(Node node) const {
+        return int(ropes.nodes[node].children >> RopeScaleShift);
+    }
+
+    int mirror(Node) const {
+        return 0;
+    }
+
+    bool hasBricks(uint32 descriptor) const {
+        return octree.hasBricks(descriptor);
+    }
+
+    bool fetch(uint64 idx, uint32 &value) const {
+        return octree.fetch(idx, value);
+    }
+
+    bool descriptor(Node node, uint32 &descriptor) {
+        descriptor = ropes.nodes[node].descriptor;
+        return true;
+    }
+
+    bool child(Node node, uint32 descriptor, int childIndex, Node &child, uint32 &childDescriptor) {
+        child = (ropes.nodes[node].children & RopeIndexMask) + countBits((descriptor << childIndex) & 127);
+        childDescriptor = ropes.nodes[child].descriptor;
+        return true;
+    }
+
+    bool leaf(Node node, uint32 descriptor, int childIndex, uint32 &material) {
+        return octree.leaf(ropes.octreeNodes[node], descriptor, childIndex, material);
+    }
+
+    bool brick(Node node, uint32 descriptor, int childIndex, uint64 &brick) {
+        return octree.brick(ropes.octreeNodes[node], descriptor, childIndex, brick);
+    }
+
+    bool lod(Node node, uint32 descriptor, int childIndex, uint32 &material) {
+        return octree.lod(ropes.octreeNodes[node], descriptor, childIndex, material);
+    }
+
+    void prefetch(Node node, uint32 descriptor) {
+        if (descriptor & 0xFF)
+            prefetchMemory(ropes.nodes + (ropes.nodes[node].children & RopeIndexMask));
+    }
+};
+
+/* Scale of the finest level of the top grid, as the traversal counts it */
+static const int32 TopGridScale = MaxScale - TopGridLevels;
+
+/* Index of the first occupancy byte of the top grid for the children of
+ * nodes with each scale, starting with TopGridScale + 1 */
+static const uint32 TopGridOffsets[TopGridLevels] = {
+    (TopGridCells/8 - 1)/7, (TopGridCells/64 - 1)/7, (TopGridCells/512 - 1)/7,
+    (TopGridCells/4096 - 1)/7, (TopGridCells/32768 - 1)/7, 0
+};
+
+/* Walks the brick at word index brick, which takes the place of the child
+ * that the ray is about to enter at cubeX, cubeY and cubeZ, with the given
+ * scale and between minT and maxT. The ray finds the voxel it enters the
+ * brick in with the same center tests as raymarchNodes, and then steps from
+ * voxel to voxel like a grid walk, testing one bit of the occupancy mask per
+ * step. Nothing below the brick has a stack entry or a descriptor, so the
+ * walk never has to rise or descend again. Returns true and moves the cube
+ * to the voxel if the ray hits one. Otherwise, the ray leaves the brick and
+ * continues behind it. Bricks that are not resident are reported as a hit
+ * with material 0.
+ */
+template<int Variant, typename Nodes>
+bool raymarchBrick(Nodes &nodes, uint64 brick, const MirroredRay &ray, float minT, float maxT,
+        float &cubeX, float &cubeY, float &cubeZ, int &cubeScale, float &cubeScaleExp2, RayHit &hit) {
+    /* Pages hold contiguous words, so the whole mask is resident if both of
+     * its ends are */
+    uint32 first, last;
+    if (!nodes.fetch(brick, first) || !nodes.fetch(brick + BrickMaskWords - 1, last)) {
+        hit.t = minT;
+        hit.material = 0;
+        return true;
+    }
+
+    float posX = cubeX, posY = cubeY, posZ = cubeZ;
+    float scaleExp2 = cubeScaleExp2;
+    for (int level = 0; level < BrickLevels; level++) {
+        float half = scaleExp2*0.5f;
+        float cornerTX = posX*ray.dTx - ray.bTx;
+        float cornerTY = posY*ray.dTy - ray.bTy;
+        float cornerTZ = posZ*ray.dTz - ray.bTz;
+        if (half*ray.dTx + cornerTX > minT) posX += half;
+        if (half*ray.dTy + cornerTY > minT) posY += half;
+        if (half*ray.dTz + cornerTZ > minT) posZ += half;
+        scaleExp2 = half;
+    }
+
+    /* The bits of the position below the brick are the upper halves taken
+     * on the way down, which the octant mask turns into child indices */
+    const int scale = cubeScale - BrickLevels;
+    const uint32 flip = ((ray.octantMask & 1) ? 0007 : 0) | ((ray.octantMask & 2) ? 0070 : 0) |
+            ((ray.octantMask & 4) ? 0700 : 0);
+
+    uint32 bit, word;
+    while (true) {
+        float cornerTX = posX*ray.dTx - ray.bTx;
+        float cornerTY = posY*ray.dTy - ray.bTy;
+        float cornerTZ = posZ*ray.dTz - ray.bTz;
+        float maxTC = minf(cornerTX, minf(cornerTY, cornerTZ));
+
+        bit = flip ^ (
+            ((floatBitsToUint(posX) >> scale) & 7) |
+            (((floatBitsToUint(posY) >> scale) & 7) << 3) |
+            (((floatBitsToUint(posZ) >> scale) & 7) << 6));
+        word = 0;
+        nodes.fetch(brick + (bit >> 5), word);
+        if (((word >> (bit & 31)) & 1) && minT <= minf(maxT, maxTC))
+            break;
+
+        if (cornerTX <= maxTC) posX -= scaleExp2;
+        if (cornerTY <= maxTC) posY -= scaleExp2;
+        if (cornerTZ <= maxTC) posZ -= scaleExp2;
+        minT = maxTC;
+
+        /* Rays past their end cannot hit anything else in the brick */
+        if (posX < cubeX || posY < cubeY || posZ < cubeZ || !(minT <= maxT))
+            return false;
+    }
+
+    hit.t = minT;
+    hit.material = 0;
+    if (!(Variant & VARIANT_ANY_HIT)) {
+        /* Materials are packed in the order of the voxel bits */
+        uint32 rank = countWordBits(word & ((1u << (bit & 31)) - 1));
+        for (uint32 i = 0; i < bit >> 5; i++) {
+            uint32 bits = 0;
+            nodes.fetch(brick + i, bits);
+            rank += countWordBits(bits);
+        }
+        if (!nodes.fetch(brick + BrickMaskWords + rank, hit.material))
+            hit.material = 0;
+    }
+
+    cubeX = posX;
+    cubeY = posY;
+    cubeZ = posZ;
+    cubeScale = scale;
+    cubeScaleExp2 = scaleExp2;
+    return true;
+}
+
+/* Nodes is one of the node access policies above. Before descending into a
+ * child, everything needed to continue below it is fetched. If any of it is
+ * not resident, the child is reported as a hit with material 0. Variant is a
+ * combination of TraversalVariant flags.
+ */
+template<int Variant, typename Nodes>
+bool raymarchNodes(Nodes &nodes, const Ray &ray, RayHit &hit) {
+    struct StackEntry {
+        typename Nodes::Node node;
+        float maxT;
+    };
+    StackEntry rayStack[MaxScale + 1];
+
+    float ox = ray.ox, oy = ray.oy, oz = ray.oz;
+    float dx = ray.dx, dy = ray.dy, dz = ray.dz;
+
+    if (absf(dx) < 1e-4f) dx = 1e-4f;
+    if (absf(dy) < 1e-4f) dy = 1e-4f;
+    if (absf(dz) < 1e-4f) dz = 1e-4f;
+
+    float dTx = 1.0f/-absf(dx);
+    float dTy = 1.0f/-absf(dy);
+    float dTz = 1.0f/-absf(dz);
+
+    float bTx = dTx*ox;
+    float bTy = dTy*oy;
+    float bTz = dTz*oz;
+
+    uint8 octantMask = 7;
+    if (dx > 0.0f) octantMask ^= 1, bTx = 3.0f*dTx - bTx;
+    if (dy > 0.0f) octantMask ^= 2, bTy = 3.0f*dTy - bTy;
+    if (dz > 0.0f) octantMask ^= 4, bTz = 3.0f*dTz - bTz;
+
+    float minT = maxf(2.0f*dTx - bTx, maxf(2.0f*dTy - bTy, 2.0f*dTz - bTz));
+    float maxT = minf(     dTx - bTx, minf(     dTy - bTy,      dTz - bTz));
+    minT = maxf(minT, 0.0f);
+    minT = maxf(minT, ray.tMin);
+    maxT = minf(maxT, ray.tMax);
+    const float rayMaxT = maxT;
+
+    uint32 current = 0;
+    typename Nodes::Node parent = nodes.root();
+    int idx     = 0;
+    float posX  = 1.0f;
+    float posY  = 1.0f;
+    float posZ  = 1.0f;
+    int scale   = MaxScale - 1;
+
+    float scaleExp2 = 0.5f;
+
+    if (1.5f*dTx - bTx > minT) idx ^= 1, posX = 1.5f;
+    if (1.5f*dTy - bTy > minT) idx ^= 2, posY = 1.5f;
+    if (1.5f*dTz - bTz > minT) idx ^= 4, posZ = 1.5f;
+
+    /* Descends towards the entry node just like the loop below, but without
+     * fetching anything, and leaves the rest of the way to the loop as soon
+     * as it would do anything else */
+    if (Nodes::HasEntryNodes && ray.entry) {
+        for (int depth = 0; depth < ray.entry->depth; depth++) {
+            float cornerTX = posX*dTx - bTx;
+            float cornerTY = posY*dTy - bTy;
+            float cornerTZ = posZ*dTz - bTz;
+            float maxTC = minf(cornerTX, minf(cornerTY, cornerTZ));
+            float maxTV = minf(maxT, maxTC);
+
+            if ((idx ^ octantMask) != ray.entry->childIndex[depth] || !(minT <= maxT) || !(minT <= maxTV))
+                break;
+            if ((Variant & VARIANT_LOD) && maxTC*ray.rayScale >= scaleExp2)
+                break;
+
+            rayStack[scale].node = parent;
+            rayStack[scale].maxT = maxT;
+            parent = nodes.entryNode(*ray.entry, depth + 1);
+
+            float half = scaleExp2*0.5f;
+            idx = 0;
+            scale--;
+            scaleExp2 = half;
+
+            if (half*dTx + cornerTX > minT) idx ^= 1, posX += scaleExp2;
+            if (half*dTy + cornerTY > minT) idx ^= 2, posY += scaleExp2;
+            if (half*dTz + cornerTZ > minT) idx ^= 4, posZ += scaleExp2;
+
+            maxT = maxTV;
+        }
+    }
+
+    /* gridParent is the Morton code of the parent of the nodes at the
+     * current scale and gridChildren the occupancy of its children, while
+     * the ray is in the top grid. In the octree below, gridParent is the
+     * grid cell the ray entered it through. Rays that miss the octree skip
+     * the grid */
+    const OctreeTopGrid *grid = Nodes::HasEntryNodes && minT <= maxT ? ray.grid : 0;
+    uint32 gridParent = 0;
+    uint32 gridChildren = grid ? grid->occupancy[0] : 0;
+
+    while (scale < MaxScale) {
+        /* Walks the levels of the top grid just like the octree, but tests
+         * occupancy bits instead of descriptors. Since every node of the grid
+         * can be found from the position, rays that step out of a node need
+         * no stack to continue above it. Occupied cells of the finest level
+         * descend into the octree. Rays past their end have nothing left to
+         * hit */
+        if (grid && scale >= TopGridScale) {
+            float cornerTX = posX*dTx - bTx;
+            float cornerTY = posY*dTy - bTy;
+            float cornerTZ = posZ*dTz - bTz;
+            float maxTC = minf(cornerTX, minf(cornerTY, cornerTZ));
+            float maxTV = minf(rayMaxT, maxTC);
+            if (!(minT <= rayMaxT)) {
+                scale = MaxScale;
+                break;
+            }
+
+            int child = idx ^ octantMask ^ 7;
+            if (((gridChildren >> child) & 1) && minT <= maxTV) {
+                gridParent = 8*gridParent + child;
+                if (scale == TopGridScale) {
+                    parent = nodes.gridNode(grid->nodes[gridParent]);
+                    nodes.descriptor(parent, current);
+                    nodes.prefetch(parent, current);
+                } else {
+                    gridChildren = grid->occupancy[TopGridOffsets[scale - 1 - TopGridScale] + gridParent];
+                }
+
+                float half = scaleExp2*0.5f;
+                idx = 0;
+                scale--;
+                scaleExp2 = half;
+
+                if (half*dTx + cornerTX > minT) idx ^= 1, posX += scaleExp2;
+                if (half*dTy + cornerTY > minT) idx ^= 2, posY += scaleExp2;
+                if (half*dTz + cornerTZ > minT) idx ^= 4, posZ += scaleExp2;
+
+                maxT = maxTV;
+                continue;
+            }
+
+            uint32 differingBits = 0;
+            if (cornerTX <= maxTC) differingBits |= floatBitsToUint(posX) ^ floatBitsToUint(posX - scaleExp2), posX -= scaleExp2;
+            if (cornerTY <= maxTC) differingBits |= floatBitsToUint(posY) ^ floatBitsToUint(posY - scaleExp2), posY -= scaleExp2;
+            if (cornerTZ <= maxTC) differingBits |= floatBitsToUint(posZ) ^ floatBitsToUint(posZ - scaleExp2), posZ -= scaleExp2;
+            minT = maxTC;
+
+            if (posX < 1.0f || posY < 1.0f || posZ < 1.0f) {
+                scale = MaxScale;
+                break;
+            }
+
+            int nextScale = (floatBitsToUint((float)differingBits) >> 23) - 127;
+            if (nextScale > scale) {
+                gridParent >>= 3*(nextScale - scale);
+                gridChildren = grid->occupancy[TopGridOffsets[nextScale - TopGridScale] + gridParent];
+                scale = nextScale;
+                scaleExp2 = uintBitsToFloat((scale - MaxScale + 127) << 23);
+            }
+
+            int shX = floatBitsToUint(posX) >> scale;
+            int shY = floatBitsToUint(posY) >> scale;
+            int shZ = floatBitsToUint(posZ) >> scale;
+            posX = uintBitsToFloat(shX << scale);
+            posY = uintBitsToFloat(shY << scale);
+            posZ = uintBitsToFloat(shZ << scale);
+            idx = (shX & 1) | ((shY & 1) << 1) | ((shZ & 1) << 2);
+            continue;
+        }
+
+        /* Nodes on the stack were fetched before, so they are still resident */
+        if (current == 0)
+            nodes.descriptor(parent, current);
+
+        float cornerTX = posX*dTx - bTx;
+        float cornerTY = posY*dTy - bTy;
+        float cornerTZ = posZ*dTz - bTz;
+        float maxTC = minf(cornerTX, minf(cornerTY, cornerTZ));
+
+        int childShift = idx ^ octantMask ^ nodes.mirror(parent);
+        uint32 childMasks = current << childShift;
+
+        if ((childMasks & 0x8000) && minT <= maxT) {
+            if ((Variant & VARIANT_LOD) && maxTC*ray.rayScale >= scaleExp2) {
+                hit.t = maxTC;
+                if (!nodes.lod(parent, current, childShift, hit.material))
+                    hit.material = 0;
+                break;
+            }
+
+            float maxTV = minf(maxT, maxTC);
+            float half = scaleExp2*0.5f;
+            float centerTX = half*dTx + cornerTX;
+            float centerTY = half*dTy + cornerTY;
+            float centerTZ = half*dTz + cornerTZ;
+
+            if (minT <= maxTV && !(childMasks & 0x80) && nodes.hasBricks(current)) {
+                /* Rays that miss every voxel of a brick go on as if the
+                 * child was empty */
+                MirroredRay mirrored = {dTx, dTy, dTz, bTx, bTy, bTz, octantMask};
+                uint64 brick;
+                if (!nodes.brick(parent, current, childShift, brick)) {
+                    hit.t = minT;
+                    hit.material = 0;
+                    break;
+                }
+                /* The walk gets copies of the cube, so that the loop can keep
+                 * its own in registers */
+                float cubeX = posX, cubeY = posY, cubeZ = posZ, cubeScaleExp2 = scaleExp2;
+                int cubeScale = scale;
+                if (raymarchBrick<Variant>(nodes, brick, mirrored, minT, maxTV,
+                        cubeX, cubeY, cubeZ, cubeScale, cubeScaleExp2, hit)) {
+                    posX = cubeX;
+                    posY = cubeY;
+                    posZ = cubeZ;
+                    scale = cubeScale;
+                    scaleExp2 = cubeScaleExp2;
+                    break;
+                }
+            } else if (minT <= maxTV) {
+                if (!(childMasks & 0x80)) {
+                    hit.t = minT;
+                    if (!nodes.leaf(parent, current, childShift, hit.material))
+                        hit.material = 0;
+                    break;
+                }
+
+                typename Nodes::Node child;
+                uint32 childDescriptor;
+                if (!nodes.child(parent, current, childShift, child, childDescriptor)) {
+                    hit.t = minT;
+                    hit.material = 0;
+                    break;
+                }
+                /* The children of the child are needed after a few steps at most,
+                 * so their load overlaps with the work until then
+                 */
+                nodes.prefetch(child, childDescriptor);
+
+                if (!Nodes::HasRopes) {
+                    rayStack[scale].node = parent;
+                    rayStack[scale].maxT = maxT;
+                }
+                parent = child;
+
+                idx = 0;
+                scale--;
+                scaleExp2 = half;
+
+                if (centerTX > minT) idx ^= 1, posX += scaleExp2;
+                if (centerTY > minT) idx ^= 2, posY += scaleExp2;
+                if (centerTZ > minT) idx ^= 4, posZ += scaleExp2;
+
+                maxT = maxTV;
+                current = childDescriptor;
+
+                continue;
+            }
+        }
+
+        int stepMask = 0;
+        if (cornerTX <= maxTC) stepMask ^= 1, posX -= scaleExp2;
+        if (cornerTY <= maxTC) stepMask ^= 2, posY -= scaleExp2;
+        if (cornerTZ <= maxTC) stepMask ^= 4, posZ -= scaleExp2;
+
+        minT = maxTC;
+        idx ^= stepMask;
+
+        if ((idx & stepMask) != 0 && Nodes::HasRopes) {
+            /* Instead of returning to the common ancestor, follows the links
+             * of the faces the ray leaves through until it is in a node that
+             * contains the next cube. Rays past their end have nothing left
+             * to hit, and would otherwise walk on through the whole octree */
+            typename Nodes::Node node = parent;
+            int nodeScale = minT <= rayMaxT ? scale : MaxScale;
+            uint32 pos[] = {floatBitsToUint(posX), floatBitsToUint(posY), floatBitsToUint(posZ)};
+            int differingBits = 0;
+            for (int axis = 0; axis < 3 && nodeScale < MaxScale; axis++) {
+                if (!(stepMask & (1 << axis)))
+                    continue;
+                uint32 axisBits = pos[axis] ^ floatBitsToUint(uintBitsToFloat(pos[axis]) + scaleExp2);
+                differingBits |= axisBits;
+                if (!(axisBits >> (nodeScale + 1)))
+                    continue;
+                /* The ray moves towards the lower face in mirrored coordinates */
+                int face = 2*axis + 1 - ((octantMask >> axis) & 1);
+                nodeScale = nodes.neighbor(node, face, node) ? nodes.scale(node) : MaxScale;
+            }
+            if (nodeScale >= MaxScale) {
+                scale = MaxScale;
+                break;
+            }
+
+            /* The stack walk would return to the common ancestor and find its
+             * way down to the node by testing the centers of the cubes on the
+             * way. For rays that pass within a rounding error of an edge, these
+             * tests can disagree with the position, or put the ray behind the
+             * exit of a cube, and the stack walk continues elsewhere. Such rays
+             * descend from the root along the position instead, to the common
+             * ancestor that the stack walk returns to */
+            int commonScale = int(floatBitsToUint(float(differingBits)) >> 23) - 127;
+            for (int s = commonScale; s > nodeScale; s--) {
+                uint32 cubeMask = ~((1u << s) - 1);
+                float cubeTX = uintBitsToFloat(pos[0] & cubeMask)*dTx - bTx;
+                float cubeTY = uintBitsToFloat(pos[1] & cubeMask)*dTy - bTy;
+                float cubeTZ = uintBitsToFloat(pos[2] & cubeMask)*dTz - bTz;
+                bool agrees = minT <= minf(cubeTX, minf(cubeTY, cubeTZ));
+                if (agrees && s - 1 > nodeScale) {
+                    float half = uintBitsToFloat((s - 1 - MaxScale + 127) << 23);
+                    uint32 halfBit = 1u << (s - 1);
+                    agrees = (half*dTx + cubeTX > minT) == ((pos[0] & halfBit) != 0) &&
+                             (half*dTy + cubeTY > minT) == ((pos[1] & halfBit) != 0) &&
+                             (half*dTz + cubeTZ > minT) == ((pos[2] & halfBit) != 0);
+                }
+                if (agrees)
+                    continue;
+
+                node = nodes.root();
+                for (int level = MaxScale - 1; level > commonScale; level--) {
+                    int childIdx = ((pos[0] >> level) & 1) | (((pos[1] >> level) & 1) << 1) | (((pos[2] >> level) & 1) << 2);
+                    uint32 descriptor, childDescriptor;
+                    nodes.descriptor(node, descriptor);
+                    nodes.child(node, descriptor, childIdx ^ octantMask, node, childDescriptor);
+                }
+                nodeScale = commonScale;
+                break;
+            }
+
+            scale = nodeScale;
+            scaleExp2 = uintBitsToFloat((scale - MaxScale + 127) << 23);
+            parent = node;
+
+            uint32 cornerMask = ~((2u << scale) - 1);
+            posX = uintBitsToFloat(pos[0] & cornerMask);
+            posY = uintBitsToFloat(pos[1] & cornerMask);
+            posZ = uintBitsToFloat(pos[2] & cornerMask);
+            float cornerTX = posX*dTx - bTx;
+            float cornerTY = posY*dTy - bTy;
+            float cornerTZ = posZ*dTz - bTz;
+            /* Same value as the stack would hold, since the exit of a node
+             * is never behind the exit of its ancestors */
+            maxT = minf(rayMaxT, minf(cornerTX, minf(cornerTY, cornerTZ)));
+
+            /* The stack walk picks the child of the common ancestor from the
+             * position, and the children of the nodes below it like when
+             * descending, so this does the same for the node it arrives at */
+            idx = 0;
+            if (scale == commonScale) {
+                uint32 scaleBit = 1u << scale;
+                if (pos[0] & scaleBit) idx ^= 1, posX += scaleExp2;
+                if (pos[1] & scaleBit) idx ^= 2, posY += scaleExp2;
+                if (pos[2] & scaleBit) idx ^= 4, posZ += scaleExp2;
+            } else {
+                if (scaleExp2*dTx + cornerTX > minT) idx ^= 1, posX += scaleExp2;
+                if (scaleExp2*dTy + cornerTY > minT) idx ^= 2, posY += scaleExp2;
+                if (scaleExp2*dTz + cornerTZ > minT) idx ^= 4, posZ += scaleExp2;
+            }
+
+            current = 0;
+        } else if ((idx & stepMask) != 0) {
+            int differingBits = 0;
+            if (stepMask & 1) differingBits |= floatBitsToUint(posX) ^ floatBitsToUint(posX + scaleExp2);
+            if (stepMask & 2) differingBits |= floatBitsToUint(posY) ^ floatBitsToUint(posY + scaleExp2);
+            if (stepMask & 4) differingBits |= floatBitsToUint(posZ) ^ floatBitsToUint(posZ + scaleExp2);
+            scale = (floatBitsToUint((float)differingBits) >> 23) - 127;
+            scaleExp2 = uintBitsToFloat((scale - MaxScale + 127) << 23);
+
+            /* Rays that leave a grid cell continue in the grid */
+            if (grid && scale >= TopGridScale && scale < MaxScale) {
+                gridParent >>= 3*(scale - TopGridScale + 1);
+                gridChildren = grid->occupancy[TopGridOffsets[scale - TopGridScale] + gridParent];
+            } else {
+                parent = rayStack[scale].node;
+                maxT   = rayStack[scale].maxT;
+            }
+
+            int shX = floatBitsToUint(posX) >> scale;
+            int shY = floatBitsToUint(posY) >> scale;
+            int shZ = floatBitsToUint(posZ) >> scale;
+            posX = uintBitsToFloat(shX << scale);
+            posY = uintBitsToFloat(shY << scale);
+            posZ = uintBitsToFloat(shZ << scale);
+            idx = (shX & 1) | ((shY & 1) << 1) | ((shZ & 1) << 2);
+
+            current = 0;
+        }
+    }
+
+    if (scale >= MaxScale)
+        return false;
+    if (Variant & VARIANT_ANY_HIT)
+        return true;
+
+    /* Undo the mirroring of the coordinate system to find the voxel we stopped in */
+    if ((octantMask & 1) == 0) posX = 3.0f - scaleExp2 - posX;
+    if ((octantMask & 2) == 0) posY = 3.0f - scaleExp2 - posY;
+    if ((octantMask & 4) == 0) posZ = 3.0f - scaleExp2 - posZ;
+
+    hit.x = int32((floatBitsToUint(posX) & 0x7FFFFF) >> scale);
+    hit.y = int32((floatBitsToUint(posY) & 0x7FFFFF) >> scale);
+    hit.z = int32((floatBitsToUint(posZ) & 0x7FFFFF) >> scale);
+    hit.level = MaxScale - scale;
+
+    return true;
+}
+
+/* Same as raymarchLayout, for octrees with neighbor links */
+template<int Variant, typename Words>
+bool raymarchRopes(const OctreeView &view, const Words &words, const Ray &ray, RayHit &hit) {
+    const bool FarPointers = (Variant & VARIANT_FAR_POINTERS) != 0;
+
+    if ((Variant & VARIANT_ANY_HIT) || view.attributes == ATTRIBUTES_NONE) {
+        RopeNodes<Words, ATTRIBUTES_NONE, FarPointers> nodes = {view.ropes, {words, false, view.bricks}};
+        return raymarchNodes<Variant>(nodes, ray, hit);
+    } else if (view.attributes == ATTRIBUTES_SEPARATE) {
+        RopeNodes<Words, ATTRIBUTES_SEPARATE, FarPointers> nodes = {view.ropes, {words, view.prefiltered, view.bricks}};
+        return raymarchNodes<Variant>(nodes, ray, hit);
+    }
+    RopeNodes<Words, ATTRIBUTES_INTERLEAVED, FarPointers> nodes = {view.ropes, {words, view.prefiltered, view.bricks}};
+    return raymarchNodes<Variant>(nodes, ray, hit);
+}
+
+/* Picks the node access policy for the layout of the octree. Any-hit
+ * queries never need materials, so they use the policies without them.
+ * Rays with an entry node start at it rather than following neighbor links
+ * or stepping through the top grid. Neither do rays with a LOD scale, which
+ * could stop at any of the nodes that a link or the grid skips.
+ */
+template<int Variant, typename Words>
+bool raymarchLayout(const OctreeView &view, const Words &words, const Ray &ray, RayHit &hit) {
+    const bool FarPointers = (Variant & VARIANT_FAR_POINTERS) != 0;
+
+    if (!(Variant & VARIANT_LOD) && view.ropes.nodes && !ray.entry)
+        return raymarchRopes<Variant>(view, words, ray, hit);
+
+    if (view.isDag) {
+        /* DAG descriptors have no far pointers */
+        const int DagVariant = Variant & ~VARIANT_FAR_POINTERS;
+        if ((Variant & VARIANT_ANY_HIT) || view.attributes == ATTRIBUTES_NONE) {
+            DagNodes<Words, ATTRIBUTES_NONE> nodes = {words, view.dagRoot, view.attributeOffset};
+            return raymarchNodes<DagVariant>(nodes, ray, hit);
+        }
+        DagNodes<Words, ATTRIBUTES_SEPARATE> nodes = {words, view.dagRoot, view.attributeOffset};
+        return raymarchNodes<DagVariant>(nodes, ray, hit);
+    }
+
+    Ray gridRay = ray;
+    if (!(Variant & VARIANT_LOD) && !ray.entry)
+        gridRay.grid = view.topGrid;
+
+    if ((Variant & VARIANT_ANY_HIT) || view.attributes == ATTRIBUTES_NONE) {
+        OctreeNodes<Words, ATTRIBUTES_NONE, FarPointers> nodes = {words, false, view.bricks};
+        return raymarchNodes<Variant>(nodes, gridRay, hit);
+    } else if (view.attributes == ATTRIBUTES_SEPARATE) {
+        OctreeNodes<Words, ATTRIBUTES_SEPARATE, FarPointers> nodes = {words, view.prefiltered, view.bricks};
+        return raymarchNodes<Variant>(nodes, gridRay, hit);
+    }
+    OctreeNodes<Words, ATTRIBUTES_INTERLEAVED, FarPointers> nodes = {words, view.prefiltered, view.bricks};
+    return raymarchNodes<Variant>(nodes, gridRay, hit);
+}
+
+int traversalVariant(const OctreeView &view, RayQuery query, bool lod) {
+    int variant = 0;
+    if (lod)
+        variant |= VARIANT_LOD;
+    if (view.farPointers)
+        variant |= VARIANT_FAR_POINTERS;
+    if (query == QUERY_ANY_HIT)
+        variant |= VARIANT_ANY_HIT;
+    return variant;
+}
+
+/* Paged traversals spend most of their time looking up pages, so they only
+ * come in the general variant, and ignore entry nodes
+ */
+bool raymarchRay(const OctreeView &view, const Ray &ray, int variant, RayHit &hit) {
+    if (view.pages) {
+        PagedWords words = {view.pages};
+        Ray pagedRay = ray;
+        pagedRay.entry = 0;
+        if (variant & VARIANT_ANY_HIT)
+            return raymarchLayout<VARIANT_GENERAL | VARIANT_ANY_HIT>(view, words, pagedRay, hit);
+        return raymarchLayout<VARIANT_GENERAL>(view, words, pagedRay, hit);
+    }
+
+    ResidentWords words = {view.nodes};
+    switch (variant) {
+    case 0: return raymarchLayout<0>(view, words, ray, hit);
+    case 1: return raymarchLayout<1>(view, words, ray, hit);
+    case 2: return raymarchLayout<2>(view, words, ray, hit);
+    case 3: return raymarchLayout<3>(view, words, ray, hit);
+    case 4: return raymarchLayout<4>(view, words, ray, hit);
+    case 5: return raymarchLayout<5>(view, words, ray, hit);
+    case 6: return raymarchLayout<6>(view, words, ray, hit);
+    default: return raymarchLayout<7>(view, words, ray, hit);
+    }
+}
+
+bool raymarch(const OctreeView &view, const Vec3 &o, const Vec3 &d, float tMin, float tMax, float rayScale,
+        RayHit &hit, RayQuery query, const EntryNode *entry) {
+    Ray ray = {o.x, o.y, o.z, d.x, d.y, d.z, tMin, tMax, rayScale, entry, 0};
+    return raymarchRay(view, ray, traversalVariant(view, query, rayScale != 0.0f), hit);
+}
+
+uint32 raymarchPacketScalar(const OctreeView &view, const RayPacket &packet, uint32 activeMask, int variant,
+        const EntryNode *entry, PacketHit &hit) {
+    uint32 hits = 0;
+    for (int i = 0; i < PacketWidth; i++) {
+        if (!(activeMask & (1 << i)))
+            continue;
+
+        Ray ray = {
+            packet.ox[i], packet.oy[i], packet.oz[i],
+            packet.dx[i], packet.dy[i], packet.dz[i],
+            packet.tMin[i], packet.tMax[i], packet.rayScale[i], entry, 0
+        };
+        RayHit laneHit;
+        if (raymarchRay(view, ray, variant, laneHit)) {
+            hits |= 1 << i;
+            if (variant & VARIANT_ANY_HIT)
+                continue;
+            hit.t[i] = laneHit.t;
+            hit.material[i] = laneHit.material;
+            hit.x[i] = laneHit.x;
+            hit.y[i] = laneHit.y;
+            hit.z[i] = laneHit.z;
+            hit.level[i] = laneHit.level;
+        }
+    }
+    return hits;
+}
+
+#ifdef SIMD_WIDTH
+
+/* Material of a child of a resident octree node that a ray stops at, either
+ * because the child is a leaf or because of the LOD scale. Used by the
+ * packet traversal wherever it cannot simply gather the material.
+ */
+uint32 lodMaterial(const OctreeView &view, uint64 node, uint32 descriptor, int childIndex) {
+    ResidentWords words = {view.nodes};
+    uint32 material = 0;
+    if (view.attributes == ATTRIBUTES_SEPARATE) {
+        OctreeNodes<ResidentWords, ATTRIBUTES_SEPARATE, true> nodes = {words, view.prefiltered, view.bricks};
+        nodes.lod(node, descriptor, childIndex, material);
+    } else if (view.attributes == ATTRIBUTES_INTERLEAVED) {
+        OctreeNodes<ResidentWords, ATTRIBUTES_INTERLEAVED, true> nodes = {words, view.prefiltered, view.bricks};
+        nodes.lod(node, descriptor, childIndex, material);
+    }
+    return material;
+}
+
+static inline SimdInt popCount7(SimdInt v) {
+    v = v - ((v >> 1) & SimdInt(0x55));
+    v = (v & SimdInt(0x33)) + ((v >> 2) & SimdInt(0x33));
+    return (v + (v >> 4)) & SimdInt(0x0F);
+}
+
+static const uint32 LaneMask = (1u << SIMD_WIDTH) - 1;
+
+/* Packet version of raymarch for the SIMD_WIDTH lanes of the packet starting
+ * at base. activeMask and the returned hit mask refer to these lanes only.
+ * Every lane runs exactly the same stack walk as the scalar code, but all
+ * lanes advance together and descriptors are fetched with gathers. Lanes drop
+ * out of the active mask as soon as they hit something or leave the octree.
+ * Lanes without LOD scale or entry node step through the top grid first.
+ * Variant is a combination of TraversalVariant flags, as for raymarchNodes.
+ */
+template<int Variant>
+uint32 raymarchLanes(const OctreeView &view, const RayPacket &packet, int base, uint32 activeMask,
+        const EntryNode *entry, PacketHit &hit) {
+    struct StackEntry {
+        SimdInt offset;
+        SimdFloat maxT;
+    };
+    StackEntry rayStack[MaxScale + 1];
+
+    const int *octree = reinterpret_cast<const int *>(view.nodes);
+
+    alignas(32) int laneBitsL[SIMD_WIDTH];
+    for (int i = 0; i < SIMD_WIDTH; i++)
+        laneBitsL[i] = 1 << i;
+    const SimdInt laneBits = SimdInt::load(laneBitsL);
+
+    SimdFloat ox = SimdFloat::load(packet.ox + base), oy = SimdFloat::load(packet.oy + base), oz = SimdFloat::load(packet.oz + base);
+    SimdFloat dx = SimdFloat::load(packet.dx + base), dy = SimdFloat::load(packet.dy + base), dz = SimdFloat::load(packet.dz + base);
+
+    const SimdFloat epsilon(1e-4f);
+    dx = simdSelect(simdAbs(dx) < epsilon, epsilon, dx);
+    dy = simdSelect(simdAbs(dy) < epsilon, epsilon, dy);
+    dz = simdSelect(simdAbs(dz) < epsilon, epsilon, dz);
+
+    const SimdFloat zero(0.0f);
+    SimdFloat dTx = SimdFloat(1.0f)/(zero - simdAbs(dx));
+    SimdFloat dTy = SimdFloat(1.0f)/(zero - simdAbs(dy));
+    SimdFloat dTz = SimdFloat(1.0f)/(zero - simdAbs(dz));
+
+    SimdFloat bTx = dTx*ox;
+    SimdFloat bTy = dTy*oy;
+    SimdFloat bTz = dTz*oz;
+
+    SimdInt octantMask(7);
+    SimdInt flipX = dx > zero, flipY = dy > zero, flipZ = dz > zero;
+    octantMask = octantMask ^ (flipX & SimdInt(1)) ^ (flipY & SimdInt(2)) ^ (flipZ & SimdInt(4));
+    bTx = simdSelect(flipX, SimdFloat(3.0f)*dTx - bTx, bTx);
+    bTy = simdSelect(flipY, SimdFloat(3.0f)*dTy - bTy, bTy);
+    bTz = simdSelect(flipZ, SimdFloat(3.0f)*dTz - bTz, bTz);
+
+    const SimdFloat two(2.0f);
+    SimdFloat minT = simdMax(two*dTx - bTx, simdMax(two*dTy - bTy, two*dTz - bTz));
+    SimdFloat maxT = simdMin(    dTx - bTx, simdMin(    dTy - bTy,     dTz - bTz));
+    minT = simdMax(minT, zero);
+    minT = simdMax(minT, SimdFloat::load(packet.tMin + base));
+    maxT = simdMin(maxT, SimdFloat::load(packet.tMax + base));
+    const SimdFloat rayMaxT = maxT;
+    const SimdFloat rayScale = SimdFloat::load(packet.rayScale + base);
+
+    SimdInt current(0);
+    SimdInt parent(0);
+    SimdInt idx(0);
+    SimdFloat posX(1.0f), posY(1.0f), posZ(1.0f);
+    SimdInt scale(MaxScale - 1);
+    SimdFloat scaleExp2(0.5f);
+
+    const SimdFloat threeHalves(1.5f);
+    SimdInt mX = threeHalves*dTx - bTx > minT;
+    SimdInt mY = threeHalves*dTy - bTy > minT;
+    SimdInt mZ = threeHalves*dTz - bTz > minT;
+    idx = (mX & SimdInt(1)) | (mY & SimdInt(2)) | (mZ & SimdInt(4));
+    posX = simdSelect(mX, threeHalves, posX);
+    posY = simdSelect(mY, threeHalves, posY);
+    posZ = simdSelect(mZ, threeHalves, posZ);
+
+    /* Same as in raymarchNodes. All lanes that still follow the way to the
+     * entry node are at the same level */
+    if (entry) {
+        SimdInt follow(-1);
+        for (int depth = 0; depth < entry->depth; depth++) {
+            SimdFloat cornerTX = posX*dTx - bTx;
+            SimdFloat cornerTY = posY*dTy - bTy;
+            SimdFloat cornerTZ = posZ*dTz - bTz;
+            SimdFloat maxTC = simdMin(cornerTX, simdMin(cornerTY, cornerTZ));
+            SimdFloat maxTV = simdMin(maxT, maxTC);
+
+            follow = follow & ((idx ^ octantMask) == SimdInt(entry->childIndex[depth]));
+            follow = follow & (minT <= maxT) & (minT <= maxTV);
+            if (Variant & VARIANT_LOD)
+                follow = andNot(follow, maxTC*rayScale >= scaleExp2);
+            if (!movemask(follow))
+                break;
+
+            int s = MaxScale - 1 - depth;
+            rayStack[s].offset = simdSelect(follow, parent, rayStack[s].offset);
+            rayStack[s].maxT = simdSelect(follow, maxT, rayStack[s].maxT);
+            parent = simdSelect(follow, SimdInt(int(entry->nodes[depth + 1])), parent);
+
+            SimdFloat half = scaleExp2*SimdFloat(0.5f);
+            SimdFloat centerTX = half*dTx + cornerTX;
+            SimdFloat centerTY = half*dTy + cornerTY;
+            SimdFloat centerTZ = half*dTz + cornerTZ;
+
+            idx = simdSelect(follow, SimdInt(0), idx);
+            scale = simdSelect(follow, scale - SimdInt(1), scale);
+            scaleExp2 = simdSelect(follow, half, scaleExp2);
+
+            SimdInt cX = follow & (centerTX > minT);
+            SimdInt cY = follow & (centerTY > minT);
+            SimdInt cZ = follow & (centerTZ > minT);
+            idx = idx ^ (cX & SimdInt(1)) ^ (cY & SimdInt(2)) ^ (cZ & SimdInt(4));
+            posX = simdSelect(cX, posX + half, posX);
+            posY = simdSelect(cY, posY + half, posY);
+            posZ = simdSelect(cZ, posZ + half, posZ);
+
+            maxT = simdSelect(follow, maxTV, maxT);
+        }
+    }
+
+    alignas(32) int scaleL[SIMD_WIDTH], resultL[SIMD_WIDTH];
+    alignas(32) int parentL[SIMD_WIDTH], currentL[SIMD_WIDTH], childShiftL[SIMD_WIDTH];
+    alignas(32) float tL[SIMD_WIDTH];
+
+    /* Lanes that enter a brick hand it to raymarchBrick */
+    MirroredRay mirroredL[SIMD_WIDTH];
+    if (view.bricks) {
+        alignas(32) float rayL[6][SIMD_WIDTH];
+        alignas(32) int octantMaskL[SIMD_WIDTH];
+        dTx.store(rayL[0]);
+        dTy.store(rayL[1]);
+        dTz.store(rayL[2]);
+        bTx.store(rayL[3]);
+        bTy.store(rayL[4]);
+        bTz.store(rayL[5]);
+        octantMask.store(octantMaskL);
+        for (int i = 0; i < SIMD_WIDTH; i++) {
+            MirroredRay lane = {rayL[0][i], rayL[1][i], rayL[2][i], rayL[3][i], rayL[4][i], rayL[5][i], octantMaskL[i]};
+            mirroredL[i] = lane;
+        }
+    }
+
+    /* Lanes in gridLanes walk the top grid like raymarchNodes while they are
+     * above TopGridScale, with gridParent and gridChildren as there. Lanes
+     * with a LOD scale or entry node do not use the grid, and neither do
+     * lanes that miss the octree */
+    const OctreeTopGrid *grid = !(Variant & VARIANT_LOD) && !entry ? view.topGrid : 0;
+    const int *gridOffsets = reinterpret_cast<const int *>(TopGridOffsets);
+    SimdInt gridLanes = grid ? minT <= maxT : SimdInt(0);
+    SimdInt gridParent(0);
+    SimdInt gridChildren(grid ? int(grid->occupancy[0]) : 0);
+
+    int *material = reinterpret_cast<int *>(hit.material + base);
+    float *hitT = hit.t + base;
+
+    uint32 active = activeMask & LaneMask;
+    uint32 hits = 0;
+    SimdInt fetch = andNot((SimdInt(int(active)) & laneBits) == laneBits, gridLanes);
+
+    while (active) {
+        /* Lanes in the grid take one step through it per iteration. Those
+         * that descend into the octree are fetched below and walk it in the
+         * same iteration */
+        uint32 walking = active;
+        SimdInt inGrid = gridLanes & (scale > SimdInt(TopGridScale - 1)) & ((SimdInt(int(active)) & laneBits) == laneBits);
+        if (movemask(inGrid)) {
+            SimdFloat cornerTX = posX*dTx - bTx;
+            SimdFloat cornerTY = posY*dTy - bTy;
+            SimdFloat cornerTZ = posZ*dTz - bTz;
+            SimdFloat maxTC = simdMin(cornerTX, simdMin(cornerTY, cornerTZ));
+            SimdFloat maxTV = simdMin(rayMaxT, maxTC);
+
+            SimdInt ended = andNot(inGrid, minT <= rayMaxT);
+            active &= ~movemask(ended);
+            inGrid = andNot(inGrid, ended);
+
+            SimdInt child = idx ^ octantMask ^ SimdInt(7);
+            SimdInt childBit = simdPow2(child);
+            SimdInt descend = inGrid & ((gridChildren & childBit) == childBit) & (minT <= maxTV);
+            if (movemask(descend)) {
+                gridParent = simdSelect(descend, (gridParent << 3) + child, gridParent);
+                SimdInt enter = descend & (scale == SimdInt(TopGridScale));
+                if (movemask(enter)) {
+                    parent = simdGather(reinterpret_cast<const int *>(grid->nodes), gridParent, enter, parent);
+                    fetch = fetch | enter;
+                }
+                SimdInt deeper = andNot(descend, enter);
+                if (movemask(deeper)) {
+                    SimdInt offset = simdGather(gridOffsets, scale - SimdInt(TopGridScale + 1), deeper, SimdInt(0));
+                    gridChildren = simdGatherBytes(grid->occupancy, offset + gridParent, deeper, gridChildren);
+                }
+
+                SimdFloat half = scaleExp2*SimdFloat(0.5f);
+                SimdFloat centerTX = half*dTx + cornerTX;
+                SimdFloat centerTY = half*dTy + cornerTY;
+                SimdFloat centerTZ = half*dTz + cornerTZ;
+
+                idx = simdSelect(descend, SimdInt(0), idx);
+                scale = simdSelect(descend, scale - SimdInt(1), scale);
+                scaleExp2 = simdSelect(descend, half, scaleExp2);
+
+                SimdInt cX = descend & (centerTX > minT);
+                SimdInt cY = descend & (centerTY > minT);
+                SimdInt cZ = descend & (centerTZ > minT);
+                idx = idx ^ (cX & SimdInt(1)) ^ (cY & SimdInt(2)) ^ (cZ & SimdInt(4));
+                posX = simdSelect(cX, posX + half, posX);
+                posY = simdSelect(cY, posY + half, posY);
+                posZ = simdSelect(cZ, posZ + half, posZ);
+
+                maxT = simdSelect(descend, maxTV, maxT);
+            }
+
+            SimdInt step = andNot(inGrid, descend);
+            if (movemask(step)) {
+                SimdInt sX = step & (cornerTX <= maxTC);
+                SimdInt sY = step & (cornerTY <= maxTC);
+                SimdInt sZ = step & (cornerTZ <= maxTC);
+                SimdInt differingBits =
+                    (sX & (asInt(posX) ^ asInt(posX - scaleExp2))) |
+                    (sY & (asInt(posY) ^ asInt(posY - scaleExp2))) |
+                    (sZ & (asInt(posZ) ^ asInt(posZ - scaleExp2)));
+                posX = simdSelect(sX, posX - scaleExp2, posX);
+                posY = simdSelect(sY, posY - scaleExp2, posY);
+                posZ = simdSelect(sZ, posZ - scaleExp2, posZ);
+                minT = simdSelect(step, maxTC, minT);
+
+                const SimdFloat one(1.0f);
+                SimdInt left = step & ((posX < one) | (posY < one) | (posZ < one));
+                active &= ~movemask(left);
+                step = andNot(step, left);
+
+                /* The parent is one level up for every level the ray rises */
+                SimdInt newScale = (asInt(toFloat(differingBits)) >> 23) - SimdInt(127);
+                SimdInt up = step & (newScale > scale);
+                if (movemask(up)) {
+                    SimdInt level = scale;
+                    SimdInt rise = up;
+                    while (movemask(rise)) {
+                        gridParent = simdSelect(rise, gridParent >> 3, gridParent);
+                        level = level + (rise & SimdInt(1));
+                        rise = up & (newScale > level);
+                    }
+                    SimdInt offset = simdGather(gridOffsets, newScale - SimdInt(TopGridScale), up, SimdInt(0));
+                    gridChildren = simdGatherBytes(grid->occupancy, offset + gridParent, up, gridChildren);
+                    scale = simdSelect(up, newScale, scale);
+                    scaleExp2 = simdSelect(up, asFloat((newScale - SimdInt(MaxScale - 127)) << 23), scaleExp2);
+                }
+
+                SimdInt scaleBit = simdPow2(scale);
+                SimdInt keepMask = andNot(SimdInt(-1), scaleBit - SimdInt(1));
+                SimdInt shX = asInt(posX), shY = asInt(posY), shZ = asInt(posZ);
+                posX = simdSelect(step, asFloat(shX & keepMask), posX);
+                posY = simdSelect(step, asFloat(shY & keepMask), posY);
+                posZ = simdSelect(step, asFloat(shZ & keepMask), posZ);
+                SimdInt newIdx =
+                    (((shX & scaleBit) == scaleBit) & SimdInt(1)) |
+                    (((shY & scaleBit) == scaleBit) & SimdInt(2)) |
+                    (((shZ & scaleBit) == scaleBit) & SimdInt(4));
+                idx = simdSelect(step, newIdx, idx);
+            }
+
+            walking = active & ~movemask(gridLanes & (scale > SimdInt(TopGridScale - 1)));
+            if (!walking)
+                continue;
+        }
+
+        current = simdGather(octree, parent, fetch, current);
+
+        SimdFloat cornerTX = posX*dTx - bTx;
+        SimdFloat cornerTY = posY*dTy - bTy;
+        SimdFloat cornerTZ = posZ*dTz - bTz;
+        SimdFloat maxTC = simdMin(cornerTX, simdMin(cornerTY, cornerTZ));
+
+        /* Equivalent to testing bit 15 of current << childShift */
+        SimdInt childShift = idx ^ octantMask;
+        SimdInt validBit = simdPow2(SimdInt(15) - childShift);
+        SimdInt live = (SimdInt(int(walking)) & laneBits) == laneBits;
+
+        SimdInt push = live & ((current & validBit) == validBit) & (minT <= maxT);
+        SimdInt lod = (Variant & VARIANT_LOD) ? push & (maxTC*rayScale >= scaleExp2) : SimdInt(0);
+        if (uint32 lodBits = movemask(lod)) {
+            if (!(Variant & VARIANT_ANY_HIT)) {
+                maxTC.store(tL);
+                parent.store(parentL);
+                current.store(currentL);
+                childShift.store(childShiftL);
+                for (int i = 0; i < SIMD_WIDTH; i++) {
+                    if (lodBits & (1 << i)) {
+                        hitT[i] = tL[i];
+                        material[i] = int(lodMaterial(view, uint32(parentL[i]), uint32(currentL[i]), childShiftL[i]));
+                    }
+                }
+            }
+            hits |= lodBits;
+            active &= ~lodBits;
+            push = andNot(push, lod);
+        }
+
+        SimdFloat maxTV = simdMin(maxT, maxTC);
+        SimdFloat half = scaleExp2*SimdFloat(0.5f);
+
+        push = push & (minT <= maxTV);
+        SimdInt down(0);
+        if (movemask(push)) {
+            /* Only the bits below the current child are counted for the
+             * sibling offsets, so a 7 bit popcount suffices */
+            SimdInt nonLeafBit = validBit >> 8;
+            SimdInt lowerMask = nonLeafBit - SimdInt(1);
+
+            SimdInt childOffset = current >> 18;
+            if (Variant & VARIANT_FAR_POINTERS) {
+                SimdInt far = push & ((current & SimdInt(0x20000)) == SimdInt(0x20000));
+                if (movemask(far))
+                    childOffset = simdGather(octree, parent + SimdInt(1), far, childOffset);
+            }
+
+            SimdInt leaf = push & ((current & nonLeafBit) == SimdInt(0));
+            SimdInt bricks = view.bricks ? leaf & ((current & SimdInt(0x10000)) == SimdInt(0x10000)) : SimdInt(0);
+            if (uint32 brickBits = movemask(bricks)) {
+                /* Each lane walks its brick with the scalar code, which takes
+                 * a few bit tests in masks of two cache lines. Lanes that hit
+                 * a voxel finish there, and the others go on as if the child
+                 * was empty */
+                SimdInt slot = parent + childOffset + popCount7((current >> 8) & lowerMask);
+                simdGather(octree, slot, bricks, SimdInt(0)).store(resultL);
+                alignas(32) float posXL[SIMD_WIDTH], posYL[SIMD_WIDTH], posZL[SIMD_WIDTH], scaleExp2L[SIMD_WIDTH];
+                alignas(32) float maxTL[SIMD_WIDTH];
+                posX.store(posXL);
+                posY.store(posYL);
+                posZ.store(posZL);
+                scaleExp2.store(scaleExp2L);
+                scale.store(scaleL);
+                minT.store(tL);
+                simdMin(maxT, maxTC).store(maxTL);
+
+                OctreeNodes<ResidentWords, ATTRIBUTES_INTERLEAVED, true> nodes = {{view.nodes}, false, true};
+                uint32 brickHits = 0;
+                for (int i = 0; i < SIMD_WIDTH; i++) {
+                    RayHit laneHit;
+                    if ((brickBits & (1 << i)) && raymarchBrick<Variant>(nodes, uint32(resultL[i]), mirroredL[i],
+                            tL[i], maxTL[i], posXL[i], posYL[i], posZL[i], scaleL[i], scaleExp2L[i], laneHit)) {
+                        brickHits |= 1 << i;
+                        if (!(Variant & VARIANT_ANY_HIT)) {
+                            hitT[i] = laneHit.t;
+                            material[i] = int(laneHit.material);
+                        }
+                    }
+                }
+
+                /* Hits report the voxel they stopped in below */
+                SimdInt hitLanes = (SimdInt(int(brickHits)) & laneBits) == laneBits;
+                posX = simdSelect(hitLanes, SimdFloat::load(posXL), posX);
+                posY = simdSelect(hitLanes, SimdFloat::load(posYL), posY);
+                posZ = simdSelect(hitLanes, SimdFloat::load(posZL), posZ);
+                scaleExp2 = simdSelect(hitLanes, SimdFloat::load(scaleExp2L), scaleExp2);
+                scale = simdSelect(hitLanes, SimdInt::load(scaleL), scale);
+                hits |= brickHits;
+                active &= ~brickHits;
+                push = andNot(push, bricks);
+                leaf = andNot(leaf, bricks);
+            }
+            if (uint32 leafBits = movemask(leaf)) {
+                if (!(Variant & VARIANT_ANY_HIT)) {
+                    if (view.attributes == ATTRIBUTES_INTERLEAVED) {
+                        SimdInt leafIndex = popCount7((current >> 8) & lowerMask);
+                        simdGather(octree, childOffset + parent + leafIndex, leaf, SimdInt(0)).store(resultL);
+                    } else {
+                        /* Each ray finds at most one leaf, so the material lookup
+                         * is not worth vectorizing */
+                        parent.store(parentL);
+                        current.store(currentL);
+                        childShift.store(childShiftL);
+                        for (int i = 0; i < SIMD_WIDTH; i++)
+                            if (leafBits & (1 << i))
+                                resultL[i] = int(lodMaterial(view, uint32(parentL[i]), uint32(currentL[i]), childShiftL[i]));
+                    }
+                    minT.store(tL);
+                    for (int i = 0; i < SIMD_WIDTH; i++) {
+                        if (leafBits & (1 << i)) {
+                            material[i] = resultL[i];
+                            hitT[i] = tL[i];
+                        }
+                    }
+                }
+                hits |= leafBits;
+                active &= ~leafBits;
+            }
+
+            down = andNot(push, leaf);
+            if (uint32 downBits = movemask(down)) {
+                scale.store(scaleL);
+                while (downBits) {
+                    int s = scaleL[findLowestBit(downBits)];
+                    SimdInt level = down & (scale == SimdInt(s));
+                    rayStack[s].offset = simdSelect(level, parent, rayStack[s].offset);
+                    rayStack[s].maxT = simdSelect(level, maxT, rayStack[s].maxT);
+                    downBits &= ~movemask(level);
+                }
+
+                SimdInt siblingCount = popCount7(current & lowerMask);
+                if (Variant & VARIANT_FAR_POINTERS) {
+                    SimdInt farChildren = (current & SimdInt(0x10000)) == SimdInt(0x10000);
+                    siblingCount = siblingCount + (siblingCount & farChildren);
+                }
+                parent = simdSelect(down, parent + childOffset + siblingCount, parent);
+
+                SimdFloat centerTX = half*dTx + cornerTX;
+                SimdFloat centerTY = half*dTy + cornerTY;
+                SimdFloat centerTZ = half*dTz + cornerTZ;
+
+                idx = simdSelect(down, SimdInt(0), idx);
+                scale = simdSelect(down, scale - SimdInt(1), scale);
+                scaleExp2 = simdSelect(down, half, scaleExp2);
+
+                SimdInt cX = down & (centerTX > minT);
+                SimdInt cY = down & (centerTY > minT);
+                SimdInt cZ = down & (centerTZ > minT);
+                idx = idx ^ (cX & SimdInt(1)) ^ (cY & SimdInt(2)) ^ (cZ & SimdInt(4));
+                posX = simdSelect(cX, posX + half, posX);
+                posY = simdSelect(cY, posY + half, posY);
+                posZ = simdSelect(cZ, posZ + half, posZ);
+
+                maxT = simdSelect(down, maxTV, maxT);
+            }
+        }
+        fetch = down;
+
+        uint32 advancing = active & walking & ~movemask(down);
+        if (!advancing)
+            continue;
+        SimdInt step = (SimdInt(int(advancing)) & laneBits) == laneBits;
+
+        SimdInt sX = step & (cornerTX <= maxTC);
+        SimdInt sY = step & (cornerTY <= maxTC);
+        SimdInt sZ = step & (cornerTZ <= maxTC);
+        posX = simdSelect(sX, posX - scaleExp2, posX);
+        posY = simdSelect(sY, posY - scaleExp2, posY);
+        posZ = simdSelect(sZ, posZ - scaleExp2, posZ);
+        SimdInt stepMask = (sX & SimdInt(1)) | (sY & SimdInt(2)) | (sZ & SimdInt(4));
+
+        minT = simdSelect(step, maxTC, minT);
+        idx = idx ^ stepMask;
+
+        SimdInt pop = andNot(step, (idx & stepMask) == SimdInt(0));
+        if (!movemask(pop))
+            continue;
+
+        SimdInt differingBits =
+            (sX & (asInt(posX) ^ asInt(posX + scaleExp2))) |
+            (sY & (asInt(posY) ^ asInt(posY + scaleExp2))) |
+            (sZ & (asInt(posZ) ^ asInt(posZ + scaleExp2)));
+        SimdInt newScale = (asInt(toFloat(differingBits)) >> 23) - SimdInt(127);
+        scale = simdSelect(pop, newScale, scale);
+        scaleExp2 = simdSelect(pop, asFloat((newScale - SimdInt(MaxScale - 127)) << 23), scaleExp2);
+
+        SimdInt scaleBit = simdPow2(newScale);
+        SimdInt keepMask = andNot(SimdInt(-1), scaleBit - SimdInt(1));
+        SimdInt shX = asInt(posX), shY = asInt(posY), shZ = asInt(posZ);
+        posX = simdSelect(pop, asFloat(shX & keepMask), posX);
+        posY = simdSelect(pop, asFloat(shY & keepMask), posY);
+        posZ = simdSelect(pop, asFloat(shZ & keepMask), posZ);
+        SimdInt newIdx =
+            (((shX & scaleBit) == scaleBit) & SimdInt(1)) |
+            (((shY & scaleBit) == scaleBit) & SimdInt(2)) |
+            (((shZ & scaleBit) == scaleBit) & SimdInt(4));
+        idx = simdSelect(pop, newIdx, idx);
+
+        SimdInt exited = pop & (scale > SimdInt(MaxScale - 1));
+        active &= ~movemask(exited);
+        pop = andNot(pop, exited);
+
+        uint32 popBits = movemask(pop);
+        scale.store(scaleL);
+        while (popBits) {
+            int s = scaleL[findLowestBit(popBits)];
+            SimdInt level = pop & (scale == SimdInt(s));
+            popBits &= ~movemask(level);
+            /* Rays that leave a grid cell continue in the grid */
+            if (grid && s >= TopGridScale) {
+                SimdInt rise = level & gridLanes;
+                gridParent = simdSelect(rise, gridParent >> 3*(s - TopGridScale + 1), gridParent);
+                gridChildren = simdGatherBytes(grid->occupancy, SimdInt(int(TopGridOffsets[s - TopGridScale])) + gridParent,
+                        rise, gridChildren);
+                pop = andNot(pop, rise);
+                level = andNot(level, rise);
+            }
+            parent = simdSelect(level, rayStack[s].offset, parent);
+            maxT = simdSelect(level, rayStack[s].maxT, maxT);
+        }
+        fetch = fetch | pop;
+    }
+
+    if (!hits || (Variant & VARIANT_ANY_HIT))
+        return hits;
+
+    /* Lanes stop updating their position and scale once they finish, so the
+     * voxel each hit stopped in can be recovered for all lanes at once */
+    const SimdFloat three(3.0f);
+    posX = simdSelect((octantMask & SimdInt(1)) == SimdInt(0), three - scaleExp2 - posX, posX);
+    posY = simdSelect((octantMask & SimdInt(2)) == SimdInt(0), three - scaleExp2 - posY, posY);
+    posZ = simdSelect((octantMask & SimdInt(4)) == SimdInt(0), three - scaleExp2 - posZ, posZ);
+
+    SimdFloat invScaleExp2 = asFloat((SimdInt(MaxScale + 127) - scale) << 23);
+    SimdInt x = toInt((posX - SimdFloat(1.0f))*invScaleExp2);
+    SimdInt y = toInt((posY - SimdFloat(1.0f))*invScaleExp2);
+    SimdInt z = toInt((posZ - SimdFloat(1.0f))*invScaleExp2);
+    SimdInt level = SimdInt(MaxScale) - scale;
+
+    SimdInt hitLanes = (SimdInt(int(hits)) & laneBits) == laneBits;
+    simdSelect(hitLanes, x, SimdInt::load(hit.x + base)).store(hit.x + base);
+    simdSelect(hitLanes, y, SimdInt::load(hit.y + base)).store(hit.y + base);
+    simdSelect(hitLanes, z, SimdInt::load(hit.z + base)).store(hit.z + base);
+    simdSelect(hitLanes, level, SimdInt::load(hit.level + base)).store(hit.level + base);
+
+    return hits;
+}
+
+uint32 raymarchLanesVariant(const OctreeView &view, const RayPacket &packet, int base, uint32 activeMask, int variant,
+        const EntryNode *entry, PacketHit &hit) {
+    switch (variant) {
+    case 0: return raymarchLanes<0>(view, packet, base, activeMask, entry, hit);
+    case 1: return raymarchLanes<1>(view, packet, base, activeMask, entry, hit);
+    case 2: return raymarchLanes<2>(view, packet, base, activeMask, entry, hit);
+    case 3: return raymarchLanes<3>(view, packet, base, activeMask, entry, hit);
+    case 4: return raymarchLanes<4>(view, packet, base, activeMask, entry, hit);
+    case 5: return raymarchLanes<5>(view, packet, base, activeMask, entry, hit);
+    case 6: return raymarchLanes<6>(view, packet, base, activeMask, entry, hit);
+    default: return raymarchLanes<7>(view, packet, base, activeMask, entry, hit);
+    }
+}
+
+#endif
+
+/* Packets are traced SIMD_WIDTH lanes at a time. Descriptor offsets are kept
+ * in 32 bit lanes, so octrees with more than 2^31 entries go through the
+ * scalar path instead, just like paged octrees and DAGs. The LOD checks are
+ * skipped if no active ray has a LOD scale.
+ */
+uint32 raymarchPacket(const OctreeView &view, const RayPacket &packet, uint32 activeMask, PacketHit &hit, RayQuery query,
+        const EntryNode *entry) {
+    bool lod = false;
+    for (int i = 0; i < PacketWidth; i++)
+        if ((activeMask & (1u << i)) && packet.rayScale[i] != 0.0f)
+            lod = true;
+    int variant = traversalVariant(view, query, lod);
+
+#ifdef SIMD_WIDTH
+    if (view.size <= uint64(0x7FFFFFFF) && !view.pages && !view.isDag) {
+        uint32 hits = 0;
+        for (int base = 0; base < PacketWidth; base += SIMD_WIDTH)
+            if (uint32 lanes = (activeMask >> base) & LaneMask)
+                hits |= raymarchLanesVariant(view, packet, base, lanes, variant, entry, hit) << base;
+        return hits;
+    }
+#endif
+    return raymarchPacketScalar(view, packet, activeMask, variant, entry, hit);
+}
+
+}
@@ -0,0 +1,47 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+/* Kernels for CPUs with SSE4.2 and POPCNT. CMake compiles this file with the
+ * matching flags; if the compiler does not support them, the kernels are
+ * left out.
+ */
+#include "kernels/Traversal.hpp"
+
+/* MSVC has no flag for SSE4.2, but allows POPCNT without one */
+#if defined(CPU_X86) && (defined(__SSE4_2__) || defined(_MSC_VER))
+
+#define TRAVERSAL_POPCNT
+#include "kernels/TraversalKernels.inl"
+
+const TraversalKernels *sse42TraversalKernels() {
+    static const TraversalKernels kernels = {ISA_SSE42, raymarch, raymarchPacket};
+    return &kernels;
+}
+
+#else
+
+const TraversalKernels *sse42TraversalKernels() {
+    return 0;
+}
+
+#endif
@@ -0,0 +1,244 @@
+/*
+Copyright (c) 2013 Benedikt Bitterli
+
+This software is provided 'as-is', without any express or implied
+warranty. In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions:
+
+   1. The origin of this software must not be misrepresented; you must not
+   claim that you wrote the original software. If you use this software
+   in a product, an acknowledgment in the product documentation would be
+   appreciated but is not required.
+
+   2. Altered source versions must be plainly marked as such, and must not be
+   misrepresented as being the original software.
+
+   3. This notice may not be removed or altered from any source
+   distribution.
+*/
+
+#ifndef MATH_SIMD_HPP_
+#define MATH_SIMD_HPP_
+
+#include "IntTypes.hpp"
+
+/* Thin wrappers around SSE2/AVX2 registers. The width is picked at compile
+ * time from the architecture flags; if neither instruction set is available,
+ * SIMD_WIDTH stays undefined and callers fall back to scalar code.
+ *
+ * The kernels include this header in translation units that are compiled for
+ * different instruction sets, so everything lives in an anonymous namespace.
+ * Otherwise the linker could pick an AVX2 copy of a function that was not
+ * inlined for code that has to run on any CPU.
+ */
+#if defined(__AVX2__)
+# include <immintrin.h>
+# define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# ifdef __SSE4_1__
+#  include <smmintrin.h>
+# endif
+# define SIMD_WIDTH 4
+#endif
+
+#ifdef SIMD_WIDTH
+
+namespace {
+
+#if SIMD_WIDTH == 8
+
+struct SimdInt {
+    __m256i v;
+
+    SimdInt() {}
+    SimdInt(__m256i a) : v(a) {}
+    SimdInt(int a) : v(_mm256_set1_epi32(a)) {}
+
+    static SimdInt load(const int *p) { return _mm256_load_si256((const __m256i *)p); }
+    void store(int *p) const { _mm256_store_si256((__m256i *)p, v); }
+};
+
+struct SimdFloat {
+    __m256 v;
+
+    SimdFloat() {}
+    SimdFloat(__m256 a) : v(a) {}
+    SimdFloat(float a) : v(_mm256_set1_ps(a)) {}
+
+    static SimdFloat load(const float *p) { return _mm256_load_ps(p); }
+    void store(float *p) const { _mm256_store_ps(p, v); }
+};
+
+static inline SimdInt operator+(SimdInt a, SimdInt b) { return _mm256_add_epi32(a.v, b.v); }
+static inline SimdInt operator-(SimdInt a, SimdInt b) { return _mm256_sub_epi32(a.v, b.v); }
+static inline SimdInt operator&(SimdInt a, SimdInt b) { return _mm256_and_si256(a.v, b.v); }
+static inline SimdInt operator|(SimdInt a, SimdInt b) { return _mm256_or_si256(a.v, b.v); }
+static inline SimdInt operator^(SimdInt a, SimdInt b) { return _mm256_xor_si256(a.v, b.v); }
+static inline SimdInt operator<<(SimdInt a, int s) { return _mm256_slli_epi32(a.v, s); }
+static inline SimdInt operator>>(SimdInt a, int s) { return _mm256_srli_epi32(a.v, s); }
+static inline SimdInt operator==(SimdInt a, SimdInt b) { return _mm256_cmpeq_epi32(a.v, b.v); }
+static inline SimdInt operator>(SimdInt a, SimdInt b) { return _mm256_cmpgt_epi32(a.v, b.v); }
+/* Returns a & ~b */
+static inline SimdInt andNot(SimdInt a, SimdInt b) { return _mm256_andnot_si256(b.v, a.v); }
+
+static inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a.v, b.v); }
+static inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a.v, b.v); }
+static inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a.v, b.v); }
+static inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a.v, b.v); }
+static inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a.v, b.v); }
+static inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a.v, b.v); }
+
+static inline SimdInt asInt(SimdFloat a) { return _mm256_castps_si256(a.v); }
+static inline SimdFloat asFloat(SimdInt a) { return _mm256_castsi256_ps(a.v); }
+static inline SimdFloat toFloat(SimdInt a) { return _mm256_cvtepi32_ps(a.v); }
+/* Truncates towards zero */
+static inline SimdInt toInt(SimdFloat a) { return _mm256_cvttps_epi32(a.v); }
+
+static inline SimdInt operator<=(SimdFloat a, SimdFloat b) { return asInt(_mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ)); }
+static inline SimdInt operator>=(SimdFloat a, SimdFloat b) { return asInt(_mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ)); }
+static inline SimdInt operator<(SimdFloat a, SimdFloat b) { return asInt(_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)); }
+static inline SimdInt operator>(SimdFloat a, SimdFloat b) { return asInt(_mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ)); }
+
+static inline int movemask(SimdInt a) { return _mm256_movemask_ps(_mm256_castsi256_ps(a.v)); }
+
+/* Lanes in mask receive base[idx], all other lanes keep src */
+static inline SimdInt simdGather(const int *base, SimdInt idx, SimdInt mask, SimdInt src) {
+    return _mm256_mask_i32gather_epi32(src.v, base, idx.v, mask.v, 4);
+}
+
+/* Lane-wise mask ? a : b. Masks are expected to be all ones or all zeros per lane */
+static inline SimdInt simdSelect(SimdInt mask, SimdInt a, SimdInt b) {
+    return _mm256_blendv_epi8(b.v, a.v, mask.v);
+}
+
+/* Lanes in mask receive the byte at base + idx, all other lanes keep src. The
+ * three bytes after it are read as well and must be accessible */
+static inline SimdInt simdGatherBytes(const uint8 *base, SimdInt idx, SimdInt mask, SimdInt src) {
+    SimdInt words = _mm256_mask_i32gather_epi32(src.v, reinterpret_cast<const int *>(base), idx.v, mask.v, 1);
+    return simdSelect(mask, words & SimdInt(0xFF), src);
+}
+
+/* 1 << a per lane, for 0 <= a < 31 */
+static inline SimdInt simdPow2(SimdInt a) {
+    return _mm256_sllv_epi32(_mm256_set1_epi32(1), a.v);
+}
+
+#else
+
+struct SimdInt {
+    __m128i v;
+
+    SimdInt() {}
+    SimdInt(__m128i a) : v(a) {}
+    SimdInt(int a) : v(_mm_set1_epi32(a)) {}
+
+    static SimdInt load(const int *p) { return _mm_load_si128((const __m128i *)p); }
+    void store(int *p) const { _mm_store_si128((__m128i *)p, v); }
+};
+
+struct SimdFloat {
+    __m128 v;
+
+    SimdFloat() {}
+    SimdFloat(__m128 a) : v(a) {}
+    SimdFloat(float a) : v(_mm_set1_ps(a)) {}
+
+    static SimdFloat load(const float *p) { return _mm_load_ps(p); }
+    void store(float *p) const { _mm_store_ps(p, v); }
+};
+
+static inline SimdInt operator+(SimdInt a, SimdInt b) { return _mm_add_epi32(a.v, b.v); }
+static inline SimdInt operator-(SimdInt a, SimdInt b) { return _mm_sub_epi32(a.v, b.v); }
+static inline SimdInt operator&(SimdInt a, SimdInt b) { return _mm_and_si128(a.v, b.v); }
+static inline SimdInt operator|(SimdInt a, SimdInt b) { return _mm_or_si128(a.v, b.v); }
+static inline SimdInt operator^(SimdInt a, SimdInt b) { return _mm_xor_si128(a.v, b.v); }
+static inline SimdInt operator<<(SimdInt a, int s) { return _mm_slli_epi32(a.v, s); }
+static inline SimdInt operator>>(SimdInt a, int s) { return _mm_srli_epi32(a.v, s); }
+static inline SimdInt operator==(SimdInt a, SimdInt b) { return _mm_cmpeq_epi32(a.v, b.v); }
+static inline SimdInt operator>(SimdInt a, SimdInt b) { return _mm_cmpgt_epi32(a.v, b.v); }
+/* Returns a & ~b */
+static inline SimdInt andNot(SimdInt a, SimdInt b) { return _mm_andnot_si128(b.v, a.v); }
+
+static inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm_add_ps(a.v, b.v); }
+static inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm_sub_ps(a.v, b.v); }
+static inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm_mul_ps(a.v, b.v); }
+static inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm_div_ps(a.v, b.v); }
+static inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm_min_ps(a.v, b.v); }
+static inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm_max_ps(a.v, b.v); }
+
+static inline SimdInt asInt(SimdFloat a) { return _mm_castps_si128(a.v); }
+static inline SimdFloat asFloat(SimdInt a) { return _mm_castsi128_ps(a.v); }
+static inline SimdFloat toFloat(SimdInt a) { return _mm_cvtepi32_ps(a.v); }
+/* Truncates towards zero */
+static inline SimdInt toInt(SimdFloat a) { return _mm_cvttps_epi32(a.v); }
+
+static inline SimdInt operator<=(SimdFloat a, SimdFloat b) { return asInt(_mm_cmple_ps(a.v, b.v)); }
+static inline SimdInt operator>=(SimdFloat a, SimdFloat b) { return asInt(_mm_cmpge_ps(a.v, b.v)); }
+static inline SimdInt operator<(SimdFloat a, SimdFloat b) { return asInt(_mm_cmplt_ps(a.v, b.v)); }
+static inline SimdInt operator>(SimdFloat a, SimdFloat b) { return asInt(_mm_cmpgt_ps(a.v, b.v)); }
+
+static inline int movemask(SimdInt a) { return _mm_movemask_ps(_mm_castsi128_ps(a.v)); }
+
+/* Lanes in mask receive base[idx], all other lanes keep src */
+static inline SimdInt simdGather(const int *base, SimdInt idx, SimdInt mask, SimdInt src) {
+    alignas(16) int i[4], m[4], r[4];
+    idx.store(i);
+    mask.store(m);
+    src.store(r);
+    return _mm_set_epi32(
+        m[3] ? base[i[3]] : r[3],
+        m[2] ? base[i[2]] : r[2],
+        m[1] ? base[i[1]] : r[1],
+        m[0] ? base[i[0]] : r[0]
+    );
+}
+
+/* Lanes in mask receive the byte at base + idx, all other lanes keep src */
+static inline SimdInt simdGatherBytes(const uint8 *base, SimdInt idx, SimdInt mask, SimdInt src) {
+    alignas(16) int i[4], m[4], r[4];
+    idx.store(i);
+    mask.store(m);
+    src.store(r);
+    return _mm_set_epi32(
+        m[3] ? base[i[3]] : r[3],
+        m[2] ? base[i[2]] : r[2],
+        m[1] ? base[i[1]] : r[1],
+        m[0] ? base[i[0]] : r[0]
+    );
+}
+
+/* Lane-wise mask ? a : b. Masks are expected to be all ones or all zeros per lane */
+static inline SimdInt simdSelect(SimdInt mask, SimdInt a, SimdInt b) {
+#ifdef __SSE4_1__
+    return _mm_blendv_epi8(b.v, a.v, mask.v);
+#else
+    return (a & mask) | andNot(b, mask);
+#endif
+}
+
+/* 1 << a per lane, for 0 <= a < 31. SSE has no per-lane shifts, so the
+ * power of two is built from float bits */
+static inline SimdInt simdPow2(SimdInt a) {
+    return toInt(asFloat((a + SimdInt(127)) << 23));
+}
+
+#endif
+
+static inline SimdFloat simdSelect(SimdInt mask, SimdFloat a, SimdFloat b) {
+    return asFloat(simdSelect(mask, asInt(a), asInt(b)));
+}
+
+static inline SimdFloat simdAbs(SimdFloat a) {
+    return asFloat(asInt(a) & SimdInt(0x7FFFFFFF));
+}
+
+}
+
+#endif
+
+#endif /* MATH_SIMD_HPP_ */